@@ -8,7 +8,36 @@
 #define VMA_IMPLEMENTATION
 #include "vk_mem_alloc.h"
 
+#include <atomic>
+#include <condition_variable>
 #include <map>
+#include <mutex>
+#include <thread>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VULKAN_SETUP_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define VULKAN_SETUP_AVX2
+#include <immintrin.h>
+#endif
 
 ////////////////////////////////////// Vulkan method declarations ///////////////////////////////////////////////////////
 
@@ -17,6 +46,18 @@ namespace
     Vulkan::Logger * g_logger = new Vulkan::Logger();
     constexpr unsigned int stagingBufferSize = 42 * 1024 * 1024;
     constexpr unsigned int uniformBufferSize = 1 * 1024 * 1024;
+    constexpr VkDeviceSize stagingAlignment = 16;
+    // without resizable BAR, the host visible part of vram on a discrete gpu is this size at most
+    constexpr VkDeviceSize smallBarHeapSize = 256 * 1024 * 1024;
+    // large images are uploaded in tiles of this size, with the upload submitted every imageUploadFlushSize bytes
+    constexpr VkDeviceSize imageTileSize = 8 * 1024 * 1024;
+    constexpr VkDeviceSize imageUploadFlushSize = 32 * 1024 * 1024;
+    // present latency is averaged, and its maximum reported, over this many frames
+    constexpr uint64_t presentLatencyWindow = 64;
+    // compressed buffer data is decompressed and submitted in windows of about this many bytes
+    constexpr VkDeviceSize decompressWindowSize = 32 * 1024 * 1024;
+    // decompression scratch a thread keeps between chunks. Scratch grown past this for a larger chunk is freed after it
+    constexpr size_t maxRetainedScratchSize = 4 * 1024 * 1024;
 }
 
 namespace Vulkan
@@ -40,7 +81,7 @@ namespace Vulkan
     bool createPipelineCache(AppDescriptor& appDesc, Context& context);
     bool createCommandPools(Context& context);
     bool recordStandardCommandBuffers(AppDescriptor& appDesc, Context& context);
-    std::vector<VkSemaphore> createSemaphores(Context& context);
+    std::vector<VkSemaphore> createSemaphores(Context& context, unsigned int count);
     bool createSemaphores(AppDescriptor& appDesc, Context& context);
     void destroySemaphores(Context& context);
     bool createDescriptorPool(Context& context, EffectDescriptor& effect);
@@ -54,7 +95,7 @@ namespace Vulkan
 
     bool createGraphicsPipeline(AppDescriptor& appDesc, Context& context, GraphicsPipelineCustomizationCallback graphicsPipelineCreationCallback, Vulkan::EffectDescriptor& effect);
     bool createComputePipeline(AppDescriptor& appDesc, Context& context, ComputePipelineCustomizationCallback computePipelineCreationCallback, Vulkan::EffectDescriptor& effect);
-    bool createBuffer(Context& context, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, BufferDescriptor& bufDesc, VmaAllocationInfo* aInfo = nullptr);
+    bool createBuffer(Context& context, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, BufferDescriptor& bufDesc, VmaAllocationInfo* aInfo = nullptr, VkMemoryPropertyFlags preferredProperties = 0);
 
     static VmaAllocator g_allocator;
 }
@@ -65,6 +106,181 @@ bool Vulkan::validationLayersEnabled = false;
 
 ///////////////////////////////////// Vulkan Helper Function ////////////////////////////////////////////////////////////
 
+namespace
+{
+    // below this the copy is likely to still be in the cache by the time it's needed, so plain stores are fine
+    constexpr size_t streamingCopyThreshold = 64 * 1024;
+
+    // copies into mapped gpu memory. Large copies into write combined memory use non-temporal stores, which go
+    // straight to memory instead of pulling every destination line into the cache first
+    void copyToMappedMemory(void* dst, const void* src, size_t amount, bool writeCombined)
+    {
+#if defined(VULKAN_SETUP_AVX2) || defined(VULKAN_SETUP_SSE2)
+        if (writeCombined && amount >= streamingCopyThreshold)
+        {
+#if defined(VULKAN_SETUP_AVX2)
+            constexpr size_t vectorSize = 32;
+#else
+            constexpr size_t vectorSize = 16;
+#endif
+            unsigned char* d = reinterpret_cast<unsigned char*>(dst);
+            const unsigned char* s = reinterpret_cast<const unsigned char*>(src);
+
+            // streaming stores need an aligned destination
+            const size_t head = (vectorSize - (reinterpret_cast<uintptr_t>(d) & (vectorSize - 1))) & (vectorSize - 1);
+            memcpy(d, s, head);
+            d += head;
+            s += head;
+            amount -= head;
+
+            for (; amount >= vectorSize * 4; amount -= vectorSize * 4, d += vectorSize * 4, s += vectorSize * 4)
+            {
+#if defined(VULKAN_SETUP_AVX2)
+                const __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s));
+                const __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 32));
+                const __m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 64));
+                const __m256i v3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + 96));
+                _mm256_stream_si256(reinterpret_cast<__m256i*>(d), v0);
+                _mm256_stream_si256(reinterpret_cast<__m256i*>(d + 32), v1);
+                _mm256_stream_si256(reinterpret_cast<__m256i*>(d + 64), v2);
+                _mm256_stream_si256(reinterpret_cast<__m256i*>(d + 96), v3);
+#else
+                const __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s));
+                const __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 16));
+                const __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 32));
+                const __m128i v3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 48));
+                _mm_stream_si128(reinterpret_cast<__m128i*>(d), v0);
+                _mm_stream_si128(reinterpret_cast<__m128i*>(d + 16), v1);
+                _mm_stream_si128(reinterpret_cast<__m128i*>(d + 32), v2);
+                _mm_stream_si128(reinterpret_cast<__m128i*>(d + 48), v3);
+#endif
+            }
+            // streaming stores are weakly ordered, so they have to be fenced before the gpu is told about the data
+            _mm_sfence();
+            memcpy(d, s, amount);
+            return;
+        }
+#endif
+        memcpy(dst, src, amount);
+    }
+
+    // threads kept for cpu work that is split up per call, like decompression and mip map filtering. They are started by
+    // the first job and stopped by shutdown, which cleanupContext calls. One job runs at a time, and tasks mustn't start
+    // jobs of their own
+    class WorkerPool
+    {
+    public:
+        WorkerPool()
+            :_numWorkers(std::max(1u, std::thread::hardware_concurrency()) - 1)
+            ,_stop(false)
+            ,_generation(0)
+            ,_task(nullptr)
+            ,_numTasks(0)
+            ,_nextTask(0)
+            ,_busy(0)
+        {
+        }
+
+        ~WorkerPool()
+        {
+            shutdown();
+        }
+
+        // the workers plus the thread calling run
+        unsigned int numThreads() const { return _numWorkers + 1; }
+
+        // waits for the job in progress and joins the workers. The next job starts them again
+        void shutdown()
+        {
+            std::lock_guard<std::mutex> runLock(_runMutex);
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _wake.notify_all();
+            for (std::thread& worker : _workers)
+                worker.join();
+            _workers.clear();
+            _stop = false;
+        }
+
+        // calls task(0) .. task(numTasks - 1) on the workers and the calling thread, and returns once they have all finished
+        void run(unsigned int numTasks, const std::function<void(unsigned int)>& task)
+        {
+            std::lock_guard<std::mutex> runLock(_runMutex);
+            if (_workers.empty())
+            {
+                for (unsigned int t = 0; t < _numWorkers; t++)
+                    _workers.emplace_back([this]() { work(); });
+            }
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _task = &task;
+                _numTasks = numTasks;
+                _nextTask = 0;
+                _generation++;
+            }
+            _wake.notify_all();
+            runTasks(task, numTasks);
+
+            // a worker that wakes up after this sees there is no job, rather than one that has gone out of scope
+            std::unique_lock<std::mutex> lock(_mutex);
+            _done.wait(lock, [this]() { return _busy == 0; });
+            _task = nullptr;
+        }
+
+    private:
+        void runTasks(const std::function<void(unsigned int)>& task, unsigned int numTasks)
+        {
+            for (unsigned int i = _nextTask++; i < numTasks; i = _nextTask++)
+                task(i);
+        }
+
+        void work()
+        {
+            uint64_t seenGeneration = 0;
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (;;)
+            {
+                _wake.wait(lock, [&]() { return _stop || _generation != seenGeneration; });
+                if (_stop)
+                    return;
+                seenGeneration = _generation;
+                if (_task == nullptr)
+                    continue;
+
+                const std::function<void(unsigned int)>& task = *_task;
+                const unsigned int numTasks = _numTasks;
+                _busy++;
+                lock.unlock();
+                runTasks(task, numTasks);
+                lock.lock();
+                if (--_busy == 0)
+                    _done.notify_all();
+            }
+        }
+
+        const unsigned int _numWorkers;
+        std::vector<std::thread> _workers;
+        std::mutex _runMutex;
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        std::condition_variable _done;
+        bool _stop;
+        uint64_t _generation;
+        const std::function<void(unsigned int)>* _task;
+        unsigned int _numTasks;
+        std::atomic<unsigned int> _nextTask;
+        unsigned int _busy;
+    };
+
+    WorkerPool& workerPool()
+    {
+        static WorkerPool pool;
+        return pool;
+    }
+}
+
 namespace Vulkan
 {
     constexpr unsigned int MAX_STAGING_BUFFER_SIZE = 2048 * 2048 * 4;
@@ -105,6 +321,18 @@ namespace
 {
     bool createCommandBuffer(Vulkan::Context& context, VkCommandPool commandPool,  VkCommandBuffer * result)
     {
+        // recycled buffers are reset implicitly when they are begun again
+        for (size_t i = context._freeCommandBuffers.size(); i > 0; i--)
+        {
+            if (context._freeCommandBuffers[i - 1]._pool == commandPool)
+            {
+                *result = context._freeCommandBuffers[i - 1]._buffer;
+                context._freeCommandBuffers[i - 1] = context._freeCommandBuffers.back();
+                context._freeCommandBuffers.pop_back();
+                return true;
+            }
+        }
+
         VkCommandBufferAllocateInfo commandBufferAllocateInfo;
         memset(&commandBufferAllocateInfo, 0, sizeof(VkCommandBufferAllocateInfo));
         commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -233,14 +461,51 @@ namespace
 
 Vulkan::Context::Context()
     :_currentFrame(0)
+    , _device(VK_NULL_HANDLE)
     , _swapChain(nullptr)
     , _pipelineCache(VK_NULL_HANDLE)
     , _allocator(nullptr)
     , _debugReportCallback(VK_NULL_HANDLE)
     , _debugUtilsCallback(VK_NULL_HANDLE)
     , _numInflightFrames(0)
+    , _lastUploadToken(0)
+    , _hasHostVisibleDeviceLocalMemory(false)
+    , _hasHostImageCopy(false)
+    , _hasExternalMemoryHost(false)
+    , _minImportedHostPointerAlignment(0)
+    , _hasTimelineSemaphore(false)
+    , _hasSynchronization2(false)
+    , _currentImageIndex(0)
+    , _frameNumber(0)
+    , _presentMode(VK_PRESENT_MODE_FIFO_KHR)
+    , _frameTimestamps(VK_NULL_HANDLE)
+{
+
+}
+
+namespace
+{
+    void destroyQueueTimelines(Vulkan::Context& context)
+    {
+        for (const Vulkan::QueueTimeline& timeline : context._timelines)
+            vkDestroySemaphore(context._device, timeline._semaphore, nullptr);
+        context._timelines.clear();
+        context._hasTimelineSemaphore = false;
+    }
+}
+
+void Vulkan::cleanupContext(Context& context)
 {
+    if (context._device != VK_NULL_HANDLE)
+    {
+        vkDeviceWaitIdle(context._device);
+        retireFinishedUploads(context);
+        processDeferredDestructions(context, true);
+        destroyQueueTimelines(context);
+    }
 
+    // the workers are shared by every context, and start again with the next job that needs them
+    workerPool().shutdown();
 }
 
 ///////////////////////////////////// Vulkan Effect Descriptor ///////////////////////////////////////////////////////////////////
@@ -595,6 +860,8 @@ Vulkan::AppDescriptor::AppDescriptor()
     :_window(nullptr)
     , _chosenPhysicalDevice(0)
     , _enableVSync(true)
+    , _presentPolicy(PresentPolicy::FromVSync)
+    , _swapChainImageCount(0)
     , _requestedNumSamples(1)
     , _actualNumSamples(1)
     , _drawableSurfaceWidth(0)
@@ -648,6 +915,50 @@ void Vulkan::BufferDescriptor::destroy()
     _memory = VK_NULL_HANDLE;
 }
 
+void Vulkan::BufferDescriptor::destroy(Vulkan::Context& context)
+{
+    const VkBuffer buffer = _buffer;
+    const VmaAllocation memory = _memory;
+    if (buffer != VK_NULL_HANDLE && memory != VK_NULL_HANDLE)
+        deferDestruction(context, [buffer, memory]() { vmaDestroyBuffer(g_allocator, buffer, memory); });
+    _buffer = VK_NULL_HANDLE;
+    _memory = VK_NULL_HANDLE;
+    _mappedData = nullptr;
+}
+
+void Vulkan::ImportedBufferDescriptor::destroy()
+{
+    if (_buffer != VK_NULL_HANDLE)
+        vkDestroyBuffer(_device, _buffer, nullptr);
+    if (_importedMemory != VK_NULL_HANDLE)
+        vkFreeMemory(_device, _importedMemory, nullptr);
+    _buffer = VK_NULL_HANDLE;
+    _importedMemory = VK_NULL_HANDLE;
+    _owner = nullptr;
+}
+
+void Vulkan::ImportedBufferDescriptor::destroy(Vulkan::Context& context)
+{
+    // the owner goes along, so the host memory outlives the import
+    const VkDevice device = _device;
+    const VkBuffer buffer = _buffer;
+    const VkDeviceMemory importedMemory = _importedMemory;
+    const std::shared_ptr<const void> owner = _owner;
+    if (buffer != VK_NULL_HANDLE || importedMemory != VK_NULL_HANDLE)
+    {
+        deferDestruction(context, [device, buffer, importedMemory, owner]() {
+            if (buffer != VK_NULL_HANDLE)
+                vkDestroyBuffer(device, buffer, nullptr);
+            if (importedMemory != VK_NULL_HANDLE)
+                vkFreeMemory(device, importedMemory, nullptr);
+        });
+    }
+    _buffer = VK_NULL_HANDLE;
+    _importedMemory = VK_NULL_HANDLE;
+    _mappedData = nullptr;
+    _owner = nullptr;
+}
+
 
 
 
@@ -655,65 +966,77 @@ bool Vulkan::BufferDescriptor::copyFrom(Vulkan::Context & context, VkCommandPool
 {
     if (_mappable)
     {
-        void* data = nullptr;
-        const VkResult mapResult = vmaMapMemory(g_allocator, _memory, &data);
-        assert(mapResult == VK_SUCCESS);
-        if (mapResult != VK_SUCCESS)
+        assert(dstOffset + amount <= _size);
+        void* data = _mappedData;
+        if (data == nullptr)
         {
-            g_logger->log(Vulkan::Logger::Level::Error, std::string("Failed to map vertex buffer memory\n"));
-            return false;
+            const VkResult mapResult = vmaMapMemory(g_allocator, _memory, &data);
+            assert(mapResult == VK_SUCCESS);
+            if (mapResult != VK_SUCCESS)
+            {
+                g_logger->log(Vulkan::Logger::Level::Error, std::string("Failed to map vertex buffer memory\n"));
+                return false;
+            }
         }
 
         unsigned char* dstData = reinterpret_cast<unsigned char*>(data);
-        void* fPointer = reinterpret_cast<void*>(dstData + dstOffset);
-        memcpy(data, srcData, amount);
-        vmaUnmapMemory(g_allocator, _memory);
+        copyToMappedMemory(dstData + dstOffset, srcData, (size_t)amount, _writeCombined);
+        // only the written range is flushed. vma rounds it to nonCoherentAtomSize, and skips coherent memory
+        vmaFlushAllocation(g_allocator, _memory, dstOffset, amount);
+
+        if (_mappedData == nullptr)
+            vmaUnmapMemory(g_allocator, _memory);
     }
     else
     {
-//         use a staging buffer to copy data
-        int64_t amountOfDataLeftToCopy = (int64_t)amount;
-        int64_t currentDstOffset = (int64_t)dstOffset;
-        int64_t srcOffset = 0;
-        while (amountOfDataLeftToCopy > 0)
-        {
-            // TODO - make this copy async, by creating a temporary buffer and then copy across, store a little struct with
-            // the temp staing buffer, the commadnbuffer and fence. Then each frame, check for completed buffers.
-            Vulkan::PersistentBufferPtr stagingBuffer = Vulkan::getPersistentStagingBuffer(context, amount);
-            const int64_t amountToCopy = std::min(amountOfDataLeftToCopy, (int64_t)stagingBuffer->_registeredSize);
+        // done when this returns, as callers may reuse the buffer or hand it to another queue straight away
+        const UploadToken token = copyFromAsync(context, commandPool, queue, srcData, amount, dstOffset);
+        if (token == 0 || !waitForUpload(context, token))
+            return false;
+    }
 
-            const char* cData = reinterpret_cast<const char*>(srcData)  + srcOffset;
-            stagingBuffer->copyFromAndFlush(context, 0, cData, amountToCopy, 0);
-            copyFromAndFlush(context, commandPool, queue, stagingBuffer->_buffers[0], amountToCopy, 0, currentDstOffset);
-            currentDstOffset += amountToCopy;
-            amountOfDataLeftToCopy -= amountToCopy;
-            srcOffset += amountToCopy;
-        }
 
+    return true;
+}
+
+Vulkan::UploadToken Vulkan::BufferDescriptor::copyFromAsync(Vulkan::Context& context, VkCommandPool commandPool, VkQueue queue, const void* srcData, VkDeviceSize amount, VkDeviceSize dstOffset)
+{
+    retireFinishedUploads(context);
+
+    // every upload gets its own slice of the staging ring, so nothing has to wait for earlier copies to finish
+    StagingAllocation staging;
+    if (!context._stagingRing.allocate(context, amount, stagingAlignment, staging))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("copyFromAsync - Failed to allocate staging memory of size ") + std::to_string(amount) + "\n");
+        return 0;
     }
+    copyToMappedMemory(staging._mappedData, srcData, (size_t)amount, staging._buffer->_writeCombined);
 
+    VkCommandBuffer commandBuffer = Vulkan::createCommandBuffer(context, commandPool, true);
 
-    return true;
+    VkBufferCopy copyRegion = {};
+    copyRegion.srcOffset = staging._offset;
+    copyRegion.dstOffset = dstOffset;
+    copyRegion.size = amount;
+    vkCmdCopyBuffer(commandBuffer, staging._buffer->_buffer, _buffer, 1, &copyRegion);
+
+    const VkResult endCommandBufferResult = vkEndCommandBuffer(commandBuffer);
+    assert(endCommandBufferResult == VK_SUCCESS);
+
+    const UploadToken token = submitUpload(context, queue, commandPool, commandBuffer, nullptr);
+    context._stagingRing.commit(staging, token);
+    if (token != 0)
+        _lastUploadToken = token;
+    return token;
 }
 
 bool Vulkan::BufferDescriptor::copyFromAndFlush(Vulkan::Context& context, VkCommandPool commandPool, VkQueue queue, BufferDescriptor & src, VkDeviceSize amount, VkDeviceSize srcOffset, VkDeviceSize dstOffset)
 {
-    VkCommandBufferAllocateInfo allocInfo = {};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandPool = commandPool;
-    allocInfo.commandBufferCount = 1;
-    
-    VkCommandBuffer commandBuffer;
-    const VkResult allocationResult = vkAllocateCommandBuffers(context._device, &allocInfo, &commandBuffer);
-	assert(allocationResult == VK_SUCCESS);
-    
-    VkCommandBufferBeginInfo beginInfo = {};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    
-    const VkResult beginCommandBufferResult = vkBeginCommandBuffer(commandBuffer, &beginInfo);
-	assert(beginCommandBufferResult == VK_SUCCESS);
+    // taken from the pool, as submitUpload hands it back there once the copy is retired
+    VkCommandBuffer commandBuffer = Vulkan::createCommandBuffer(context, commandPool, true);
+    assert(commandBuffer != VK_NULL_HANDLE);
+    if (commandBuffer == VK_NULL_HANDLE)
+        return false;
 
     VkBufferCopy copyRegion = {};
     copyRegion.srcOffset = srcOffset;
@@ -724,22 +1047,11 @@ bool Vulkan::BufferDescriptor::copyFromAndFlush(Vulkan::Context& context, VkComm
 	const VkResult endCommandBufferResult = vkEndCommandBuffer(commandBuffer);
     assert(endCommandBufferResult == VK_SUCCESS);
 
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-    
-    VkFence fence = Vulkan::createFence(context._device, 0);
-    assert(fence != VK_NULL_HANDLE);
-
-    const VkResult submitResult = vkQueueSubmit(queue, 1, &submitInfo, fence);
-	assert(submitResult == VK_SUCCESS);
-
-    const VkResult waitForFencesResult = vkWaitForFences(context._device, 1, &fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
-    vkDestroyFence(context._device, fence, nullptr);
-
-    vkFreeCommandBuffers(context._device, commandPool, 1, &commandBuffer);
-    return true;
+    // submitUpload signals the queue's timeline when there is one, and frees the command buffer when it's retired
+    const UploadToken token = submitUpload(context, queue, commandPool, commandBuffer, nullptr);
+    if (token == 0)
+        return false;
+    return waitForUpload(context, token);
 }
 
 bool Vulkan::BufferDescriptor::copyToAndFlush(
@@ -748,7 +1060,8 @@ bool Vulkan::BufferDescriptor::copyToAndFlush(
     VkQueue queue,
     VkImage image,
     VkOffset3D offset,
-    VkExtent3D extent)
+    VkExtent3D extent,
+    VkDeviceSize bufferOffset)
 {
     VkCommandBufferAllocateInfo allocInfo = {};
     allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -768,7 +1081,7 @@ bool Vulkan::BufferDescriptor::copyToAndFlush(
     assert(beginCommandBufferResult == VK_SUCCESS);
 
     VkBufferImageCopy region = {};
-    region.bufferOffset = 0;
+    region.bufferOffset = bufferOffset;
     region.bufferRowLength = 0;
     region.bufferImageHeight = 0;
     region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -811,6 +1124,14 @@ void Vulkan::PersistentBuffer::destroy()
     _buffers.clear();
 }
 
+void Vulkan::PersistentBuffer::destroy(Vulkan::Context& context)
+{
+    for (auto& buf : _buffers)
+        buf.destroy(context);
+
+    _buffers.clear();
+}
+
 bool Vulkan::PersistentBuffer::copyFrom(unsigned int frameIndex, const void* srcData, VkDeviceSize amount, VkDeviceSize offset)
 {
     frameIndex = frameIndex % _offsets.size();
@@ -822,7 +1143,7 @@ bool Vulkan::PersistentBuffer::copyFrom(unsigned int frameIndex, const void* src
     unsigned char* dstData = reinterpret_cast<unsigned char*>(_allocInfos[frameIndex].pMappedData);
     // data is mapped - just copy it
     void* fPointer = reinterpret_cast<void*>(dstData + lOffset);
-    memcpy(fPointer, srcData, amount);
+    copyToMappedMemory(fPointer, srcData, (size_t)amount, _buffers[frameIndex]._writeCombined);
     _offsets[frameIndex] = lOffset + (unsigned int)amount;
 
     return true;
@@ -853,8 +1174,10 @@ bool Vulkan::PersistentBuffer::startFrame(unsigned int frameIndex)
 
 bool Vulkan::PersistentBuffer::flushData(Vulkan::Context& context, unsigned int frameIndex)
 {
+    // everything written this frame. vma rounds the range out to nonCoherentAtomSize itself
     VkDeviceSize size = _offsets[frameIndex % _offsets.size()];
-    size = size + size % context._deviceProperties.limits.nonCoherentAtomSize;
+    if (size == 0)
+        return true;
     size = (size > _registeredSize) ? VK_WHOLE_SIZE : size;
 
     VkResult success = vmaFlushAllocation(g_allocator,
@@ -873,6 +1196,149 @@ bool Vulkan::PersistentBuffer::submitFrame(Vulkan::Context& context, unsigned in
     return true;
 }
 
+///////////////////////////////////// Vulkan StagingRing ///////////////////////////////////////////////////////////////////
+
+namespace
+{
+    inline VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment)
+    {
+        return (alignment <= 1) ? value : ((value + alignment - 1) / alignment) * alignment;
+    }
+
+    // buffer offsets for image copies must be a multiple of both the texel size and 4
+    inline VkDeviceSize imageStagingAlignment(VkDeviceSize pixelSize)
+    {
+        return alignUp(stagingAlignment, 4 * std::max<VkDeviceSize>(pixelSize, 1));
+    }
+
+    bool allocateFromSegment(Vulkan::StagingRing::Segment& segment, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& result)
+    {
+        const VkDeviceSize capacity = segment._buffer._size;
+        if (segment._inFlight.empty())
+        {
+            segment._head = 0;
+            if (size > capacity)
+                return false;
+            result = 0;
+            return true;
+        }
+
+        const VkDeviceSize tail = segment._inFlight.front()._begin;
+        const VkDeviceSize head = alignUp(segment._head, alignment);
+        if (segment._head > tail)
+        {
+            // [tail, head) is in use - try the end of the buffer first, then wrap around
+            if (head + size <= capacity)
+            {
+                result = head;
+                return true;
+            }
+            if (size <= tail)
+            {
+                result = 0;
+                return true;
+            }
+            return false;
+        }
+
+        // wrapped - the free space is [head, tail)
+        if (head + size <= tail)
+        {
+            result = head;
+            return true;
+        }
+        return false;
+    }
+}
+
+bool Vulkan::StagingRing::allocate(Vulkan::Context& context, VkDeviceSize size, VkDeviceSize alignment, StagingAllocation& result)
+{
+    size = std::max<VkDeviceSize>(size, 1);
+    if (_segmentSize == 0)
+        _segmentSize = stagingBufferSize;
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        for (unsigned int i = 0; i < (unsigned int)_segments.size(); i++)
+        {
+            Segment& segment = *_segments[i];
+            VkDeviceSize offset = 0;
+            if (allocateFromSegment(segment, size, alignment, offset))
+            {
+                segment._inFlight.push_back(Range{ 0, false, offset, offset + size });
+                segment._head = offset + size;
+
+                result._buffer = &segment._buffer;
+                result._offset = offset;
+                result._size = size;
+                result._mappedData = reinterpret_cast<unsigned char*>(segment._allocInfo.pMappedData) + offset;
+                result._segment = i;
+                return true;
+            }
+        }
+
+        // release whatever the gpu has finished with before growing
+        if (attempt == 0)
+            retire(context);
+    }
+
+    std::unique_ptr<Segment> segment(new Segment());
+    const VkDeviceSize segmentSize = std::max<VkDeviceSize>(_segmentSize, alignUp(size, 4096));
+    if (!Vulkan::createBuffer(context, segmentSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, segment->_buffer, &segment->_allocInfo))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("StagingRing - Failed to create segment of size ") + std::to_string(segmentSize) + "\n");
+        return false;
+    }
+    g_logger->log(Vulkan::Logger::Level::Verbose, std::string("StagingRing - added segment ") + std::to_string(_segments.size()) + " of size " + std::to_string(segmentSize) + "\n");
+
+    _segments.push_back(std::move(segment));
+    return allocate(context, size, alignment, result);
+}
+
+void Vulkan::StagingRing::commit(const StagingAllocation& allocation, UploadToken token)
+{
+    assert(allocation._segment < (unsigned int)_segments.size());
+    std::deque<Range>& inFlight = _segments[allocation._segment]->_inFlight;
+    for (auto it = inFlight.rbegin(); it != inFlight.rend(); ++it)
+    {
+        if (it->_begin == allocation._offset && !it->_committed)
+        {
+            it->_token = token;
+            it->_committed = true;
+            return;
+        }
+    }
+    assert(0);
+}
+
+void Vulkan::StagingRing::retire(Vulkan::Context& context)
+{
+    for (std::unique_ptr<Segment>& segment : _segments)
+    {
+        std::deque<Range>& inFlight = segment->_inFlight;
+        while (!inFlight.empty() && inFlight.front()._committed && Vulkan::isUploadComplete(context, inFlight.front()._token))
+            inFlight.pop_front();
+
+        if (inFlight.empty())
+            segment->_head = 0;
+    }
+}
+
+VkDeviceSize Vulkan::StagingRing::capacity() const
+{
+    VkDeviceSize result = 0;
+    for (const std::unique_ptr<Segment>& segment : _segments)
+        result += segment->_buffer._size;
+    return result;
+}
+
+void Vulkan::StagingRing::destroy()
+{
+    for (std::unique_ptr<Segment>& segment : _segments)
+        segment->_buffer.destroy();
+    _segments.clear();
+}
+
 ///////////////////////////////////// Vulkan Methods ///////////////////////////////////////////////////////////////////
 
 void Vulkan::ImageDescriptor::destroy()
@@ -882,6 +1348,21 @@ void Vulkan::ImageDescriptor::destroy()
 
     _image = VK_NULL_HANDLE;
     _size = 0;
+    _layouts.clear();
+}
+
+void Vulkan::ImageDescriptor::destroy(Vulkan::Context& context)
+{
+    if (_image != VK_NULL_HANDLE)
+    {
+        ImageDescriptor image = *this;
+        deferDestruction(context, [image]() mutable { image.destroy(); });
+    }
+
+    _image = VK_NULL_HANDLE;
+    _mappedData = nullptr;
+    _size = 0;
+    _layouts.clear();
 }
 
 void* Vulkan::ImageDescriptor::map()
@@ -900,6 +1381,36 @@ void Vulkan::ImageDescriptor::unmap()
     _mappedData = nullptr;
 }
 
+VkImageLayout Vulkan::ImageDescriptor::layout(uint32_t mipLevel, uint32_t arrayLayer) const
+{
+    const size_t index = (size_t)arrayLayer * _mipLevels + mipLevel;
+    return index < _layouts.size() ? _layouts[index] : VK_IMAGE_LAYOUT_UNDEFINED;
+}
+
+bool Vulkan::ImageDescriptor::hasUniformLayout() const
+{
+    for (VkImageLayout subresourceLayout : _layouts)
+    {
+        if (subresourceLayout != _layouts[0])
+            return false;
+    }
+    return true;
+}
+
+void Vulkan::ImageDescriptor::setLayout(VkImageLayout layout, uint32_t baseMipLevel, uint32_t levelCount, uint32_t baseArrayLayer, uint32_t layerCount)
+{
+    if (_layouts.empty())
+        return;
+
+    const uint32_t endMipLevel = levelCount == VK_REMAINING_MIP_LEVELS ? _mipLevels : std::min<uint32_t>(_mipLevels, baseMipLevel + levelCount);
+    const uint32_t endArrayLayer = layerCount == VK_REMAINING_ARRAY_LAYERS ? _arrayLayers : std::min<uint32_t>(_arrayLayers, baseArrayLayer + layerCount);
+    for (uint32_t arrayLayer = baseArrayLayer; arrayLayer < endArrayLayer; arrayLayer++)
+    {
+        for (uint32_t mipLevel = baseMipLevel; mipLevel < endMipLevel; mipLevel++)
+            _layouts[(size_t)arrayLayer * _mipLevels + mipLevel] = layout;
+    }
+}
+
 
 
 ///////////////////////////////////// Image Descriptor ///////////////////////////////////////////////////////////////////
@@ -1001,20 +1512,22 @@ bool Vulkan::createImage(Vulkan::Context & context,
     VkImageTiling requiredTiling,
     VkImageUsageFlags requiredUsage,
     VkMemoryPropertyFlags memoryProperties,
-    Vulkan::ImageDescriptor & resultImage)
+    Vulkan::ImageDescriptor & resultImage,
+    unsigned int arrayLayers,
+    VkImageCreateFlags createFlags)
 {
     VkImageCreateInfo createInfo;
     memset(&createInfo, 0, sizeof(createInfo));
     createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     createInfo.pNext = NULL;
-    createInfo.flags = 0;
+    createInfo.flags = createFlags;
     createInfo.imageType = (depth > 1) ? VK_IMAGE_TYPE_3D : VK_IMAGE_TYPE_2D;
     createInfo.format = requiredFormat;
     createInfo.extent.width = width;
     createInfo.extent.height = height;
     createInfo.extent.depth = depth;
     createInfo.mipLevels = mipMapLevels;
-    createInfo.arrayLayers = 1;
+    createInfo.arrayLayers = arrayLayers;
     createInfo.samples = (VkSampleCountFlagBits)samplesPrPixels;
     createInfo.tiling = requiredTiling;
     createInfo.usage = requiredUsage;
@@ -1044,283 +1557,3434 @@ bool Vulkan::createImage(Vulkan::Context & context,
     }
     resultImage._image = image;
     resultImage._memory = allocation;
+    resultImage._format = requiredFormat;
+    resultImage._usage = requiredUsage;
+    resultImage._extent = createInfo.extent;
+    resultImage._mipLevels = mipMapLevels;
+    resultImage._arrayLayers = arrayLayers;
+    resultImage._layouts.assign((size_t)mipMapLevels * arrayLayers, VK_IMAGE_LAYOUT_UNDEFINED);
 
     return true;
 }
 
-bool Vulkan::updataImageData(Vulkan::Context& context, Vulkan::ImageDescriptor& result, const void* pixels, unsigned int mipMapLevels, const unsigned int& pixelSize, const unsigned int& width, const unsigned int& height, const unsigned int& depth, VkImageLayout finalLayout)
+namespace
 {
-    if (!Vulkan::transitionImageLayoutAndSubmit(context, result._image,
-        finalLayout,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL))
+    // formats where every byte of a pixel is an unsigned 8 bit channel, which is what the cpu mip filter expects
+    bool isByteChannelFormat(VkFormat format)
     {
-        g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - transitionImageLayout : VK_IMAGE_LAYOUT_UNDEFINED -> VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL\n"));
-        return false;
+        switch (format)
+        {
+        case VK_FORMAT_R8_UNORM:
+        case VK_FORMAT_R8_UINT:
+        case VK_FORMAT_R8_SRGB:
+        case VK_FORMAT_R8G8_UNORM:
+        case VK_FORMAT_R8G8_UINT:
+        case VK_FORMAT_R8G8_SRGB:
+        case VK_FORMAT_R8G8B8_UNORM:
+        case VK_FORMAT_R8G8B8_UINT:
+        case VK_FORMAT_R8G8B8_SRGB:
+        case VK_FORMAT_B8G8R8_UNORM:
+        case VK_FORMAT_B8G8R8_SRGB:
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_UINT:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+            return true;
+        default:
+            return false;
+        }
     }
 
-    if (pixels != nullptr)
+    // the blit path filters these in linear space, so the cpu filter has to as well or the smaller levels come out darker
+    bool isSrgbFormat(VkFormat format)
     {
-        assert(mipMapLevels > 0);
-        VkDeviceSize size = pixelSize * width * height * depth;
-        Vulkan::PersistentBufferPtr stagingBuffer = getPersistentStagingBuffer(context, size);
-        Context::Queue& queue = getQueue(context, VK_QUEUE_TRANSFER_BIT, { 8,8,1 });
-        for (int32_t depthLevel = 0; depthLevel < (int32_t)depth; depthLevel = depthLevel + queue._minGranularity.depth)
+        switch (format)
         {
-            VkDeviceSize amountToCopy = pixelSize * width * height * queue._minGranularity.depth;
-            assert(amountToCopy <= stagingBuffer->_registeredSize);
+        case VK_FORMAT_R8_SRGB:
+        case VK_FORMAT_R8G8_SRGB:
+        case VK_FORMAT_R8G8B8_SRGB:
+        case VK_FORMAT_B8G8R8_SRGB:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+            return true;
+        default:
+            return false;
+        }
+    }
 
-            const char* dataPointer = reinterpret_cast<const char*>(pixels) + depthLevel * amountToCopy;
-            if (!stagingBuffer->copyFromAndFlush(context, 0, reinterpret_cast<const void*>(dataPointer), amountToCopy, 0))
-            {
-                g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - Failed to fill staging buffer\n"));
-                return false;
+    struct SrgbTables
+    {
+        static constexpr unsigned int linearSteps = 1 << 14;
+        float _toLinear[256];
+        unsigned char _fromLinear[linearSteps]; // indexed by the linear value scaled to [0, linearSteps - 1]
+
+        SrgbTables()
+        {
+            for (unsigned int i = 0; i < 256; i++)
+            {
+                const float c = i / 255.0f;
+                _toLinear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+            }
+            for (unsigned int i = 0; i < linearSteps; i++)
+            {
+                const float l = i / (float)(linearSteps - 1);
+                const float c = l <= 0.0031308f ? l * 12.92f : 1.055f * powf(l, 1.0f / 2.4f) - 0.055f;
+                _fromLinear[i] = (unsigned char)std::min(255.0f, c * 255.0f + 0.5f);
+            }
+        }
+    };
+
+    const SrgbTables& srgbTables()
+    {
+        static const SrgbTables tables;
+        return tables;
+    }
+
+    // 2x2 box filter of rows [firstRow, lastRow) of the next mip level. Edges are clamped, so odd sizes and 1 pixel wide levels work
+    void downsampleRows(const unsigned char* src, unsigned int srcWidth, unsigned int srcHeight, unsigned char* dst, unsigned int dstWidth, unsigned int firstRow, unsigned int lastRow, unsigned int pixelSize)
+    {
+        const size_t srcPitch = (size_t)srcWidth * pixelSize;
+        std::vector<uint16_t> columnSums(srcPitch);
+        for (unsigned int y = firstRow; y < lastRow; y++)
+        {
+            const unsigned char* row0 = src + std::min(2 * y, srcHeight - 1) * srcPitch;
+            const unsigned char* row1 = src + std::min(2 * y + 1, srcHeight - 1) * srcPitch;
+
+            // vertical pairs first - this doesn't depend on the pixel layout
+            size_t i = 0;
+#if defined(VULKAN_SETUP_SSE2)
+            const __m128i zero = _mm_setzero_si128();
+            for (; i + 16 <= srcPitch; i += 16)
+            {
+                const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row0 + i));
+                const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + i));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&columnSums[i]), _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&columnSums[i + 8]), _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)));
+            }
+#endif
+            for (; i < srcPitch; i++)
+                columnSums[i] = (uint16_t)(row0[i] + row1[i]);
+
+            // then horizontal pairs
+            unsigned char* dstRow = dst + (size_t)y * dstWidth * pixelSize;
+            unsigned int x = 0;
+#if defined(VULKAN_SETUP_SSE2)
+            if (pixelSize == 4)
+            {
+                const __m128i two = _mm_set1_epi16(2);
+                for (; x + 2 <= dstWidth && 2 * x + 3 < srcWidth; x += 2)
+                {
+                    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&columnSums[(size_t)x * 8]));
+                    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&columnSums[(size_t)x * 8 + 8]));
+                    const __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+                    const __m128i average = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+                    _mm_storel_epi64(reinterpret_cast<__m128i*>(dstRow + (size_t)x * 4), _mm_packus_epi16(average, zero));
+                }
+            }
+#endif
+            for (; x < dstWidth; x++)
+            {
+                const size_t p0 = (size_t)std::min(2 * x, srcWidth - 1) * pixelSize;
+                const size_t p1 = (size_t)std::min(2 * x + 1, srcWidth - 1) * pixelSize;
+                for (unsigned int c = 0; c < pixelSize; c++)
+                    dstRow[(size_t)x * pixelSize + c] = (unsigned char)((columnSums[p0 + c] + columnSums[p1 + c] + 2) >> 2);
+            }
+        }
+    }
+
+    // same as downsampleRows, with the colour channels averaged in linear space. A 4th channel is alpha, which isn't encoded
+    void downsampleRowsSrgb(const unsigned char* src, unsigned int srcWidth, unsigned int srcHeight, unsigned char* dst, unsigned int dstWidth, unsigned int firstRow, unsigned int lastRow, unsigned int pixelSize)
+    {
+        const SrgbTables& tables = srgbTables();
+        const float linearScale = 0.25f * (SrgbTables::linearSteps - 1);
+        const unsigned int colourChannels = std::min(pixelSize, 3u);
+        const size_t srcPitch = (size_t)srcWidth * pixelSize;
+        for (unsigned int y = firstRow; y < lastRow; y++)
+        {
+            const unsigned char* row0 = src + std::min(2 * y, srcHeight - 1) * srcPitch;
+            const unsigned char* row1 = src + std::min(2 * y + 1, srcHeight - 1) * srcPitch;
+            unsigned char* dstRow = dst + (size_t)y * dstWidth * pixelSize;
+            for (unsigned int x = 0; x < dstWidth; x++)
+            {
+                const size_t p0 = (size_t)std::min(2 * x, srcWidth - 1) * pixelSize;
+                const size_t p1 = (size_t)std::min(2 * x + 1, srcWidth - 1) * pixelSize;
+                for (unsigned int c = 0; c < pixelSize; c++)
+                {
+                    if (c < colourChannels)
+                    {
+                        const float sum = tables._toLinear[row0[p0 + c]] + tables._toLinear[row0[p1 + c]] + tables._toLinear[row1[p0 + c]] + tables._toLinear[row1[p1 + c]];
+                        dstRow[(size_t)x * pixelSize + c] = tables._fromLinear[(unsigned int)(sum * linearScale + 0.5f)];
+                    }
+                    else
+                        dstRow[(size_t)x * pixelSize + c] = (unsigned char)((row0[p0 + c] + row0[p1 + c] + row1[p0 + c] + row1[p1 + c] + 2) >> 2);
+                }
+            }
+        }
+    }
+
+    void downsample(const unsigned char* src, unsigned int srcWidth, unsigned int srcHeight, unsigned char* dst, unsigned int dstWidth, unsigned int dstHeight, unsigned int pixelSize, bool srgb)
+    {
+        // built before the workers start, rather than by whichever gets there first
+        if (srgb)
+            srgbTables();
+        const auto filterRows = srgb ? downsampleRowsSrgb : downsampleRows;
+
+        // small levels aren't worth handing out to the workers
+        constexpr unsigned int minRowsPerThread = 64;
+        WorkerPool& pool = workerPool();
+        const unsigned int numThreads = std::max(1u, std::min(pool.numThreads(), dstHeight / minRowsPerThread));
+        const unsigned int rowsPerThread = (dstHeight + numThreads - 1) / numThreads;
+        if (numThreads == 1)
+        {
+            filterRows(src, srcWidth, srcHeight, dst, dstWidth, 0, dstHeight, pixelSize);
+            return;
+        }
+
+        pool.run(numThreads, [&](unsigned int t) {
+            const unsigned int firstRow = t * rowsPerThread;
+            const unsigned int lastRow = std::min(dstHeight, firstRow + rowsPerThread);
+            if (firstRow < lastRow)
+                filterRows(src, srcWidth, srcHeight, dst, dstWidth, firstRow, lastRow, pixelSize);
+        });
+    }
+
+    // rounds value down to a multiple of granularity, but never below one granule
+    inline unsigned int granularTileSize(unsigned int value, unsigned int granularity)
+    {
+        return std::max(granularity, (value / granularity) * granularity);
+    }
+
+    // copies a mip level in tiles of at most imageTileSize bytes, so images of any size fit in the staging ring. Tile offsets
+    // are multiples of the queue's minImageTransferGranularity, and the batch is flushed every imageUploadFlushSize bytes
+    // so only a few tiles worth of staging memory is in use at a time
+    bool recordImageTiles(Vulkan::TransferBatch& batch, VkImage image, unsigned int mipLevel, const void* pixels, unsigned int pixelSize, unsigned int width, unsigned int height, unsigned int depth)
+    {
+        const VkExtent3D granularity = batch.minGranularity();
+        const VkDeviceSize rowSize = (VkDeviceSize)pixelSize * width;
+        const VkDeviceSize sliceSize = rowSize * height;
+        const VkDeviceSize alignment = imageStagingAlignment(pixelSize);
+        const unsigned char* src = reinterpret_cast<const unsigned char*>(pixels);
+
+        // a granularity of 0 means only whole images can be copied on this queue
+        const bool wholeImageOnly = granularity.width == 0 || granularity.height == 0 || granularity.depth == 0;
+        const unsigned int depthStep = wholeImageOnly ? depth : granularTileSize(std::max<unsigned int>(1, (unsigned int)(imageTileSize / sliceSize)), granularity.depth);
+        for (unsigned int z = 0; z < depth; z += depthStep)
+        {
+            const unsigned int numSlices = std::min<unsigned int>(depthStep, depth - z);
+            const VkDeviceSize slabRowSize = rowSize * numSlices;
+            const unsigned int rowStep = wholeImageOnly ? height : granularTileSize((unsigned int)std::max<VkDeviceSize>(1, imageTileSize / slabRowSize), granularity.height);
+            const unsigned int columnStep = wholeImageOnly ? width : granularTileSize((unsigned int)std::max<VkDeviceSize>(1, imageTileSize / ((VkDeviceSize)pixelSize * rowStep * numSlices)), granularity.width);
+            for (unsigned int y = 0; y < height; y += rowStep)
+            {
+                const unsigned int numRows = std::min<unsigned int>(rowStep, height - y);
+                for (unsigned int x = 0; x < width; x += columnStep)
+                {
+                    const unsigned int numColumns = std::min<unsigned int>(columnStep, width - x);
+                    const VkDeviceSize tileRowSize = (VkDeviceSize)pixelSize * numColumns;
+                    const VkDeviceSize tileSize = tileRowSize * numRows * numSlices;
+
+                    if (batch.stagingBytes() > 0 && batch.stagingBytes() + tileSize > imageUploadFlushSize && !batch.flush())
+                        return false;
+
+                    VkBufferImageCopy region = {};
+                    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+                    region.imageSubresource.mipLevel = mipLevel;
+                    region.imageSubresource.baseArrayLayer = 0;
+                    region.imageSubresource.layerCount = 1;
+                    region.imageOffset = { (int32_t)x, (int32_t)y, (int32_t)z };
+                    region.imageExtent = { numColumns, numRows, numSlices };
+
+                    const unsigned char* tileSrc = src + z * sliceSize + y * rowSize + (VkDeviceSize)x * pixelSize;
+                    if (numColumns == width && (numRows == height || numSlices == 1))
+                    {
+                        // whole rows are contiguous in the source already
+                        if (!batch.copyToImage(image, tileSrc, tileSize, alignment, region))
+                            return false;
+                        continue;
+                    }
+
+                    unsigned char* staging = reinterpret_cast<unsigned char*>(batch.reserveImageCopy(image, tileSize, alignment, region));
+                    if (staging == nullptr)
+                        return false;
+                    for (unsigned int slice = 0; slice < numSlices; slice++)
+                    {
+                        for (unsigned int row = 0; row < numRows; row++)
+                        {
+                            copyToMappedMemory(staging, tileSrc + slice * sliceSize + row * rowSize, (size_t)tileRowSize, true);
+                            staging += tileRowSize;
+                        }
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // builds levels 1..mipMapLevels-1 on the cpu, and records copies of them into the batch
+    bool recordCpuMipChain(Vulkan::TransferBatch& batch, VkImage image, VkFormat format, const void* pixels, unsigned int mipMapLevels, unsigned int pixelSize, unsigned int width, unsigned int height)
+    {
+        const bool srgb = isSrgbFormat(format);
+        std::vector<unsigned char> previous;
+        std::vector<unsigned char> current;
+        const unsigned char* src = reinterpret_cast<const unsigned char*>(pixels);
+        for (unsigned int level = 1; level < mipMapLevels; level++)
+        {
+            const unsigned int levelWidth = std::max(1u, width / 2);
+            const unsigned int levelHeight = std::max(1u, height / 2);
+            current.resize((size_t)levelWidth * levelHeight * pixelSize);
+            downsample(src, width, height, &current[0], levelWidth, levelHeight, pixelSize, srgb);
+
+            if (!recordImageTiles(batch, image, level, &current[0], pixelSize, levelWidth, levelHeight, 1))
+                return false;
+
+            previous.swap(current);
+            src = &previous[0];
+            width = levelWidth;
+            height = levelHeight;
+        }
+        return true;
+    }
+
+    // expects every level in TRANSFER_DST_OPTIMAL with level 0 filled in. Leaves all but the last level in TRANSFER_SRC_OPTIMAL
+    bool recordMipChainBlits(Vulkan::TransferBatch& batch, Vulkan::ImageDescriptor& image, unsigned int mipMapLevels, unsigned int width, unsigned int height, unsigned int depth)
+    {
+        for (unsigned int level = 1; level < mipMapLevels; level++)
+        {
+            if (!batch.transitionImageLayout(image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, level - 1, 1))
+                return false;
+
+            const unsigned int levelWidth = std::max(1u, width / 2);
+            const unsigned int levelHeight = std::max(1u, height / 2);
+            const unsigned int levelDepth = std::max(1u, depth / 2);
+
+            VkImageBlit blit = {};
+            blit.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, 1 };
+            blit.srcOffsets[0] = { 0, 0, 0 };
+            blit.srcOffsets[1] = { (int32_t)width, (int32_t)height, (int32_t)depth };
+            blit.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1 };
+            blit.dstOffsets[0] = { 0, 0, 0 };
+            blit.dstOffsets[1] = { (int32_t)levelWidth, (int32_t)levelHeight, (int32_t)levelDepth };
+            if (!batch.blitImage(image._image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image._image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, blit, VK_FILTER_LINEAR))
+                return false;
+
+            width = levelWidth;
+            height = levelHeight;
+            depth = levelDepth;
+        }
+        return true;
+    }
+
+    // the graphics timeline value of the last submission to the graphics queue, or 0 without timeline semaphores
+    uint64_t lastGraphicsSubmission(Vulkan::Context& context)
+    {
+        Vulkan::QueueTimeline* timeline = Vulkan::getQueueTimeline(context, Vulkan::getQueue(context, VK_QUEUE_GRAPHICS_BIT)._queue);
+        return timeline != nullptr ? timeline->_lastSignaled : 0;
+    }
+
+    // true while graphics work submitted after timelineValue, a lastGraphicsSubmission value, hasn't finished. That is
+    // every submission that signals the graphics timeline, endFrame's or not. Without timeline semaphores only frames
+    // submitted by endFrame since frameNumber are known about
+    bool graphicsWorkPending(Vulkan::Context& context, uint64_t timelineValue, uint64_t frameNumber)
+    {
+        Vulkan::QueueTimeline* timeline = Vulkan::getQueueTimeline(context, Vulkan::getQueue(context, VK_QUEUE_GRAPHICS_BIT)._queue);
+        if (timeline != nullptr)
+        {
+            uint64_t currentValue = 0;
+            return timeline->_lastSignaled > timelineValue
+                && (vkGetSemaphoreCounterValue(context._device, timeline->_semaphore, &currentValue) != VK_SUCCESS || currentValue < timeline->_lastSignaled);
+        }
+        return frameNumber < context._frameNumber && !Vulkan::isFrameComplete(context, context._frameNumber - 1);
+    }
+
+    // true when the image has contents that graphics work which hasn't finished yet may be sampling
+    bool imageMayBeInUse(Vulkan::Context& context, const Vulkan::ImageDescriptor& image)
+    {
+        if (image.hasUniformLayout() && image.layout() == VK_IMAGE_LAYOUT_UNDEFINED)
+            return false;
+        return graphicsWorkPending(context, 0, 0);
+    }
+
+    // writes level 0 straight from host memory with VK_EXT_host_image_copy. Returns false without touching the image when
+    // that isn't possible, so the caller can fall back to staging. The whole image is transitioned at once, so it has to
+    // be in one layout to begin with
+    bool hostCopyImageData(Vulkan::Context& context, Vulkan::ImageDescriptor& image, const void* pixels, unsigned int width, unsigned int height, unsigned int depth, VkImageLayout finalLayout)
+    {
+#if defined(VK_EXT_host_image_copy)
+        if (pixels == nullptr || (image._usage & VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT) == 0 || !image.hasUniformLayout())
+            return false;
+
+        const VkImageLayout oldLayout = image.layout();
+
+        const std::vector<VkImageLayout>& layouts = context._hostImageCopyDstLayouts;
+        if (std::find(layouts.begin(), layouts.end(), finalLayout) == layouts.end())
+            return false;
+        if (oldLayout != VK_IMAGE_LAYOUT_UNDEFINED && std::find(layouts.begin(), layouts.end(), oldLayout) == layouts.end())
+            return false;
+
+        if (oldLayout != finalLayout)
+        {
+            VkHostImageLayoutTransitionInfoEXT transition = {};
+            transition.sType = VK_STRUCTURE_TYPE_HOST_IMAGE_LAYOUT_TRANSITION_INFO_EXT;
+            transition.image = image._image;
+            transition.oldLayout = oldLayout;
+            transition.newLayout = finalLayout;
+            transition.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, VK_REMAINING_MIP_LEVELS, 0, VK_REMAINING_ARRAY_LAYERS };
+            if (vkTransitionImageLayoutEXT(context._device, 1, &transition) != VK_SUCCESS)
+                return false;
+        }
+
+        VkMemoryToImageCopyEXT region = {};
+        region.sType = VK_STRUCTURE_TYPE_MEMORY_TO_IMAGE_COPY_EXT;
+        region.pHostPointer = pixels;
+        region.memoryRowLength = 0;
+        region.memoryImageHeight = 0;
+        region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        region.imageOffset = { 0, 0, 0 };
+        region.imageExtent = { width, height, depth };
+
+        VkCopyMemoryToImageInfoEXT copyInfo = {};
+        copyInfo.sType = VK_STRUCTURE_TYPE_COPY_MEMORY_TO_IMAGE_INFO_EXT;
+        copyInfo.dstImage = image._image;
+        copyInfo.dstImageLayout = finalLayout;
+        copyInfo.regionCount = 1;
+        copyInfo.pRegions = &region;
+        const VkResult copyResult = vkCopyMemoryToImageEXT(context._device, &copyInfo);
+        assert(copyResult == VK_SUCCESS);
+        if (copyResult != VK_SUCCESS)
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - vkCopyMemoryToImageEXT failed\n"));
+            return false;
+        }
+        image.setLayout(finalLayout);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // records the layout transitions and copies needed to upload pixels into image, starting from the layouts the image
+    // tracks. All depth slices go into the same batch
+    bool recordImageData(Vulkan::Context& context, Vulkan::TransferBatch& batch, Vulkan::ImageDescriptor& image, const void* pixels, unsigned int mipMapLevels, unsigned int pixelSize, unsigned int width, unsigned int height, unsigned int depth, VkImageLayout finalLayout, bool generateMipMaps)
+    {
+        // host copies happen right away and don't involve the batch at all. Mip chains still need the batch for blits
+        // an image frames in flight may still be sampling is left to the batch, which orders the write after them
+        const bool needsMipChain = generateMipMaps && mipMapLevels > 1;
+        if (!needsMipChain && !imageMayBeInUse(context, image) && hostCopyImageData(context, image, pixels, width, height, depth, finalLayout))
+            return true;
+
+        if (!batch.transitionImageLayout(image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - transitionImageLayout : -> VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL\n"));
+            return false;
+        }
+
+        if (pixels != nullptr)
+        {
+            assert(mipMapLevels > 0);
+            if (!recordImageTiles(batch, image._image, 0, pixels, pixelSize, width, height, depth))
+            {
+                g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - copyData\n"));
+                return false;
+            }
+        }
+
+        const bool buildMipChain = generateMipMaps && pixels != nullptr && mipMapLevels > 1;
+        if (buildMipChain && (batch.queueFlags() & VK_QUEUE_GRAPHICS_BIT) && Vulkan::canBlitMipMaps(context, image._format))
+        {
+            if (!recordMipChainBlits(batch, image, mipMapLevels, width, height, depth))
+            {
+                g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - Failed to record mip map blits\n"));
+                return false;
+            }
+
+            // the blitted levels are in TRANSFER_SRC and the last one in TRANSFER_DST, which the tracked layouts sort out
+            if (!batch.transitionImageLayout(image, finalLayout))
+            {
+                g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - transitionImageLayout : mip chain -> final layout\n"));
+                return false;
+            }
+            return true;
+        }
+
+        if (buildMipChain)
+        {
+            if (depth != 1 || !isByteChannelFormat(image._format))
+            {
+                g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - mip maps can't be generated for this format\n"));
+                return false;
+            }
+
+            if (!recordCpuMipChain(batch, image._image, image._format, pixels, mipMapLevels, pixelSize, width, height))
+            {
+                g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - Failed to upload mip maps\n"));
+                return false;
+            }
+        }
+
+        if (!batch.transitionImageLayout(image, finalLayout))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - transitionImageLayout : VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL -> final layout\n"));
+            return false;
+        }
+        return true;
+    }
+
+    // mip maps are blitted on a graphics queue when possible, everything else goes on the transfer queue
+    unsigned int uploadQueueFlags(Vulkan::Context& context, VkFormat format, unsigned int mipMapLevels, bool generateMipMaps)
+    {
+        if (generateMipMaps && mipMapLevels > 1 && Vulkan::canBlitMipMaps(context, format))
+            return VK_QUEUE_GRAPHICS_BIT;
+        return VK_QUEUE_TRANSFER_BIT;
+    }
+}
+
+bool Vulkan::canBlitMipMaps(Vulkan::Context& context, VkFormat format)
+{
+    if (format == VK_FORMAT_UNDEFINED)
+        return false;
+
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(context._physicalDevice, format, &formatProperties);
+    const VkFormatFeatureFlags requiredFeatures = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    return (formatProperties.optimalTilingFeatures & requiredFeatures) == requiredFeatures;
+}
+
+bool Vulkan::updataImageData(Vulkan::Context& context, Vulkan::TransferBatch& batch, Vulkan::ImageDescriptor& result, const void* pixels, unsigned int mipMapLevels, const unsigned int& pixelSize, const unsigned int& width, const unsigned int& height, const unsigned int& depth, VkImageLayout finalLayout, bool generateMipMaps)
+{
+    return recordImageData(context, batch, result, pixels, mipMapLevels, pixelSize, width, height, depth, finalLayout, generateMipMaps);
+}
+
+bool Vulkan::updataImageData(Vulkan::Context& context, Vulkan::ImageDescriptor& result, const void* pixels, unsigned int mipMapLevels, const unsigned int& pixelSize, const unsigned int& width, const unsigned int& height, const unsigned int& depth, VkImageLayout finalLayout, bool generateMipMaps)
+{
+    // an image that already has contents is updated in place on the graphics queue, behind the frames that sample it,
+    // rather than being handed to the transfer queue and back
+    const bool hasContents = !result.hasUniformLayout() || result.layout() != VK_IMAGE_LAYOUT_UNDEFINED;
+    TransferBatch batch;
+    if (!batch.begin(context, hasContents ? VK_QUEUE_GRAPHICS_BIT : uploadQueueFlags(context, result._format, mipMapLevels, generateMipMaps)))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("updataImageData - Failed to begin transfer batch\n"));
+        return false;
+    }
+
+    if (!recordImageData(context, batch, result, pixels, mipMapLevels, pixelSize, width, height, depth, finalLayout, generateMipMaps))
+        return false;
+
+    return batch.submitAndWait();
+}
+
+namespace
+{
+    // host transfer usage is only added when the driver says it doesn't slow down device access to the image
+    bool useHostImageCopy(Vulkan::Context& context, VkFormat format, VkImageType type, VkImageUsageFlags usage)
+    {
+#if defined(VK_EXT_host_image_copy)
+        if (!context._hasHostImageCopy)
+            return false;
+
+        VkPhysicalDeviceImageFormatInfo2 formatInfo = {};
+        formatInfo.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2;
+        formatInfo.format = format;
+        formatInfo.type = type;
+        formatInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        formatInfo.usage = usage | VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT;
+
+        VkHostImageCopyDevicePerformanceQueryEXT performanceQuery = {};
+        performanceQuery.sType = VK_STRUCTURE_TYPE_HOST_IMAGE_COPY_DEVICE_PERFORMANCE_QUERY_EXT;
+        VkImageFormatProperties2 formatProperties = {};
+        formatProperties.sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2;
+        formatProperties.pNext = &performanceQuery;
+        if (vkGetPhysicalDeviceImageFormatProperties2(context._physicalDevice, &formatInfo, &formatProperties) != VK_SUCCESS)
+            return false;
+        return performanceQuery.optimalDeviceAccess == VK_TRUE;
+#else
+        return false;
+#endif
+    }
+
+    bool createDeviceImage(Vulkan::Context& context, unsigned int width, unsigned int height, unsigned int depth, unsigned int samplesPrPixels, VkFormat format, unsigned int mipMapLevels, bool hasPixels, Vulkan::ImageDescriptor& result)
+    {
+        VkImageUsageFlags usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+#if defined(VK_EXT_host_image_copy)
+        if (hasPixels && useHostImageCopy(context, format, depth > 1 ? VK_IMAGE_TYPE_3D : VK_IMAGE_TYPE_2D, usage))
+            usage |= VK_IMAGE_USAGE_HOST_TRANSFER_BIT_EXT;
+#endif
+
+        if (!Vulkan::createImage(context,
+            width,
+            height,
+            depth,
+            mipMapLevels,
+            samplesPrPixels,
+            format,
+            VK_IMAGE_TILING_OPTIMAL,
+            usage,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            result))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - Failed to create image\n"));
+            return false;
+        }
+        return true;
+    }
+
+    // a failed upload into an image that was just created drops the image, and everything recorded into the batch with
+    // it. Parts of the batch that were already flushed may use the image, so it goes once the gpu is done with them
+    bool discardNewImage(Vulkan::Context& context, Vulkan::TransferBatch& batch, Vulkan::ImageDescriptor& image)
+    {
+        batch.abort();
+        image.destroy(context);
+        return false;
+    }
+}
+
+bool Vulkan::createImage(Vulkan::Context& context,
+    Vulkan::TransferBatch& batch,
+    const void* pixels,
+    const unsigned int pixelSize,
+    const unsigned int width,
+    const unsigned int height,
+    const unsigned int depth,
+    const unsigned int samplesPrPixels,
+    VkFormat format,
+    Vulkan::ImageDescriptor& result,
+    unsigned int mipMapLevels,
+    VkImageLayout finalLayout,
+    bool generateMipMaps)
+{
+    if (!createDeviceImage(context, width, height, depth, samplesPrPixels, format, mipMapLevels, pixels != nullptr, result))
+        return false;
+
+    if (pixels == nullptr)
+        return batch.transitionImageLayout(result, finalLayout) || discardNewImage(context, batch, result);
+
+    return recordImageData(context, batch, result, pixels, mipMapLevels, pixelSize, width, height, depth, finalLayout, generateMipMaps) || discardNewImage(context, batch, result);
+}
+
+bool Vulkan::createImage(Vulkan::Context& context,
+    const void* pixels, 
+    const unsigned int pixelSize, 
+    const unsigned int width, 
+    const unsigned int height, 
+    const unsigned int depth, 
+    const unsigned int samplesPrPixels,
+    VkFormat format,
+    Vulkan::ImageDescriptor & result, 
+    unsigned int mipMapLevels,
+    VkImageLayout finalLayout,
+    bool generateMipMaps)
+{
+    if (pixels == nullptr)
+    {
+        if (!createDeviceImage(context, width, height, depth, samplesPrPixels, format, mipMapLevels, false, result))
+            return false;
+
+        // submitted along with the other queued transitions, before the next graphics submission, rather than once per image
+        if (!Vulkan::queueImageTransition(context, result, finalLayout))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - transitionImageLayout : VK_IMAGE_LAYOUT_UNDEFINED -> VK_IMAGE_LAYOUT_GENERAL\n"));
+            result.destroy(context);
+            return false;
+        }
+        return true;
+    }
+
+    // the upload goes straight from UNDEFINED to TRANSFER_DST, so the whole image is done in a single submission
+    TransferBatch batch;
+    if (!batch.begin(context, uploadQueueFlags(context, format, mipMapLevels, generateMipMaps)))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - Failed to begin transfer batch\n"));
+        return false;
+    }
+
+    if (!Vulkan::createImage(context, batch, pixels, pixelSize, width, height, depth, samplesPrPixels, format, result, mipMapLevels, finalLayout, generateMipMaps))
+        return false;
+
+    if (!batch.submitAndWait())
+    {
+        result.destroy(context);
+        return false;
+    }
+    return true;
+}
+
+
+///////////////////////////////////// Texture Loading ///////////////////////////////////////////////////////////////////
+
+namespace
+{
+    // read only memory mapping of a whole file
+    class MappedFile
+    {
+    public:
+        MappedFile()
+            :_data(nullptr)
+            , _size(0)
+#if defined(_WIN32)
+            , _file(INVALID_HANDLE_VALUE)
+            , _mapping(nullptr)
+#else
+            , _fd(-1)
+#endif
+        {
+        }
+
+        ~MappedFile() { close(); }
+
+        bool open(const std::string& filename)
+        {
+            close();
+#if defined(_WIN32)
+            _file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (_file == INVALID_HANDLE_VALUE)
+                return false;
+
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(_file, &fileSize) || fileSize.QuadPart == 0)
+            {
+                close();
+                return false;
+            }
+            _size = (size_t)fileSize.QuadPart;
+
+            _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (_mapping == nullptr)
+            {
+                close();
+                return false;
             }
+            _data = reinterpret_cast<const unsigned char*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+            _fd = ::open(filename.c_str(), O_RDONLY);
+            if (_fd < 0)
+                return false;
+
+            struct stat fileStat;
+            if (fstat(_fd, &fileStat) != 0 || fileStat.st_size == 0)
+            {
+                close();
+                return false;
+            }
+            _size = (size_t)fileStat.st_size;
+
+            void* mapping = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                close();
+                return false;
+            }
+            // the file is read front to back exactly once
+            madvise(mapping, _size, MADV_SEQUENTIAL);
+            _data = reinterpret_cast<const unsigned char*>(mapping);
+#endif
+            if (_data == nullptr)
+            {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        void close()
+        {
+#if defined(_WIN32)
+            if (_data != nullptr)
+                UnmapViewOfFile(_data);
+            if (_mapping != nullptr)
+                CloseHandle(_mapping);
+            if (_file != INVALID_HANDLE_VALUE)
+                CloseHandle(_file);
+            _mapping = nullptr;
+            _file = INVALID_HANDLE_VALUE;
+#else
+            if (_data != nullptr)
+                munmap(const_cast<unsigned char*>(_data), _size);
+            if (_fd >= 0)
+                ::close(_fd);
+            _fd = -1;
+#endif
+            _data = nullptr;
+            _size = 0;
+        }
+
+        inline const unsigned char* data() const { return _data; }
+        inline size_t size() const { return _size; }
+
+    private:
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const unsigned char* _data;
+        size_t _size;
+#if defined(_WIN32)
+        HANDLE _file;
+        HANDLE _mapping;
+#else
+        int _fd;
+#endif
+    };
+
+    // size of a block of texels. Uncompressed formats are 1x1 blocks
+    struct FormatBlock
+    {
+        unsigned int _width;
+        unsigned int _height;
+        unsigned int _bytes;
+    };
+
+    bool getFormatBlock(VkFormat format, FormatBlock& block)
+    {
+        switch (format)
+        {
+        case VK_FORMAT_R8_UNORM:
+        case VK_FORMAT_R8_SRGB:
+            block = { 1, 1, 1 };
+            return true;
+        case VK_FORMAT_R8G8_UNORM:
+        case VK_FORMAT_R8G8_SRGB:
+        case VK_FORMAT_R16_SFLOAT:
+        case VK_FORMAT_R16_UNORM:
+            block = { 1, 1, 2 };
+            return true;
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+        case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+        case VK_FORMAT_B10G11R11_UFLOAT_PACK32:
+        case VK_FORMAT_E5B9G9R9_UFLOAT_PACK32:
+        case VK_FORMAT_R16G16_SFLOAT:
+        case VK_FORMAT_R32_SFLOAT:
+            block = { 1, 1, 4 };
+            return true;
+        case VK_FORMAT_R16G16B16A16_SFLOAT:
+        case VK_FORMAT_R16G16B16A16_UNORM:
+        case VK_FORMAT_R32G32_SFLOAT:
+            block = { 1, 1, 8 };
+            return true;
+        case VK_FORMAT_R32G32B32A32_SFLOAT:
+            block = { 1, 1, 16 };
+            return true;
+        case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+        case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+        case VK_FORMAT_BC4_UNORM_BLOCK:
+        case VK_FORMAT_BC4_SNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A1_UNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A1_SRGB_BLOCK:
+        case VK_FORMAT_EAC_R11_UNORM_BLOCK:
+            block = { 4, 4, 8 };
+            return true;
+        case VK_FORMAT_BC2_UNORM_BLOCK:
+        case VK_FORMAT_BC2_SRGB_BLOCK:
+        case VK_FORMAT_BC3_UNORM_BLOCK:
+        case VK_FORMAT_BC3_SRGB_BLOCK:
+        case VK_FORMAT_BC5_UNORM_BLOCK:
+        case VK_FORMAT_BC5_SNORM_BLOCK:
+        case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+        case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+        case VK_FORMAT_BC7_UNORM_BLOCK:
+        case VK_FORMAT_BC7_SRGB_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK:
+        case VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK:
+        case VK_FORMAT_EAC_R11G11_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_4x4_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_4x4_SRGB_BLOCK:
+            block = { 4, 4, 16 };
+            return true;
+        case VK_FORMAT_ASTC_6x6_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_6x6_SRGB_BLOCK:
+            block = { 6, 6, 16 };
+            return true;
+        case VK_FORMAT_ASTC_8x8_UNORM_BLOCK:
+        case VK_FORMAT_ASTC_8x8_SRGB_BLOCK:
+            block = { 8, 8, 16 };
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // one copy into the image - a mip level of one or more consecutive array layers
+    struct TextureSubresource
+    {
+        unsigned int _level;
+        unsigned int _baseLayer;
+        unsigned int _layerCount;
+        const unsigned char* _data;
+        VkDeviceSize _size;
+    };
+
+    struct TextureFile
+    {
+        VkFormat _format;
+        unsigned int _width;
+        unsigned int _height;
+        unsigned int _depth;
+        unsigned int _layers; // including cube faces
+        unsigned int _levels;
+        bool _cube;
+        FormatBlock _block;
+        std::vector<TextureSubresource> _subresources;
+    };
+
+    inline unsigned int mipSize(unsigned int size, unsigned int level) { return std::max(1u, size >> level); }
+
+    VkDeviceSize levelSize(const TextureFile& texture, unsigned int level)
+    {
+        const VkDeviceSize blocksX = (mipSize(texture._width, level) + texture._block._width - 1) / texture._block._width;
+        const VkDeviceSize blocksY = (mipSize(texture._height, level) + texture._block._height - 1) / texture._block._height;
+        return blocksX * blocksY * mipSize(texture._depth, level) * texture._block._bytes;
+    }
+
+    template<typename T>
+    T readValue(const unsigned char* data)
+    {
+        T value;
+        memcpy(&value, data, sizeof(T));
+        return value;
+    }
+
+    bool parseKtx2(const unsigned char* data, size_t size, TextureFile& texture)
+    {
+        static const unsigned char identifier[12] = { 0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+        constexpr size_t headerSize = 80;
+        constexpr size_t levelIndexEntrySize = 24;
+        if (size < headerSize || memcmp(data, identifier, sizeof(identifier)) != 0)
+            return false;
+
+        texture._format = (VkFormat)readValue<uint32_t>(data + 12);
+        texture._width = readValue<uint32_t>(data + 20);
+        texture._height = std::max(1u, readValue<uint32_t>(data + 24));
+        texture._depth = std::max(1u, readValue<uint32_t>(data + 28));
+        const unsigned int layerCount = std::max(1u, readValue<uint32_t>(data + 32));
+        const unsigned int faceCount = readValue<uint32_t>(data + 36);
+        // a level count of 0 asks the loader to generate the mips - we only upload what is stored
+        texture._levels = std::max(1u, readValue<uint32_t>(data + 40));
+        const uint32_t supercompressionScheme = readValue<uint32_t>(data + 44);
+
+        if (supercompressionScheme != 0)
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("loadTexture - supercompressed KTX2 files are not supported\n"));
+            return false;
+        }
+
+        texture._cube = faceCount == 6;
+        texture._layers = layerCount * faceCount;
+        if (!getFormatBlock(texture._format, texture._block) || texture._width == 0 || (faceCount != 1 && faceCount != 6))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("loadTexture - unsupported KTX2 format ") + std::to_string((int)texture._format) + "\n");
+            return false;
+        }
+
+        if (size < headerSize + levelIndexEntrySize * texture._levels)
+            return false;
+
+        // levels are stored with all their layers, faces and slices together, which matches a single buffer to image copy
+        for (unsigned int level = 0; level < texture._levels; level++)
+        {
+            const unsigned char* entry = data + headerSize + levelIndexEntrySize * level;
+            const uint64_t byteOffset = readValue<uint64_t>(entry);
+            const uint64_t byteLength = readValue<uint64_t>(entry + 8);
+            if (byteOffset > size || byteLength > size - byteOffset || byteLength != levelSize(texture, level) * texture._layers)
+            {
+                g_logger->log(Vulkan::Logger::Level::Error, std::string("loadTexture - KTX2 level ") + std::to_string(level) + " is out of range\n");
+                return false;
+            }
+
+            TextureSubresource subresource = { level, 0, texture._layers, data + byteOffset, byteLength };
+            texture._subresources.push_back(subresource);
+        }
+        return true;
+    }
+
+    constexpr uint32_t makeFourCC(char a, char b, char c, char d) { return (uint32_t)a | ((uint32_t)b << 8) | ((uint32_t)c << 16) | ((uint32_t)d << 24); }
+
+    VkFormat ddsFourCCFormat(uint32_t fourCC)
+    {
+        switch (fourCC)
+        {
+        case makeFourCC('D', 'X', 'T', '1'): return VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+        case makeFourCC('D', 'X', 'T', '3'): return VK_FORMAT_BC2_UNORM_BLOCK;
+        case makeFourCC('D', 'X', 'T', '5'): return VK_FORMAT_BC3_UNORM_BLOCK;
+        case makeFourCC('A', 'T', 'I', '1'):
+        case makeFourCC('B', 'C', '4', 'U'): return VK_FORMAT_BC4_UNORM_BLOCK;
+        case makeFourCC('A', 'T', 'I', '2'):
+        case makeFourCC('B', 'C', '5', 'U'): return VK_FORMAT_BC5_UNORM_BLOCK;
+        case 113: return VK_FORMAT_R16G16B16A16_SFLOAT; // D3DFMT_A16B16G16R16F
+        case 116: return VK_FORMAT_R32G32B32A32_SFLOAT; // D3DFMT_A32B32G32R32F
+        default: return VK_FORMAT_UNDEFINED;
+        }
+    }
+
+    VkFormat ddsDxgiFormat(uint32_t dxgiFormat)
+    {
+        switch (dxgiFormat)
+        {
+        case 2: return VK_FORMAT_R32G32B32A32_SFLOAT;
+        case 10: return VK_FORMAT_R16G16B16A16_SFLOAT;
+        case 11: return VK_FORMAT_R16G16B16A16_UNORM;
+        case 16: return VK_FORMAT_R32G32_SFLOAT;
+        case 24: return VK_FORMAT_A2B10G10R10_UNORM_PACK32;
+        case 26: return VK_FORMAT_B10G11R11_UFLOAT_PACK32;
+        case 28: return VK_FORMAT_R8G8B8A8_UNORM;
+        case 29: return VK_FORMAT_R8G8B8A8_SRGB;
+        case 34: return VK_FORMAT_R16G16_SFLOAT;
+        case 41: return VK_FORMAT_R32_SFLOAT;
+        case 49: return VK_FORMAT_R8G8_UNORM;
+        case 54: return VK_FORMAT_R16_SFLOAT;
+        case 56: return VK_FORMAT_R16_UNORM;
+        case 61: return VK_FORMAT_R8_UNORM;
+        case 67: return VK_FORMAT_E5B9G9R9_UFLOAT_PACK32;
+        case 71: return VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+        case 72: return VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+        case 74: return VK_FORMAT_BC2_UNORM_BLOCK;
+        case 75: return VK_FORMAT_BC2_SRGB_BLOCK;
+        case 77: return VK_FORMAT_BC3_UNORM_BLOCK;
+        case 78: return VK_FORMAT_BC3_SRGB_BLOCK;
+        case 80: return VK_FORMAT_BC4_UNORM_BLOCK;
+        case 81: return VK_FORMAT_BC4_SNORM_BLOCK;
+        case 83: return VK_FORMAT_BC5_UNORM_BLOCK;
+        case 84: return VK_FORMAT_BC5_SNORM_BLOCK;
+        case 87: return VK_FORMAT_B8G8R8A8_UNORM;
+        case 91: return VK_FORMAT_B8G8R8A8_SRGB;
+        case 95: return VK_FORMAT_BC6H_UFLOAT_BLOCK;
+        case 96: return VK_FORMAT_BC6H_SFLOAT_BLOCK;
+        case 98: return VK_FORMAT_BC7_UNORM_BLOCK;
+        case 99: return VK_FORMAT_BC7_SRGB_BLOCK;
+        default: return VK_FORMAT_UNDEFINED;
+        }
+    }
+
+    bool parseDds(const unsigned char* data, size_t size, TextureFile& texture)
+    {
+        constexpr size_t headerSize = 4 + 124;
+        constexpr size_t dx10HeaderSize = 20;
+        constexpr uint32_t DDPF_FOURCC = 0x4;
+        constexpr uint32_t DDPF_RGB = 0x40;
+        constexpr uint32_t DDSCAPS2_CUBEMAP = 0x200;
+        constexpr uint32_t DDSCAPS2_VOLUME = 0x200000;
+        constexpr uint32_t DDS_RESOURCE_MISC_TEXTURECUBE = 0x4;
+
+        if (size < headerSize || readValue<uint32_t>(data) != makeFourCC('D', 'D', 'S', ' '))
+            return false;
+
+        const unsigned char* header = data + 4;
+        texture._height = std::max(1u, readValue<uint32_t>(header + 8));
+        texture._width = readValue<uint32_t>(header + 12);
+        const uint32_t depth = readValue<uint32_t>(header + 20);
+        texture._levels = std::max(1u, readValue<uint32_t>(header + 24));
+        const unsigned char* pixelFormat = header + 72;
+        const uint32_t pixelFormatFlags = readValue<uint32_t>(pixelFormat + 4);
+        const uint32_t fourCC = readValue<uint32_t>(pixelFormat + 8);
+        const uint32_t caps2 = readValue<uint32_t>(header + 108);
+
+        size_t dataOffset = headerSize;
+        unsigned int arraySize = 1;
+        texture._cube = (caps2 & DDSCAPS2_CUBEMAP) != 0;
+        texture._format = VK_FORMAT_UNDEFINED;
+        if ((pixelFormatFlags & DDPF_FOURCC) && fourCC == makeFourCC('D', 'X', '1', '0'))
+        {
+            if (size < headerSize + dx10HeaderSize)
+                return false;
+            const unsigned char* dx10 = data + headerSize;
+            texture._format = ddsDxgiFormat(readValue<uint32_t>(dx10));
+            texture._cube = (readValue<uint32_t>(dx10 + 8) & DDS_RESOURCE_MISC_TEXTURECUBE) != 0;
+            arraySize = std::max(1u, readValue<uint32_t>(dx10 + 12));
+            dataOffset += dx10HeaderSize;
+        }
+        else if (pixelFormatFlags & DDPF_FOURCC)
+            texture._format = ddsFourCCFormat(fourCC);
+        else if ((pixelFormatFlags & DDPF_RGB) && readValue<uint32_t>(pixelFormat + 12) == 32)
+            texture._format = readValue<uint32_t>(pixelFormat + 16) == 0x000000ff ? VK_FORMAT_R8G8B8A8_UNORM : VK_FORMAT_B8G8R8A8_UNORM;
+
+        if (texture._format == VK_FORMAT_UNDEFINED || !getFormatBlock(texture._format, texture._block) || texture._width == 0)
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("loadTexture - unsupported DDS format\n"));
+            return false;
+        }
+
+        texture._depth = (caps2 & DDSCAPS2_VOLUME) ? std::max(1u, depth) : 1;
+        texture._layers = arraySize * (texture._cube ? 6 : 1);
+
+        // dds stores every layer with its full mip chain, so each (layer, level) pair is its own copy
+        size_t offset = dataOffset;
+        for (unsigned int layer = 0; layer < texture._layers; layer++)
+        {
+            for (unsigned int level = 0; level < texture._levels; level++)
+            {
+                const VkDeviceSize byteLength = levelSize(texture, level);
+                if (offset > size || byteLength > size - offset)
+                {
+                    g_logger->log(Vulkan::Logger::Level::Error, std::string("loadTexture - DDS file is truncated\n"));
+                    return false;
+                }
+
+                TextureSubresource subresource = { level, layer, 1, data + offset, byteLength };
+                texture._subresources.push_back(subresource);
+                offset += (size_t)byteLength;
+            }
+        }
+        return true;
+    }
+}
+
+bool Vulkan::loadTexture(Vulkan::Context& context, Vulkan::TransferBatch& batch, const std::string& filename, Vulkan::ImageDescriptor& result, VkImageLayout finalLayout)
+{
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("loadTexture - Failed to open ") + filename + "\n");
+        return false;
+    }
+
+    TextureFile texture = {};
+    if (!parseKtx2(file.data(), file.size(), texture) && !parseDds(file.data(), file.size(), texture))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("loadTexture - ") + filename + " is not a supported KTX2 or DDS file\n");
+        return false;
+    }
+
+    if (!Vulkan::createImage(context,
+        texture._width,
+        texture._height,
+        texture._depth,
+        texture._levels,
+        1,
+        texture._format,
+        VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        result,
+        texture._layers,
+        texture._cube ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT : 0))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("loadTexture - Failed to create image for ") + filename + "\n");
+        return false;
+    }
+
+    if (!batch.transitionImageLayout(result, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL))
+        return discardNewImage(context, batch, result);
+
+    // buffer offsets have to be a multiple of the block size, as well as of 4
+    const VkDeviceSize alignment = imageStagingAlignment(texture._block._bytes);
+    for (const TextureSubresource& subresource : texture._subresources)
+    {
+        VkBufferImageCopy region = {};
+        region.bufferOffset = 0;
+        region.bufferRowLength = 0;
+        region.bufferImageHeight = 0;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = subresource._level;
+        region.imageSubresource.baseArrayLayer = subresource._baseLayer;
+        region.imageSubresource.layerCount = subresource._layerCount;
+        region.imageOffset = { 0, 0, 0 };
+        region.imageExtent = { mipSize(texture._width, subresource._level), mipSize(texture._height, subresource._level), mipSize(texture._depth, subresource._level) };
+        if (!batch.copyToImage(result._image, subresource._data, subresource._size, alignment, region))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("loadTexture - Failed to upload ") + filename + "\n");
+            return discardNewImage(context, batch, result);
+        }
+    }
+
+    return batch.transitionImageLayout(result, finalLayout) || discardNewImage(context, batch, result);
+}
+
+bool Vulkan::loadTexture(Vulkan::Context& context, const std::string& filename, Vulkan::ImageDescriptor& result, VkImageLayout finalLayout)
+{
+    TransferBatch batch;
+    if (!batch.begin(context))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("loadTexture - Failed to begin transfer batch\n"));
+        return false;
+    }
+
+    if (!loadTexture(context, batch, filename, result, finalLayout))
+        return false;
+
+    if (!batch.submitAndWait())
+    {
+        result.destroy(context);
+        return false;
+    }
+    return true;
+}
+
+bool Vulkan::createImageView(Vulkan::Context& context, VkImage image, VkFormat requiredFormat, VkImageAspectFlags requiredAspectFlags, VkImageViewType imageViewType, VkImageView& result)
+{
+    VkImageViewCreateInfo createInfo;
+    memset(&createInfo, 0, sizeof(createInfo));
+    createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    createInfo.pNext = NULL;
+    createInfo.flags = 0;
+    createInfo.image = image;
+    createInfo.viewType = imageViewType;
+    createInfo.format = requiredFormat;
+    createInfo.components = VkComponentMapping{ VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
+    createInfo.subresourceRange.aspectMask = requiredAspectFlags;
+    createInfo.subresourceRange.baseMipLevel = 0;
+    createInfo.subresourceRange.levelCount = 1;
+    createInfo.subresourceRange.baseArrayLayer = 0;
+    createInfo.subresourceRange.layerCount = 1;
+
+    const VkResult imageViewCreationResult = vkCreateImageView(context._device, &createInfo, VK_NULL_HANDLE, &result);
+    if (imageViewCreationResult != VK_SUCCESS)
+        return false;
+
+    return true;
+}
+
+bool Vulkan::transitionImageLayout(Vulkan::Context& context,
+    VkImage image,
+    VkImageLayout oldLayout,
+    VkImageLayout newLayout,
+    VkAccessFlags srcAccessMask,
+    VkAccessFlags dstAccessMask,
+    VkPipelineStageFlags srcStageFlags,
+    VkPipelineStageFlags dstStageFlags,
+    VkCommandBuffer commandBuffer)
+{
+    VkImageMemoryBarrier barrier;
+    memset(&barrier, 0, sizeof(barrier));
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.pNext = NULL;
+    barrier.srcAccessMask = srcAccessMask;
+    barrier.dstAccessMask = dstAccessMask;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = (newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL || oldLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+        ? VK_IMAGE_ASPECT_DEPTH_BIT
+        : VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+
+    vkCmdPipelineBarrier(
+        commandBuffer,
+        srcStageFlags,
+        dstStageFlags,
+        0,
+        0,
+        nullptr,
+        0,
+        nullptr,
+        1,
+        &barrier);
+
+    return true;
+}
+
+bool Vulkan::transitionImageLayout(Vulkan::Context& context,
+    VkImage image,
+    VkImageLayout oldLayout,
+    VkImageLayout newLayout,
+    VkCommandBuffer commandBuffer)
+{
+    VkAccessFlags srcAccessMask = 0;
+    VkAccessFlags dstAccessMask = 0;
+
+    VkPipelineStageFlags sourceStage = 0;
+    VkPipelineStageFlags destinationStage = 0;
+
+    struct LayoutMapping {
+        VkAccessFlags accessMask = 0;
+        VkPipelineStageFlags stage = 0;
+
+        LayoutMapping() {} 
+        LayoutMapping(const LayoutMapping & src) 
+        :accessMask(src.accessMask)
+        ,stage(src.stage) { }
+
+        LayoutMapping(VkAccessFlags aMask, VkPipelineStageFlags st) 
+            :accessMask(aMask)
+            ,stage(st) {}
+    };
+
+    static const std::map<VkImageLayout, LayoutMapping> dstMappings = {
+        {VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
+        {VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
+        {VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
+        {VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
+        {VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
+        {VK_IMAGE_LAYOUT_GENERAL, {0, VK_PIPELINE_STAGE_TRANSFER_BIT }},
+        {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
+    };
+
+    srcAccessMask = 0;
+    sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    const auto it = dstMappings.find(newLayout);
+    if (it == dstMappings.end()) {
+        assert(0);
+        return false;
+    }
+
+    dstAccessMask = it->second.accessMask;
+    destinationStage = it->second.stage;
+
+    return transitionImageLayout(context, image, oldLayout, newLayout, srcAccessMask, dstAccessMask, sourceStage, destinationStage, commandBuffer);
+}
+
+bool Vulkan::transitionImageLayout(Vulkan::Context& context, Vulkan::ImageDescriptor& image, VkImageLayout newLayout, VkCommandBuffer commandBuffer)
+{
+    BarrierBatch barriers;
+    barriers.transitionImage(image, newLayout, VK_QUEUE_GRAPHICS_BIT);
+    barriers.flush(context, commandBuffer);
+    barriers.keepLayouts();
+    return true;
+}
+
+bool Vulkan::transitionImageLayoutAndSubmit(Vulkan::Context & context, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout)
+{
+    return queueImageTransition(context, image, oldLayout, newLayout) && flushImageTransitions(context);
+}
+
+bool Vulkan::transitionImageLayoutAndSubmit(Vulkan::Context& context, Vulkan::ImageDescriptor& image, VkImageLayout newLayout)
+{
+    return queueImageTransition(context, image, newLayout) && flushImageTransitions(context);
+}
+
+bool Vulkan::queueImageTransition(Vulkan::Context& context, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout)
+{
+    // done on the queue that uses the image, so no ownership transfer is needed afterwards
+    Context::Queue& queue = getQueue(context, VK_QUEUE_GRAPHICS_BIT);
+    if (context._pendingTransitions.references(image) && !flushImageTransitions(context))
+        return false;
+
+    context._pendingTransitions.transitionImage(image, oldLayout, newLayout, queue._flagBits);
+    return true;
+}
+
+bool Vulkan::queueImageTransition(Vulkan::Context& context, Vulkan::ImageDescriptor& image, VkImageLayout newLayout)
+{
+    Context::Queue& queue = getQueue(context, VK_QUEUE_GRAPHICS_BIT);
+    if (context._pendingTransitions.references(image._image) && !flushImageTransitions(context))
+        return false;
+
+    context._pendingTransitions.transitionImage(image, newLayout, queue._flagBits);
+    return true;
+}
+
+bool Vulkan::flushImageTransitions(Vulkan::Context& context)
+{
+    if (context._pendingTransitions.empty())
+        return true;
+
+    VkCommandBuffer commandBuffer;
+    Context::Queue& queue = getQueue(context, VK_QUEUE_GRAPHICS_BIT);
+    VkCommandPool commandPool = context._commandPools[queue._familyIndex];
+    if (!::createCommandBuffer(context, commandPool, &commandBuffer))
+        return false;
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+    {
+        recycleCommandBuffer(context, commandPool, commandBuffer);
+        return false;
+    }
+
+    context._pendingTransitions.flush(context, commandBuffer);
+    vkEndCommandBuffer(commandBuffer);
+
+    // tracked like any other upload, on the graphics timeline when there is one, and recycled by retireFinishedUploads
+    if (submitUpload(context, queue._queue, commandPool, commandBuffer, nullptr) == 0)
+    {
+        context._pendingTransitions.restoreLayouts();
+        return false;
+    }
+    context._pendingTransitions.keepLayouts();
+    return true;
+}
+
+void Vulkan::checkForFinishedPairCommandBufferBuffers(Context& context) {
+    std::vector<VkFence> finishedFences;
+    for (size_t i = 0; i < context._fenceCommandBufferPairs.size(); ) {
+        FenceCommandBufferPair& pair = context._fenceCommandBufferPairs[i];
+        if (vkGetFenceStatus(context._device, pair._fence) == VK_SUCCESS) {
+            finishedFences.push_back(pair._fence);
+            recycleCommandBuffer(context, pair._pool, pair._buffer);
+            context._fenceCommandBufferPairs[i] = context._fenceCommandBufferPairs.back();
+            context._fenceCommandBufferPairs.pop_back();
+        }
+        else {
+            i++;
+        }
+    }
+    recycleFences(context, finishedFences);
+    retireFinishedUploads(context);
+}
+
+VkFence Vulkan::acquireFence(Context& context)
+{
+    if (context._freeFences.empty())
+        return createFence(context._device, 0);
+
+    const VkFence fence = context._freeFences.back();
+    context._freeFences.pop_back();
+    return fence;
+}
+
+void Vulkan::recycleFences(Context& context, const std::vector<VkFence>& fences)
+{
+    if (fences.empty())
+        return;
+
+    // reset together, in one call
+    const VkResult resetFencesResult = vkResetFences(context._device, (uint32_t)fences.size(), &fences[0]);
+    assert(resetFencesResult == VK_SUCCESS);
+    if (resetFencesResult != VK_SUCCESS)
+    {
+        for (VkFence fence : fences)
+            vkDestroyFence(context._device, fence, nullptr);
+        return;
+    }
+    context._freeFences.insert(context._freeFences.end(), fences.begin(), fences.end());
+}
+
+void Vulkan::recycleCommandBuffer(Context& context, VkCommandPool commandPool, VkCommandBuffer commandBuffer)
+{
+    if (commandBuffer == VK_NULL_HANDLE)
+        return;
+
+    if (std::find(context._commandPools.begin(), context._commandPools.end(), commandPool) == context._commandPools.end())
+    {
+        vkFreeCommandBuffers(context._device, commandPool, 1, &commandBuffer);
+        return;
+    }
+
+    PooledCommandBuffer pooled;
+    pooled._buffer = commandBuffer;
+    pooled._pool = commandPool;
+    context._freeCommandBuffers.push_back(pooled);
+}
+
+Vulkan::QueueTimeline* Vulkan::getQueueTimeline(Context& context, VkQueue queue)
+{
+    if (!context._hasTimelineSemaphore)
+        return nullptr;
+    for (QueueTimeline& timeline : context._timelines)
+    {
+        if (timeline._queue == queue)
+            return &timeline;
+    }
+    return nullptr;
+}
+
+Vulkan::UploadToken Vulkan::submitUpload(Context& context, VkQueue queue, VkCommandPool commandPool, VkCommandBuffer commandBuffer, BufferPtr stagingBuffer)
+{
+    // transitions queued before this submission have to reach the queue first. flushImageTransitions empties the
+    // batch before it calls back in here
+    if (!context._pendingTransitions.empty() && queue == getQueue(context, VK_QUEUE_GRAPHICS_BIT)._queue)
+        flushImageTransitions(context);
+
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+
+    // the queue's timeline is signalled when there is one, and a fence is only created without it
+    QueueTimeline* timeline = getQueueTimeline(context, queue);
+    VkFence fence = VK_NULL_HANDLE;
+    uint64_t signalValue = 0;
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+    if (timeline != nullptr)
+    {
+        signalValue = timeline->_lastSignaled + 1;
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &signalValue;
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &timeline->_semaphore;
+    }
+    else
+    {
+        fence = acquireFence(context);
+        assert(fence != VK_NULL_HANDLE);
+    }
+
+    const VkResult submitResult = (timeline == nullptr && fence == VK_NULL_HANDLE) ? VK_ERROR_INITIALIZATION_FAILED : vkQueueSubmit(queue, 1, &submitInfo, fence);
+    assert(submitResult == VK_SUCCESS);
+    if (submitResult != VK_SUCCESS)
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("submitUpload - Failed to submit upload\n"));
+        if (fence != VK_NULL_HANDLE)
+            context._freeFences.push_back(fence); // never submitted, so still unsignalled
+        recycleCommandBuffer(context, commandPool, commandBuffer);
+        return 0;
+    }
+
+    PendingUpload upload;
+    upload._token = ++context._lastUploadToken;
+    upload._fence = fence;
+    upload._buffer = commandBuffer;
+    upload._pool = commandPool;
+    upload._stagingBuffer = stagingBuffer;
+    upload._acquireBuffer = VK_NULL_HANDLE;
+    upload._acquirePool = VK_NULL_HANDLE;
+    upload._semaphore = VK_NULL_HANDLE;
+    upload._releaseBuffer = VK_NULL_HANDLE;
+    upload._releaseSemaphore = VK_NULL_HANDLE;
+    upload._timeline = VK_NULL_HANDLE;
+    upload._timelineValue = 0;
+    if (timeline != nullptr)
+    {
+        timeline->_lastSignaled = signalValue;
+        upload._timeline = timeline->_semaphore;
+        upload._timelineValue = signalValue;
+    }
+    context._pendingUploads.push_back(upload);
+
+    return upload._token;
+}
+
+namespace
+{
+    Vulkan::PendingUpload* findPendingUpload(Vulkan::Context& context, Vulkan::UploadToken token)
+    {
+        for (Vulkan::PendingUpload& upload : context._pendingUploads)
+        {
+            if (upload._token == token)
+                return &upload;
+        }
+        return nullptr;
+    }
+
+    bool isTimelineValueReached(Vulkan::Context& context, VkSemaphore timeline, uint64_t value)
+    {
+        uint64_t currentValue = 0;
+        return vkGetSemaphoreCounterValue(context._device, timeline, &currentValue) == VK_SUCCESS && currentValue >= value;
+    }
+
+    bool waitForTimelineValues(Vulkan::Context& context, const std::vector<VkSemaphore>& timelines, const std::vector<uint64_t>& values)
+    {
+        if (timelines.empty())
+            return true;
+
+        VkSemaphoreWaitInfo waitInfo = {};
+        waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+        waitInfo.semaphoreCount = (uint32_t)timelines.size();
+        waitInfo.pSemaphores = &timelines[0];
+        waitInfo.pValues = &values[0];
+        const VkResult waitResult = vkWaitSemaphores(context._device, &waitInfo, std::numeric_limits<uint64_t>::max());
+        assert(waitResult == VK_SUCCESS);
+        return waitResult == VK_SUCCESS;
+    }
+
+    bool isPendingUploadDone(Vulkan::Context& context, const Vulkan::PendingUpload& upload)
+    {
+        if (upload._timeline != VK_NULL_HANDLE)
+            return isTimelineValueReached(context, upload._timeline, upload._timelineValue);
+        return vkGetFenceStatus(context._device, upload._fence) == VK_SUCCESS;
+    }
+}
+
+bool Vulkan::isUploadComplete(Context& context, UploadToken token)
+{
+    assert(token <= context._lastUploadToken);
+    const PendingUpload* upload = findPendingUpload(context, token);
+    if (upload == nullptr)
+        return true; // already retired
+
+    return isPendingUploadDone(context, *upload);
+}
+
+bool Vulkan::waitForUpload(Context& context, UploadToken token)
+{
+    const PendingUpload* upload = findPendingUpload(context, token);
+    if (upload == nullptr)
+        return true;
+
+    bool waited = false;
+    if (upload->_timeline != VK_NULL_HANDLE)
+        waited = waitForTimelineValues(context, { upload->_timeline }, { upload->_timelineValue });
+    else
+    {
+        const VkResult waitForFencesResult = vkWaitForFences(context._device, 1, &upload->_fence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+        assert(waitForFencesResult == VK_SUCCESS);
+        waited = waitForFencesResult == VK_SUCCESS;
+    }
+    retireFinishedUploads(context);
+    return waited;
+}
+
+bool Vulkan::waitForUploads(Context& context)
+{
+    // the highest value pending on each timeline covers everything before it
+    std::vector<VkFence> fences;
+    std::vector<VkSemaphore> timelines;
+    std::vector<uint64_t> values;
+    for (const PendingUpload& upload : context._pendingUploads)
+    {
+        if (upload._timeline == VK_NULL_HANDLE)
+        {
+            fences.push_back(upload._fence);
+            continue;
+        }
+
+        const auto it = std::find(timelines.begin(), timelines.end(), upload._timeline);
+        if (it == timelines.end())
+        {
+            timelines.push_back(upload._timeline);
+            values.push_back(upload._timelineValue);
+        }
+        else
+            values[it - timelines.begin()] = std::max(values[it - timelines.begin()], upload._timelineValue);
+    }
+
+    bool waited = waitForTimelineValues(context, timelines, values);
+    if (!fences.empty())
+    {
+        const VkResult waitForFencesResult = vkWaitForFences(context._device, (uint32_t)fences.size(), &fences[0], VK_TRUE, std::numeric_limits<uint64_t>::max());
+        assert(waitForFencesResult == VK_SUCCESS);
+        waited = waited && waitForFencesResult == VK_SUCCESS;
+    }
+    retireFinishedUploads(context);
+    return waited;
+}
+
+void Vulkan::retireFinishedUploads(Context& context)
+{
+    std::vector<VkFence> finishedFences;
+    for (size_t i = 0; i < context._pendingUploads.size(); )
+    {
+        PendingUpload& upload = context._pendingUploads[i];
+        if (isPendingUploadDone(context, upload))
+        {
+            if (upload._fence != VK_NULL_HANDLE)
+                finishedFences.push_back(upload._fence);
+            recycleCommandBuffer(context, upload._pool, upload._buffer);
+            if (upload._acquireBuffer != VK_NULL_HANDLE)
+                recycleCommandBuffer(context, upload._acquirePool, upload._acquireBuffer);
+            if (upload._semaphore != VK_NULL_HANDLE)
+                vkDestroySemaphore(context._device, upload._semaphore, nullptr);
+            if (upload._releaseBuffer != VK_NULL_HANDLE)
+                recycleCommandBuffer(context, upload._acquirePool, upload._releaseBuffer);
+            if (upload._releaseSemaphore != VK_NULL_HANDLE)
+                vkDestroySemaphore(context._device, upload._releaseSemaphore, nullptr);
+            context._pendingUploads[i] = context._pendingUploads.back();
+            context._pendingUploads.pop_back();
+        }
+        else
+            i++;
+    }
+
+    recycleFences(context, finishedFences);
+    context._stagingRing.retire(context);
+}
+
+namespace
+{
+    Vulkan::QueueTimeline* getGraphicsTimeline(Vulkan::Context& context)
+    {
+        return Vulkan::getQueueTimeline(context, Vulkan::getQueue(context, VK_QUEUE_GRAPHICS_BIT)._queue);
+    }
+
+    // true when graphics work submitted since the buffer was created, which may have bound it, or an upload into it,
+    // hasn't finished yet. Only the latest submission needs checking, as the queue finishes them in order
+    bool bufferMayBeInUse(Vulkan::Context& context, const Vulkan::BufferDescriptor& buffer)
+    {
+        if (!Vulkan::isUploadComplete(context, buffer._lastUploadToken))
+            return true;
+        return graphicsWorkPending(context, buffer._createdTimelineValue, buffer._createdFrame);
+    }
+
+    // true when graphics work that could have used the buffer has been submitted since it was created
+    bool usedSinceCreation(Vulkan::Context& context, const Vulkan::BufferDescriptor& buffer)
+    {
+        if (getGraphicsTimeline(context) != nullptr)
+            return lastGraphicsSubmission(context) > buffer._createdTimelineValue;
+        return buffer._createdFrame < context._frameNumber;
+    }
+
+    // waits for the work last submitted in a frame slot, on the graphics timeline if there is one
+    bool waitForFrameSlot(Vulkan::Context& context, unsigned int slot)
+    {
+        Vulkan::QueueTimeline* timeline = getGraphicsTimeline(context);
+        if (timeline != nullptr)
+        {
+            if (slot >= (unsigned int)context._frameTimelineValues.size() || context._frameTimelineValues[slot] == 0)
+                return true;
+            return waitForTimelineValues(context, { timeline->_semaphore }, { context._frameTimelineValues[slot] });
+        }
+
+        if (slot >= (unsigned int)context._fences.size())
+            return true;
+        const VkResult waitForFencesResult = vkWaitForFences(context._device, 1, &context._fences[slot], VK_TRUE, std::numeric_limits<uint64_t>::max());
+        assert(waitForFencesResult == VK_SUCCESS);
+        return waitForFencesResult == VK_SUCCESS;
+    }
+
+    const Vulkan::SubmittedFrame* findSubmittedFrame(Vulkan::Context& context, uint64_t frameNumber)
+    {
+        for (const Vulkan::SubmittedFrame& frame : context._submittedFrames)
+        {
+            if (frame._frameNumber == frameNumber)
+                return &frame;
+        }
+        return nullptr;
+    }
+}
+
+///////////////////////////////////// Vulkan TransferBatch ///////////////////////////////////////////////////////////////////
+
+namespace
+{
+    // a buffer the owner queue may still be reading has to be written behind a barrier on that queue. So does one that
+    // already belongs to the owner's queue family, as the rest of its contents would be lost if it was written elsewhere
+    // without the owner releasing it first
+    bool writesOnOwnerQueue(Vulkan::Context& context, const Vulkan::BufferDescriptor& buffer, bool transfersOwnership)
+    {
+        if (bufferMayBeInUse(context, buffer))
+            return true;
+        return transfersOwnership && (usedSinceCreation(context, buffer) || buffer._lastUploadToken != 0);
+    }
+
+    // the accesses an image in a given layout is expected to see, limited to the stages the recording queue knows about
+    void layoutAccessAndStage(VkImageLayout layout, unsigned int queueFlags, VkAccessFlags& accessMask, VkPipelineStageFlags& stageMask)
+    {
+        switch (layout)
+        {
+        case VK_IMAGE_LAYOUT_UNDEFINED:
+        case VK_IMAGE_LAYOUT_PREINITIALIZED:
+            accessMask = 0;
+            stageMask = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+            return;
+        case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
+            accessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            stageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+            return;
+        case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL:
+            accessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            stageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+            return;
+        case VK_IMAGE_LAYOUT_PRESENT_SRC_KHR:
+            accessMask = 0;
+            stageMask = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+            return;
+        default:
+            break;
+        }
+
+        const bool graphics = (queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+        const bool compute = (queueFlags & VK_QUEUE_COMPUTE_BIT) != 0;
+        if (layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL && (graphics || compute))
+        {
+            accessMask = VK_ACCESS_SHADER_READ_BIT;
+            stageMask = (graphics ? (VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT) : 0) | (compute ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : 0);
+            return;
+        }
+        if (layout == VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL && graphics)
+        {
+            accessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+            stageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+            return;
+        }
+        if (layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL && graphics)
+        {
+            accessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+            stageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+            return;
+        }
+
+        // GENERAL, or a layout the queue can't name the consumer of (e.g. SHADER_READ_ONLY on a transfer only queue)
+        accessMask = (graphics || compute) ? (VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT) : 0;
+        stageMask = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+    }
+
+    // the ways an uploaded buffer can be read on the owner queue
+    void bufferReadAccessAndStage(unsigned int queueFlags, VkAccessFlags& accessMask, VkPipelineStageFlags& stageMask)
+    {
+        accessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        stageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        if (queueFlags & VK_QUEUE_GRAPHICS_BIT)
+        {
+            accessMask |= VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+            stageMask |= VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        }
+        if (queueFlags & VK_QUEUE_COMPUTE_BIT)
+        {
+            accessMask |= VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+            stageMask |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+        }
+    }
+
+    // staying in a layout that is only read from has nothing to wait for. Layouts that can be written to still need a
+    // barrier, to order the writes that come before it against the ones after
+    bool needsTransition(VkImageLayout oldLayout, VkImageLayout newLayout)
+    {
+        if (oldLayout != newLayout)
+            return true;
+
+        switch (newLayout)
+        {
+        case VK_IMAGE_LAYOUT_UNDEFINED:
+        case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
+        case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL:
+        case VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL:
+        case VK_IMAGE_LAYOUT_PRESENT_SRC_KHR:
+            return false;
+        default:
+            return true;
+        }
+    }
+
+    struct LayoutRange
+    {
+        VkImageLayout _oldLayout;
+        uint32_t _baseMipLevel;
+        uint32_t _levelCount;
+        uint32_t _baseArrayLayer;
+        uint32_t _layerCount;
+    };
+
+    // splits the given mip levels of image into the fewest ranges whose subresources share a layout, leaving out those
+    // that don't need a transition to newLayout. Array layers split the same way as the layer before them share its ranges
+    void collectLayoutRanges(const Vulkan::ImageDescriptor& image, VkImageLayout newLayout, uint32_t baseMipLevel, uint32_t levelCount, std::vector<LayoutRange>& ranges)
+    {
+        ranges.clear();
+        if (image._layouts.empty())
+        {
+            // nothing is known about the image, so its contents can't be kept
+            ranges.push_back({ VK_IMAGE_LAYOUT_UNDEFINED, baseMipLevel, levelCount, 0, VK_REMAINING_ARRAY_LAYERS });
+            return;
+        }
+
+        const uint32_t endMipLevel = levelCount == VK_REMAINING_MIP_LEVELS ? image._mipLevels : std::min<uint32_t>(image._mipLevels, baseMipLevel + levelCount);
+        size_t previousBegin = 0;
+        for (uint32_t arrayLayer = 0; arrayLayer < image._arrayLayers; arrayLayer++)
+        {
+            const size_t layerBegin = ranges.size();
+            uint32_t mipLevel = baseMipLevel;
+            while (mipLevel < endMipLevel)
+            {
+                const VkImageLayout oldLayout = image.layout(mipLevel, arrayLayer);
+                uint32_t rangeEnd = mipLevel + 1;
+                while (rangeEnd < endMipLevel && image.layout(rangeEnd, arrayLayer) == oldLayout)
+                    rangeEnd++;
+
+                if (needsTransition(oldLayout, newLayout))
+                    ranges.push_back({ oldLayout, mipLevel, rangeEnd - mipLevel, arrayLayer, 1 });
+                mipLevel = rangeEnd;
+            }
+
+            bool sameAsPrevious = arrayLayer > 0 && ranges.size() - layerBegin == layerBegin - previousBegin;
+            for (size_t i = 0; sameAsPrevious && i < layerBegin - previousBegin; i++)
+            {
+                const LayoutRange& previous = ranges[previousBegin + i];
+                const LayoutRange& current = ranges[layerBegin + i];
+                sameAsPrevious = previous._oldLayout == current._oldLayout && previous._baseMipLevel == current._baseMipLevel && previous._levelCount == current._levelCount;
+            }
+
+            if (sameAsPrevious)
+            {
+                for (size_t i = previousBegin; i < layerBegin; i++)
+                    ranges[i]._layerCount++;
+                ranges.resize(layerBegin);
+            }
+            else
+                previousBegin = layerBegin;
+        }
+    }
+}
+
+void Vulkan::BarrierBatch::transitionImage(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, unsigned int queueFlags, uint32_t baseMipLevel, uint32_t levelCount, uint32_t baseArrayLayer, uint32_t layerCount)
+{
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = (newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL || oldLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+        ? VK_IMAGE_ASPECT_DEPTH_BIT
+        : VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = baseMipLevel;
+    barrier.subresourceRange.levelCount = levelCount;
+    barrier.subresourceRange.baseArrayLayer = baseArrayLayer;
+    barrier.subresourceRange.layerCount = layerCount;
+
+    VkPipelineStageFlags srcStage = 0;
+    VkPipelineStageFlags dstStage = 0;
+    layoutAccessAndStage(oldLayout, queueFlags, barrier.srcAccessMask, srcStage);
+    layoutAccessAndStage(newLayout, queueFlags, barrier.dstAccessMask, dstStage);
+    // nothing needs to be made available after a read
+    barrier.srcAccessMask &= VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+    addImageBarrier(barrier, srcStage, dstStage);
+}
+
+void Vulkan::BarrierBatch::transitionImage(Vulkan::ImageDescriptor& image, VkImageLayout newLayout, unsigned int queueFlags, uint32_t baseMipLevel, uint32_t levelCount)
+{
+    std::vector<LayoutRange> ranges;
+    collectLayoutRanges(image, newLayout, baseMipLevel, levelCount, ranges);
+    for (const LayoutRange& range : ranges)
+        transitionImage(image._image, range._oldLayout, newLayout, queueFlags, range._baseMipLevel, range._levelCount, range._baseArrayLayer, range._layerCount);
+    rememberLayouts(image);
+    image.setLayout(newLayout, baseMipLevel, levelCount);
+}
+
+void Vulkan::BarrierBatch::rememberLayouts(Vulkan::ImageDescriptor& image)
+{
+    for (const RememberedLayouts& remembered : _rememberedLayouts)
+    {
+        if (remembered._image == &image)
+            return;
+    }
+
+    RememberedLayouts remembered;
+    remembered._image = &image;
+    remembered._layouts = image._layouts;
+    _rememberedLayouts.push_back(remembered);
+}
+
+void Vulkan::BarrierBatch::restoreLayouts()
+{
+    for (RememberedLayouts& remembered : _rememberedLayouts)
+        remembered._image->_layouts.swap(remembered._layouts);
+    _rememberedLayouts.clear();
+}
+
+void Vulkan::BarrierBatch::keepLayouts()
+{
+    _rememberedLayouts.clear();
+}
+
+void Vulkan::BarrierBatch::addImageBarrier(const VkImageMemoryBarrier& barrier, VkPipelineStageFlags srcStage, VkPipelineStageFlags dstStage)
+{
+    _imageBarriers.push_back(barrier);
+    _srcStages.push_back(srcStage);
+    _dstStages.push_back(dstStage);
+}
+
+bool Vulkan::BarrierBatch::references(VkImage image) const
+{
+    for (const VkImageMemoryBarrier& barrier : _imageBarriers)
+    {
+        if (barrier.image == image)
+            return true;
+    }
+    return false;
+}
+
+void Vulkan::BarrierBatch::flush(Vulkan::Context& context, VkCommandBuffer commandBuffer)
+{
+    if (_imageBarriers.empty())
+        return;
+
+#if defined(VK_VERSION_1_3)
+    if (context._hasSynchronization2)
+    {
+        std::vector<VkImageMemoryBarrier2> barriers(_imageBarriers.size());
+        for (size_t i = 0; i < _imageBarriers.size(); i++)
+        {
+            const VkImageMemoryBarrier& barrier = _imageBarriers[i];
+            VkImageMemoryBarrier2& barrier2 = barriers[i];
+            barrier2 = {};
+            barrier2.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+            // the legacy stage and access bits have the same values in the 64 bit flags
+            barrier2.srcStageMask = _srcStages[i];
+            barrier2.srcAccessMask = barrier.srcAccessMask;
+            barrier2.dstStageMask = _dstStages[i];
+            barrier2.dstAccessMask = barrier.dstAccessMask;
+            barrier2.oldLayout = barrier.oldLayout;
+            barrier2.newLayout = barrier.newLayout;
+            barrier2.srcQueueFamilyIndex = barrier.srcQueueFamilyIndex;
+            barrier2.dstQueueFamilyIndex = barrier.dstQueueFamilyIndex;
+            barrier2.image = barrier.image;
+            barrier2.subresourceRange = barrier.subresourceRange;
+        }
+
+        VkDependencyInfo dependencyInfo = {};
+        dependencyInfo.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+        dependencyInfo.imageMemoryBarrierCount = (uint32_t)barriers.size();
+        dependencyInfo.pImageMemoryBarriers = &barriers[0];
+        vkCmdPipelineBarrier2(commandBuffer, &dependencyInfo);
+        clear();
+        return;
+    }
+#endif
+
+    VkPipelineStageFlags srcStage = 0;
+    VkPipelineStageFlags dstStage = 0;
+    for (size_t i = 0; i < _imageBarriers.size(); i++)
+    {
+        srcStage |= _srcStages[i];
+        dstStage |= _dstStages[i];
+    }
+    vkCmdPipelineBarrier(commandBuffer, srcStage, dstStage, 0, 0, nullptr, 0, nullptr, (uint32_t)_imageBarriers.size(), &_imageBarriers[0]);
+    clear();
+}
+
+void Vulkan::BarrierBatch::clear()
+{
+    _imageBarriers.clear();
+    _srcStages.clear();
+    _dstStages.clear();
+}
+
+Vulkan::TransferBatch::TransferBatch()
+    :_context(nullptr)
+    ,_queue(VK_NULL_HANDLE)
+    ,_commandPool(VK_NULL_HANDLE)
+    ,_commandBuffer(VK_NULL_HANDLE)
+    ,_queueFlags(0)
+    ,_minGranularity{ 1, 1, 1 }
+    ,_numCommands(0)
+    ,_requestedQueueFlags(0)
+    ,_requestedOwnerQueueFlags(0)
+    ,_stagingBytes(0)
+    ,_familyIndex(0)
+    ,_ownerFamilyIndex(0)
+    ,_ownerQueueFlags(0)
+    ,_ownerQueue(VK_NULL_HANDLE)
+    ,_ownerCommandPool(VK_NULL_HANDLE)
+    ,_ownerCommandBuffer(VK_NULL_HANDLE)
+    ,_numOwnerCommands(0)
+    ,_ownerQueueWritesStarted(false)
+    ,_acquireStages(0)
+    ,_releaseStages(0)
+    ,_pendingCommandBuffer(VK_NULL_HANDLE)
+    ,_pendingSrc(VK_NULL_HANDLE)
+    ,_pendingDst(VK_NULL_HANDLE)
+{
+}
+
+Vulkan::TransferBatch::~TransferBatch()
+{
+    if (isRecording())
+    {
+        g_logger->log(Vulkan::Logger::Level::Warn, std::string("TransferBatch - destroyed without being submitted. Recorded copies are discarded\n"));
+        abort();
+    }
+}
+
+void Vulkan::TransferBatch::abort()
+{
+    if (!isRecording())
+        return;
+
+    vkEndCommandBuffer(_commandBuffer);
+    recycleCommandBuffer(*_context, _commandPool, _commandBuffer);
+    if (_ownerCommandBuffer != VK_NULL_HANDLE)
+    {
+        vkEndCommandBuffer(_ownerCommandBuffer);
+        recycleCommandBuffer(*_context, _ownerCommandPool, _ownerCommandBuffer);
+    }
+    release(0, false);
+}
+
+bool Vulkan::TransferBatch::begin(Vulkan::Context& context, unsigned int queueFlagBits, unsigned int ownerQueueFlagBits)
+{
+    assert(!isRecording());
+    if (isRecording())
+        return false;
+
+    if (queueFlagBits >= 8 || context._queues[queueFlagBits].empty() || ownerQueueFlagBits >= 8 || context._queues[ownerQueueFlagBits].empty())
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("TransferBatch - no queue supports the requested flags\n"));
+        return false;
+    }
+
+    // images the batch writes to may have been created with a transition that hasn't been submitted yet
+    flushImageTransitions(context);
+
+    Context::Queue& queue = getQueue(context, queueFlagBits);
+    Context::Queue& ownerQueue = getQueue(context, ownerQueueFlagBits);
+    VkCommandPool commandPool = context._commandPools[queue._familyIndex];
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    if (!::createCommandBuffer(context, commandPool, &commandBuffer))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("TransferBatch - failed to create command buffer\n"));
+        return false;
+    }
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("TransferBatch - failed to begin command buffer\n"));
+        recycleCommandBuffer(context, commandPool, commandBuffer);
+        return false;
+    }
+
+    _context = &context;
+    _queue = queue._queue;
+    _commandPool = commandPool;
+    _commandBuffer = commandBuffer;
+    _queueFlags = queue._flagBits;
+    _minGranularity = queue._minGranularity;
+    _numCommands = 0;
+    _requestedQueueFlags = queueFlagBits;
+    _requestedOwnerQueueFlags = ownerQueueFlagBits;
+    _stagingBytes = 0;
+    _familyIndex = queue._familyIndex;
+    _ownerFamilyIndex = ownerQueue._familyIndex;
+    _ownerQueueFlags = ownerQueue._flagBits;
+    _ownerQueue = ownerQueue._queue;
+    _ownerCommandPool = context._commandPools[ownerQueue._familyIndex];
+    return true;
+}
+
+bool Vulkan::TransferBatch::copyToBuffer(BufferDescriptor& dst, const void* srcData, VkDeviceSize amount, VkDeviceSize dstOffset)
+{
+    if (amount == 0)
+        return true;
+
+    void* staging = reserveBufferCopy(dst, amount, dstOffset);
+    if (staging == nullptr)
+        return false;
+    copyToMappedMemory(staging, srcData, (size_t)amount, _stagingAllocations.back()._buffer->_writeCombined);
+    return true;
+}
+
+void* Vulkan::TransferBatch::reserveBufferCopy(BufferDescriptor& dst, VkDeviceSize amount, VkDeviceSize dstOffset)
+{
+    assert(isRecording());
+    assert(amount > 0);
+    assert(dstOffset + amount <= dst._size);
+    if (!isRecording() || amount == 0)
+        return nullptr;
+
+    // where a buffer's copies go is settled by the first write to it, and stays the same until the batch is submitted
+    if (std::find(_writtenBuffers.begin(), _writtenBuffers.end(), &dst) == _writtenBuffers.end())
+    {
+        _writtenBuffers.push_back(&dst);
+        if (writesOnOwnerQueue(*_context, dst, transfersOwnership()))
+            _ownerQueueBuffers.push_back(dst._buffer);
+    }
+    const bool onOwnerQueue = std::find(_ownerQueueBuffers.begin(), _ownerQueueBuffers.end(), dst._buffer) != _ownerQueueBuffers.end();
+    VkCommandBuffer commandBuffer = onOwnerQueue ? beginOwnerQueueWrites() : _commandBuffer;
+    if (commandBuffer == VK_NULL_HANDLE)
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("TransferBatch - Failed to begin command buffer on the owner queue\n"));
+        return nullptr;
+    }
+
+    StagingAllocation staging;
+    if (!_context->_stagingRing.allocate(*_context, amount, stagingAlignment, staging))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("TransferBatch - Failed to allocate staging memory\n"));
+        return nullptr;
+    }
+    _stagingAllocations.push_back(staging);
+    _stagingBytes += staging._size;
+
+    // consecutive copies between the same two buffers become regions of a single vkCmdCopyBuffer
+    if (staging._buffer->_buffer != _pendingSrc || dst._buffer != _pendingDst)
+    {
+        flushBufferRegions();
+        _pendingCommandBuffer = commandBuffer;
+        _pendingSrc = staging._buffer->_buffer;
+        _pendingDst = dst._buffer;
+    }
+
+    VkBufferCopy region;
+    region.srcOffset = staging._offset;
+    region.dstOffset = dstOffset;
+    region.size = amount;
+    _pendingRegions.push_back(region);
+
+    if (transfersOwnership() && !onOwnerQueue)
+    {
+        const auto released = std::find_if(_acquireBufferBarriers.begin(), _acquireBufferBarriers.end(), [&dst](const VkBufferMemoryBarrier& barrier) { return barrier.buffer == dst._buffer; });
+        if (released != _acquireBufferBarriers.end())
+        {
+            // grow the span handed over to cover this copy too
+            const VkDeviceSize end = std::max(released->offset + released->size, dstOffset + amount);
+            released->offset = std::min(released->offset, dstOffset);
+            released->size = end - released->offset;
+        }
+        else
+        {
+            VkPipelineStageFlags dstStage = 0;
+            VkBufferMemoryBarrier barrier = {};
+            barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            barrier.srcAccessMask = 0;
+            bufferReadAccessAndStage(_ownerQueueFlags, barrier.dstAccessMask, dstStage);
+            barrier.srcQueueFamilyIndex = _familyIndex;
+            barrier.dstQueueFamilyIndex = _ownerFamilyIndex;
+            barrier.buffer = dst._buffer;
+            barrier.offset = dstOffset;
+            barrier.size = amount;
+            _acquireBufferBarriers.push_back(barrier);
+            _acquireStages |= dstStage;
+        }
+    }
+    return staging._mappedData;
+}
+
+bool Vulkan::TransferBatch::copyToImage(VkImage image, const void* srcData, VkDeviceSize amount, VkDeviceSize alignment, const VkBufferImageCopy& region)
+{
+    void* staging = reserveImageCopy(image, amount, alignment, region);
+    if (staging == nullptr)
+        return false;
+    copyToMappedMemory(staging, srcData, (size_t)amount, _stagingAllocations.back()._buffer->_writeCombined);
+    return true;
+}
+
+void* Vulkan::TransferBatch::reserveImageCopy(VkImage image, VkDeviceSize amount, VkDeviceSize alignment, const VkBufferImageCopy& region)
+{
+    assert(isRecording());
+    if (!isRecording())
+        return nullptr;
+
+    StagingAllocation staging;
+    if (!_context->_stagingRing.allocate(*_context, amount, alignment, staging))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("TransferBatch - Failed to allocate staging memory\n"));
+        return nullptr;
+    }
+    _stagingAllocations.push_back(staging);
+    _stagingBytes += staging._size;
+
+    flushBufferRegions();
+    flushBarriers(image);
+
+    VkBufferImageCopy stagedRegion = region;
+    stagedRegion.bufferOffset += staging._offset;
+    vkCmdCopyBufferToImage(_commandBuffer, staging._buffer->_buffer, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &stagedRegion);
+    _numCommands++;
+    return staging._mappedData;
+}
+
+bool Vulkan::TransferBatch::transitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t baseMipLevel, uint32_t levelCount)
+{
+    assert(isRecording());
+    if (!isRecording())
+        return false;
+
+    // a second transition of the same image can't go into the same barrier call as the first
+    flushBarriers(image);
+    recordImageBarrier(image, oldLayout, newLayout, baseMipLevel, levelCount, 0, VK_REMAINING_ARRAY_LAYERS);
+    return true;
+}
+
+bool Vulkan::TransferBatch::transitionImageLayout(Vulkan::ImageDescriptor& image, VkImageLayout newLayout, uint32_t baseMipLevel, uint32_t levelCount)
+{
+    assert(isRecording());
+    if (!isRecording())
+        return false;
+
+    std::vector<LayoutRange> ranges;
+    collectLayoutRanges(image, newLayout, baseMipLevel, levelCount, ranges);
+    if (!ranges.empty())
+        flushBarriers(image._image);
+
+    // the ranges don't overlap, so they can all go into one barrier call
+    std::vector<LayoutRange> fromOwner;
+    for (const LayoutRange& range : ranges)
+    {
+        const bool transferLayout = range._oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL || range._oldLayout == VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        if (transfersOwnership() && !transferLayout && range._oldLayout != VK_IMAGE_LAYOUT_UNDEFINED)
+        {
+            // the owner queue has contents in there, and may still be reading them
+            recordImageAcquireFromOwner(image._image, range._oldLayout, newLayout, range._baseMipLevel, range._levelCount, range._baseArrayLayer, range._layerCount);
+            fromOwner.push_back(range);
+        }
+        else
+            recordImageBarrier(image._image, range._oldLayout, newLayout, range._baseMipLevel, range._levelCount, range._baseArrayLayer, range._layerCount);
+    }
+
+    const bool leavesTransfer = newLayout != VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    if (!fromOwner.empty() && leavesTransfer)
+    {
+        // taken over only to change the layout, so it is handed straight back
+        flushBarriers(image._image);
+        for (const LayoutRange& range : fromOwner)
+            recordImageBarrier(image._image, newLayout, newLayout, range._baseMipLevel, range._levelCount, range._baseArrayLayer, range._layerCount);
+    }
+    _barriers.rememberLayouts(image);
+    image.setLayout(newLayout, baseMipLevel, levelCount);
+    return true;
+}
+
+void Vulkan::TransferBatch::recordImageAcquireFromOwner(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t baseMipLevel, uint32_t levelCount, uint32_t baseArrayLayer, uint32_t layerCount)
+{
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = _ownerFamilyIndex;
+    barrier.dstQueueFamilyIndex = _familyIndex;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = (newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL || oldLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+        ? VK_IMAGE_ASPECT_DEPTH_BIT
+        : VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = baseMipLevel;
+    barrier.subresourceRange.levelCount = levelCount;
+    barrier.subresourceRange.baseArrayLayer = baseArrayLayer;
+    barrier.subresourceRange.layerCount = layerCount;
+
+    // the release goes on the owner queue, where it waits for the work submitted there before it
+    VkImageMemoryBarrier release = barrier;
+    VkPipelineStageFlags releaseStage = 0;
+    layoutAccessAndStage(oldLayout, _ownerQueueFlags, release.srcAccessMask, releaseStage);
+    release.srcAccessMask &= VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+    release.dstAccessMask = 0;
+    _releaseImageBarriers.push_back(release);
+    _releaseStages |= releaseStage;
+
+    // and the acquire here, once the batch's submission has waited for the release
+    VkPipelineStageFlags dstStage = 0;
+    barrier.srcAccessMask = 0;
+    layoutAccessAndStage(newLayout, _queueFlags, barrier.dstAccessMask, dstStage);
+    _barriers.addImageBarrier(barrier, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, dstStage);
+    _numCommands++;
+}
+
+VkCommandBuffer Vulkan::TransferBatch::recordOwnerReleases()
+{
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    if (!::createCommandBuffer(*_context, _ownerCommandPool, &commandBuffer))
+        return VK_NULL_HANDLE;
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+    {
+        recycleCommandBuffer(*_context, _ownerCommandPool, commandBuffer);
+        return VK_NULL_HANDLE;
+    }
+
+    vkCmdPipelineBarrier(commandBuffer, _releaseStages, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, (uint32_t)_releaseImageBarriers.size(), &_releaseImageBarriers[0]);
+    vkEndCommandBuffer(commandBuffer);
+    return commandBuffer;
+}
+
+void Vulkan::TransferBatch::recordImageBarrier(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t baseMipLevel, uint32_t levelCount, uint32_t baseArrayLayer, uint32_t layerCount)
+{
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = oldLayout;
+    barrier.newLayout = newLayout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = (newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL || oldLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+        ? VK_IMAGE_ASPECT_DEPTH_BIT
+        : VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = baseMipLevel;
+    barrier.subresourceRange.levelCount = levelCount;
+    barrier.subresourceRange.baseArrayLayer = baseArrayLayer;
+    barrier.subresourceRange.layerCount = layerCount;
+
+    VkPipelineStageFlags srcStage = 0;
+    VkPipelineStageFlags dstStage = 0;
+    layoutAccessAndStage(oldLayout, _queueFlags, barrier.srcAccessMask, srcStage);
+    layoutAccessAndStage(newLayout, _queueFlags, barrier.dstAccessMask, dstStage);
+    // nothing needs to be made available after a read
+    barrier.srcAccessMask &= VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+
+    const bool leavesTransfer = newLayout != VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    if (transfersOwnership() && leavesTransfer)
+    {
+        // the layout change becomes part of the release, and is repeated in the matching acquire on the owner queue
+        VkImageMemoryBarrier acquire = barrier;
+        acquire.srcQueueFamilyIndex = _familyIndex;
+        acquire.dstQueueFamilyIndex = _ownerFamilyIndex;
+        acquire.srcAccessMask = 0;
+        VkPipelineStageFlags acquireStage = 0;
+        layoutAccessAndStage(newLayout, _ownerQueueFlags, acquire.dstAccessMask, acquireStage);
+        _acquireImageBarriers.push_back(acquire);
+        _acquireStages |= acquireStage;
+
+        barrier.srcQueueFamilyIndex = _familyIndex;
+        barrier.dstQueueFamilyIndex = _ownerFamilyIndex;
+        barrier.dstAccessMask = 0;
+        dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+    }
+
+    _barriers.addImageBarrier(barrier, srcStage, dstStage);
+    _numCommands++;
+}
+
+void Vulkan::TransferBatch::flushBarriers(VkImage image)
+{
+    if (image == VK_NULL_HANDLE || _barriers.references(image))
+        _barriers.flush(*_context, _commandBuffer);
+}
+
+bool Vulkan::TransferBatch::blitImage(VkImage src, VkImageLayout srcLayout, VkImage dst, VkImageLayout dstLayout, const VkImageBlit& region, VkFilter filter)
+{
+    assert(isRecording());
+    assert(_queueFlags & VK_QUEUE_GRAPHICS_BIT);
+    if (!isRecording() || (_queueFlags & VK_QUEUE_GRAPHICS_BIT) == 0)
+        return false;
+
+    flushBufferRegions();
+    flushBarriers(src);
+    flushBarriers(dst);
+    vkCmdBlitImage(_commandBuffer, src, srcLayout, dst, dstLayout, 1, &region, filter);
+    _numCommands++;
+    return true;
+}
+
+Vulkan::UploadToken Vulkan::TransferBatch::submit()
+{
+    return submitRecorded(false);
+}
+
+Vulkan::UploadToken Vulkan::TransferBatch::submitRecorded(bool keepBufferOwnership)
+{
+    if (!isRecording())
+        return 0;
+
+    flushBufferRegions();
+    flushBarriers(VK_NULL_HANDLE);
+    if (!keepBufferOwnership)
+        recordBufferReleases();
+    if (_queue == _ownerQueue && !_writtenBuffers.empty())
+        recordWriteVisibility(_commandBuffer);
+    vkEndCommandBuffer(_commandBuffer);
+
+    const bool acquires = (!keepBufferOwnership && !_acquireBufferBarriers.empty()) || !_acquireImageBarriers.empty();
+    // images released by the owner queue need submitWithOwnershipTransfer, even when nothing is handed back
+    if ((acquires || !_releaseImageBarriers.empty()) && _ownerCommandBuffer == VK_NULL_HANDLE && !beginOwnerCommands())
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("TransferBatch - Failed to begin command buffer on the owner queue\n"));
+        recycleCommandBuffer(*_context, _commandPool, _commandBuffer);
+        release(0, false);
+        return 0;
+    }
+
+    if (_ownerCommandBuffer != VK_NULL_HANDLE)
+    {
+        if (_ownerQueueWritesStarted)
+            recordWriteVisibility(_ownerCommandBuffer);
+        if (acquires)
+        {
+            const bool buffers = !keepBufferOwnership && !_acquireBufferBarriers.empty();
+            vkCmdPipelineBarrier(_ownerCommandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, _acquireStages, 0,
+                0, nullptr,
+                buffers ? (uint32_t)_acquireBufferBarriers.size() : 0, buffers ? &_acquireBufferBarriers[0] : nullptr,
+                (uint32_t)_acquireImageBarriers.size(), _acquireImageBarriers.empty() ? nullptr : &_acquireImageBarriers[0]);
+            _numOwnerCommands++;
+        }
+        vkEndCommandBuffer(_ownerCommandBuffer);
+    }
+
+    UploadToken token = 0;
+    const bool hasCommands = _numCommands > 0 || _numOwnerCommands > 0;
+    if (!hasCommands)
+    {
+        recycleCommandBuffer(*_context, _commandPool, _commandBuffer);
+        recycleCommandBuffer(*_context, _ownerCommandPool, _ownerCommandBuffer);
+    }
+    else if (_ownerCommandBuffer == VK_NULL_HANDLE)
+        token = submitUpload(*_context, _queue, _commandPool, _commandBuffer, nullptr); // frees the command buffer if it fails
+    else if (_numCommands == 0)
+    {
+        // only the owner queue has anything to do
+        recycleCommandBuffer(*_context, _commandPool, _commandBuffer);
+        token = submitUpload(*_context, _ownerQueue, _ownerCommandPool, _ownerCommandBuffer, nullptr);
+    }
+    else
+        token = submitWithOwnershipTransfer();
+
+    if (token != 0)
+    {
+        for (BufferDescriptor* buffer : _writtenBuffers)
+            buffer->_lastUploadToken = token;
+    }
+    release(token, keepBufferOwnership && (token != 0 || !hasCommands));
+    return token;
+}
+
+bool Vulkan::TransferBatch::submitAndWait()
+{
+    if (!isRecording())
+        return false;
+
+    const bool hasCommands = _numCommands > 0 || _numOwnerCommands > 0 || !_pendingRegions.empty();
+    Vulkan::Context& context = *_context;
+    const UploadToken token = submit();
+    if (token == 0)
+        return !hasCommands;
+
+    return waitForUpload(context, token);
+}
+
+bool Vulkan::TransferBatch::flush()
+{
+    if (!isRecording())
+        return false;
+
+    Vulkan::Context& context = *_context;
+    const unsigned int queueFlagBits = _requestedQueueFlags;
+    const unsigned int ownerQueueFlagBits = _requestedOwnerQueueFlags;
+    const bool hasCommands = _numCommands > 0 || _numOwnerCommands > 0 || !_pendingRegions.empty();
+    // buffers stay with the transfer queue's family until the final submission, which hands them all over at once
+    if (submitRecorded(true) == 0 && hasCommands)
+        return false;
+
+    return begin(context, queueFlagBits, ownerQueueFlagBits);
+}
+
+void Vulkan::TransferBatch::flushBufferRegions()
+{
+    if (!_pendingRegions.empty())
+    {
+        vkCmdCopyBuffer(_pendingCommandBuffer, _pendingSrc, _pendingDst, (uint32_t)_pendingRegions.size(), &_pendingRegions[0]);
+        if (_pendingCommandBuffer == _ownerCommandBuffer)
+            _numOwnerCommands++;
+        else
+            _numCommands++;
+        _pendingRegions.clear();
+    }
+    _pendingCommandBuffer = VK_NULL_HANDLE;
+    _pendingSrc = VK_NULL_HANDLE;
+    _pendingDst = VK_NULL_HANDLE;
+}
+
+void Vulkan::TransferBatch::recordBufferReleases()
+{
+    if (_acquireBufferBarriers.empty())
+        return;
+
+    std::vector<VkBufferMemoryBarrier> releases = _acquireBufferBarriers;
+    for (VkBufferMemoryBarrier& barrier : releases)
+    {
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+    }
+    vkCmdPipelineBarrier(_commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, (uint32_t)releases.size(), &releases[0], 0, nullptr);
+    _numCommands++;
+}
+
+bool Vulkan::TransferBatch::beginOwnerCommands()
+{
+    assert(_ownerCommandBuffer == VK_NULL_HANDLE);
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    if (!::createCommandBuffer(*_context, _ownerCommandPool, &commandBuffer))
+        return false;
+
+    VkCommandBufferBeginInfo beginInfo = {};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+    {
+        recycleCommandBuffer(*_context, _ownerCommandPool, commandBuffer);
+        return false;
+    }
+
+    _ownerCommandBuffer = commandBuffer;
+    _numOwnerCommands = 0;
+    return true;
+}
+
+VkCommandBuffer Vulkan::TransferBatch::beginOwnerQueueWrites()
+{
+    // without a queue of its own the batch is recorded on the owner queue already
+    VkCommandBuffer commandBuffer = _queue == _ownerQueue ? _commandBuffer : _ownerCommandBuffer;
+    if (commandBuffer == VK_NULL_HANDLE)
+    {
+        if (!beginOwnerCommands())
+            return VK_NULL_HANDLE;
+        commandBuffer = _ownerCommandBuffer;
+    }
+
+    if (!_ownerQueueWritesStarted)
+    {
+        // reads submitted to the queue before this have to finish before the buffers are overwritten
+        flushBufferRegions();
+        VkAccessFlags readAccess = 0;
+        VkPipelineStageFlags readStages = 0;
+        bufferReadAccessAndStage(_ownerQueueFlags, readAccess, readStages);
+        vkCmdPipelineBarrier(commandBuffer, readStages, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+        _ownerQueueWritesStarted = true;
+    }
+    return commandBuffer;
+}
+
+void Vulkan::TransferBatch::recordWriteVisibility(VkCommandBuffer commandBuffer)
+{
+    // makes the copies visible to whatever is submitted to the queue after them
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    VkPipelineStageFlags readStages = 0;
+    bufferReadAccessAndStage(_ownerQueueFlags, barrier.dstAccessMask, readStages);
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, readStages, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+Vulkan::UploadToken Vulkan::TransferBatch::submitWithOwnershipTransfer()
+{
+    Vulkan::Context& context = *_context;
+    // with timelines, the owner submission waits on the transfer queue's timeline and signals the owner queue's one.
+    // Otherwise a semaphore links the two submissions and a fence tracks the second one
+    QueueTimeline* transferTimeline = getQueueTimeline(context, _queue);
+    QueueTimeline* ownerTimeline = getQueueTimeline(context, _ownerQueue);
+    const bool useTimelines = transferTimeline != nullptr && ownerTimeline != nullptr;
+    VkSemaphore semaphore = useTimelines ? VK_NULL_HANDLE : createSemaphore(context._device);
+    VkFence fence = useTimelines ? VK_NULL_HANDLE : acquireFence(context);
+    bool ready = useTimelines || (semaphore != VK_NULL_HANDLE && fence != VK_NULL_HANDLE);
+
+    // images the owner queue was using are released there first, behind the frames already submitted to it
+    const bool releases = !_releaseImageBarriers.empty();
+    VkCommandBuffer releaseBuffer = (ready && releases) ? recordOwnerReleases() : VK_NULL_HANDLE;
+    VkSemaphore releaseSemaphore = (ready && releases && !useTimelines) ? createSemaphore(context._device) : VK_NULL_HANDLE;
+    ready = ready && (!releases || (releaseBuffer != VK_NULL_HANDLE && (useTimelines || releaseSemaphore != VK_NULL_HANDLE)));
+
+    VkResult submitResult = ready ? VK_SUCCESS : VK_ERROR_INITIALIZATION_FAILED;
+    bool releaseSubmitted = false;
+    const uint64_t releaseValue = useTimelines ? ownerTimeline->_lastSignaled + 1 : 0;
+    VkSemaphore releaseSignal = useTimelines ? ownerTimeline->_semaphore : releaseSemaphore;
+    if (ready && releases)
+    {
+        VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &releaseValue;
+
+        VkSubmitInfo releaseSubmit = {};
+        releaseSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        releaseSubmit.pNext = useTimelines ? &timelineInfo : nullptr;
+        releaseSubmit.commandBufferCount = 1;
+        releaseSubmit.pCommandBuffers = &releaseBuffer;
+        releaseSubmit.signalSemaphoreCount = 1;
+        releaseSubmit.pSignalSemaphores = &releaseSignal;
+        submitResult = vkQueueSubmit(_ownerQueue, 1, &releaseSubmit, VK_NULL_HANDLE);
+        releaseSubmitted = submitResult == VK_SUCCESS;
+        if (releaseSubmitted && useTimelines)
+            ownerTimeline->_lastSignaled = releaseValue;
+    }
+
+    const uint64_t transferValue = useTimelines ? transferTimeline->_lastSignaled + 1 : 0;
+    const uint64_t acquireValue = useTimelines ? ownerTimeline->_lastSignaled + 1 : 0;
+    VkSemaphore transferSignal = useTimelines ? transferTimeline->_semaphore : semaphore;
+    const VkPipelineStageFlags releaseWaitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+    if (submitResult == VK_SUCCESS)
+    {
+        VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.waitSemaphoreValueCount = releases ? 1 : 0;
+        timelineInfo.pWaitSemaphoreValues = &releaseValue;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &transferValue;
+
+        VkSubmitInfo transferSubmit = {};
+        transferSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        transferSubmit.pNext = useTimelines ? &timelineInfo : nullptr;
+        if (releases)
+        {
+            transferSubmit.waitSemaphoreCount = 1;
+            transferSubmit.pWaitSemaphores = &releaseSignal;
+            transferSubmit.pWaitDstStageMask = &releaseWaitStage;
+        }
+        transferSubmit.commandBufferCount = 1;
+        transferSubmit.pCommandBuffers = &_commandBuffer;
+        transferSubmit.signalSemaphoreCount = 1;
+        transferSubmit.pSignalSemaphores = &transferSignal;
+        submitResult = vkQueueSubmit(_queue, 1, &transferSubmit, VK_NULL_HANDLE);
+        if (submitResult == VK_SUCCESS && useTimelines)
+            transferTimeline->_lastSignaled = transferValue;
+        if (submitResult != VK_SUCCESS && releaseSubmitted)
+            vkQueueWaitIdle(_ownerQueue); // the release is in flight, and its command buffer can't be freed before it's done
+    }
+
+    if (submitResult == VK_SUCCESS)
+    {
+        VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.waitSemaphoreValueCount = 1;
+        timelineInfo.pWaitSemaphoreValues = &transferValue;
+        timelineInfo.signalSemaphoreValueCount = 1;
+        timelineInfo.pSignalSemaphoreValues = &acquireValue;
+
+        // with nothing to acquire, the copies recorded for the owner queue are what waits
+        const VkPipelineStageFlags waitStages = _acquireStages != 0 ? _acquireStages : VK_PIPELINE_STAGE_TRANSFER_BIT;
+        VkSubmitInfo acquireSubmit = {};
+        acquireSubmit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        acquireSubmit.pNext = useTimelines ? &timelineInfo : nullptr;
+        acquireSubmit.waitSemaphoreCount = 1;
+        acquireSubmit.pWaitSemaphores = &transferSignal;
+        acquireSubmit.pWaitDstStageMask = &waitStages;
+        acquireSubmit.commandBufferCount = 1;
+        acquireSubmit.pCommandBuffers = &_ownerCommandBuffer;
+        if (useTimelines)
+        {
+            acquireSubmit.signalSemaphoreCount = 1;
+            acquireSubmit.pSignalSemaphores = &ownerTimeline->_semaphore;
+        }
+        submitResult = vkQueueSubmit(_ownerQueue, 1, &acquireSubmit, fence);
+        if (submitResult == VK_SUCCESS && useTimelines)
+            ownerTimeline->_lastSignaled = acquireValue;
+        if (submitResult != VK_SUCCESS)
+        {
+            // the transfer is already in flight, and its command buffer can't be freed before it's done
+            vkQueueWaitIdle(_queue);
+            vkQueueWaitIdle(_ownerQueue);
+        }
+    }
+
+    assert(submitResult == VK_SUCCESS);
+    if (submitResult != VK_SUCCESS)
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("TransferBatch - Failed to submit upload with ownership transfer\n"));
+        recycleCommandBuffer(context, _ownerCommandPool, _ownerCommandBuffer);
+        recycleCommandBuffer(context, _ownerCommandPool, releaseBuffer);
+        recycleCommandBuffer(context, _commandPool, _commandBuffer);
+        if (semaphore != VK_NULL_HANDLE)
+            vkDestroySemaphore(context._device, semaphore, nullptr);
+        if (releaseSemaphore != VK_NULL_HANDLE)
+            vkDestroySemaphore(context._device, releaseSemaphore, nullptr);
+        if (fence != VK_NULL_HANDLE)
+            vkDestroyFence(context._device, fence, nullptr); // its state is unknown after a failed submission
+        return 0;
+    }
+
+    // the fence (or timeline value) is on the owner submission, which can't finish before the transfer and release have
+    PendingUpload upload;
+    upload._token = ++context._lastUploadToken;
+    upload._fence = fence;
+    upload._buffer = _commandBuffer;
+    upload._pool = _commandPool;
+    upload._acquireBuffer = _ownerCommandBuffer;
+    upload._acquirePool = _ownerCommandPool;
+    upload._semaphore = semaphore;
+    upload._releaseBuffer = releaseBuffer;
+    upload._releaseSemaphore = releaseSemaphore;
+    upload._timeline = useTimelines ? ownerTimeline->_semaphore : VK_NULL_HANDLE;
+    upload._timelineValue = acquireValue;
+    context._pendingUploads.push_back(upload);
+    return upload._token;
+}
+
+void Vulkan::TransferBatch::release(UploadToken token, bool keepBufferOwnership)
+{
+    for (const StagingAllocation& allocation : _stagingAllocations)
+        _context->_stagingRing.commit(allocation, token);
+    _stagingAllocations.clear();
+    if (!keepBufferOwnership)
+    {
+        _writtenBuffers.clear();
+        _ownerQueueBuffers.clear();
+        _acquireBufferBarriers.clear();
+        _acquireStages = 0;
+    }
+    _acquireImageBarriers.clear();
+    _releaseImageBarriers.clear();
+    _releaseStages = 0;
+    _ownerCommandBuffer = VK_NULL_HANDLE;
+    _numOwnerCommands = 0;
+    _ownerQueueWritesStarted = false;
+    _barriers.clear();
+    // the transitions are on the gpu's way only if something was submitted
+    if (token != 0)
+        _barriers.keepLayouts();
+    else
+        _barriers.restoreLayouts();
+    _pendingRegions.clear();
+    _pendingCommandBuffer = VK_NULL_HANDLE;
+    _pendingSrc = VK_NULL_HANDLE;
+    _pendingDst = VK_NULL_HANDLE;
+    _commandBuffer = VK_NULL_HANDLE;
+    _numCommands = 0;
+    _stagingBytes = 0;
+}
 
+///////////////////////////////////// Vulkan UploadScheduler ///////////////////////////////////////////////////////////
 
-            if (!stagingBuffer->getBuffer(0).copyToAndFlush(context._device,
-                context._commandPools[queue._familyIndex],
-                queue._queue,
-                result._image,
-                VkOffset3D{ 0, 0, depthLevel },
-                VkExtent3D{ width, height,  queue._minGranularity.depth }))
+Vulkan::UploadScheduler::UploadScheduler()
+    :_bytesPerFrame(8 * 1024 * 1024)
+    ,_millisecondsPerFrame(2.0)
+    ,_numSubmitted(0)
+{
+}
+
+unsigned int Vulkan::UploadScheduler::numQueued() const
+{
+    unsigned int count = 0;
+    for (const std::deque<QueuedUpload>& queue : _queues)
+        count += (unsigned int)queue.size();
+    return count;
+}
+
+void Vulkan::UploadScheduler::enqueue(UploadPriority priority, VkDeviceSize bytes, UploadFunction upload, UploadSubmittedFunction submitted)
+{
+    assert(priority < UploadPriority::Count);
+    QueuedUpload queued;
+    queued._bytes = bytes;
+    queued._upload = upload;
+    queued._submitted = submitted;
+    queued._enqueueTime = std::chrono::steady_clock::now();
+    _queues[(unsigned int)priority].push_back(queued);
+
+    _stats._queueDepth[(unsigned int)priority]++;
+    _stats._queuedBytes += bytes;
+}
+
+void Vulkan::UploadScheduler::enqueueBufferData(UploadPriority priority, BufferDescriptorPtr dst, const void* data, VkDeviceSize size, VkDeviceSize dstOffset, UploadSubmittedFunction submitted)
+{
+    assert(dst != nullptr && dstOffset + size <= dst->_size);
+    const VkDeviceSize pieceSize = std::max<VkDeviceSize>(1, std::min<VkDeviceSize>(_bytesPerFrame, stagingBufferSize));
+    const unsigned char* src = reinterpret_cast<const unsigned char*>(data);
+    for (VkDeviceSize offset = 0; offset < size; offset += pieceSize)
+    {
+        const VkDeviceSize amount = std::min<VkDeviceSize>(pieceSize, size - offset);
+        std::shared_ptr<std::vector<unsigned char>> piece(new std::vector<unsigned char>(src + offset, src + offset + amount));
+        const VkDeviceSize pieceOffset = dstOffset + offset;
+        // only the last piece reports back - the data is complete once that one has been uploaded
+        const bool last = offset + amount >= size;
+        enqueue(priority, amount, [dst, piece, pieceOffset](TransferBatch& batch) {
+            return batch.copyToBuffer(*dst, piece->data(), (VkDeviceSize)piece->size(), pieceOffset);
+        }, last ? submitted : nullptr);
+    }
+}
+
+void Vulkan::UploadScheduler::enqueueImageData(UploadPriority priority, Context& context, ImageDescriptor& image, const void* pixels, unsigned int pixelSize, VkImageLayout finalLayout, bool generateMipMaps, UploadSubmittedFunction submitted)
+{
+    assert(image._image != VK_NULL_HANDLE && pixels != nullptr);
+    const VkDeviceSize size = (VkDeviceSize)pixelSize * image._extent.width * image._extent.height * image._extent.depth;
+    const unsigned char* src = reinterpret_cast<const unsigned char*>(pixels);
+    std::shared_ptr<std::vector<unsigned char>> copy(new std::vector<unsigned char>(src, src + size));
+    Context* uploadContext = &context;
+    ImageDescriptor* dst = &image;
+    enqueue(priority, size, [uploadContext, dst, copy, pixelSize, finalLayout, generateMipMaps](TransferBatch& batch) {
+        return updataImageData(*uploadContext, batch, *dst, copy->data(), dst->_mipLevels, pixelSize, dst->_extent.width, dst->_extent.height, dst->_extent.depth, finalLayout, generateMipMaps);
+    }, submitted);
+}
+
+Vulkan::UploadToken Vulkan::UploadScheduler::processFrame(Context& context)
+{
+    _stats._bytesLastFrame = 0;
+    _stats._millisecondsLastFrame = 0.0;
+    if (numQueued() == 0)
+        return 0;
+
+    TransferBatch batch;
+    if (!batch.begin(context))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("UploadScheduler - Failed to begin transfer batch\n"));
+        return 0;
+    }
+
+    const std::chrono::steady_clock::time_point frameStart = std::chrono::steady_clock::now();
+    std::vector<std::pair<unsigned int, QueuedUpload>> recorded;
+    VkDeviceSize recordedBytes = 0;
+    bool failed = false;
+    QueuedUpload failedUpload;
+    for (unsigned int priority = 0; priority < (unsigned int)UploadPriority::Count && !failed; priority++)
+    {
+        std::deque<QueuedUpload>& queue = _queues[priority];
+        while (!queue.empty())
+        {
+            const bool critical = priority == (unsigned int)UploadPriority::Critical;
+            const bool firstUpload = recorded.empty();
+            const double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+            if (!critical && !firstUpload && (recordedBytes + queue.front()._bytes > _bytesPerFrame || elapsed >= _millisecondsPerFrame))
+                break;
+
+            QueuedUpload queued = queue.front();
+            queue.pop_front();
+            _stats._queuedBytes -= queued._bytes;
+            _stats._queueDepth[priority]--;
+
+            if (!queued._upload(batch))
             {
-                g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - copyData\n"));
-                return false;
+                g_logger->log(Vulkan::Logger::Level::Error, std::string("UploadScheduler - Failed to record upload\n"));
+                failed = true;
+                failedUpload = queued;
+                break;
             }
+
+            recordedBytes += queued._bytes;
+            recorded.push_back(std::make_pair(priority, queued));
         }
     }
 
-    if (!Vulkan::transitionImageLayoutAndSubmit(context,
-        result._image,
-        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        finalLayout))
+    if (failed)
     {
-        g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - transitionImageLayout : VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL -> VK_IMAGE_LAYOUT_GENERAL\n"));
-        return false;
+        // the failed upload may have left partial copies in the batch, so none of it is submitted, and the batch discards
+        // them. The uploads recorded before it go back to the front of their queues, in order, to be recorded next frame
+        for (size_t i = recorded.size(); i > 0; i--)
+        {
+            const unsigned int priority = recorded[i - 1].first;
+            const QueuedUpload& queued = recorded[i - 1].second;
+            _queues[priority].push_front(queued);
+            _stats._queuedBytes += queued._bytes;
+            _stats._queueDepth[priority]++;
+        }
+
+        _stats._millisecondsLastFrame = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count();
+        if (failedUpload._submitted)
+            failedUpload._submitted(0);
+        return 0;
     }
-    return true;
+
+    const UploadToken token = batch.submit();
+
+    const std::chrono::steady_clock::time_point submitTime = std::chrono::steady_clock::now();
+    _stats._millisecondsLastFrame = std::chrono::duration<double, std::milli>(submitTime - frameStart).count();
+    if (token != 0)
+    {
+        _stats._bytesLastFrame = recordedBytes;
+        for (const std::pair<unsigned int, QueuedUpload>& upload : recorded)
+        {
+            const double latency = std::chrono::duration<double, std::milli>(submitTime - upload.second._enqueueTime).count();
+            _numSubmitted++;
+            _stats._averageLatencyMilliseconds += (latency - _stats._averageLatencyMilliseconds) / (double)_numSubmitted;
+            _stats._maxLatencyMilliseconds = std::max(_stats._maxLatencyMilliseconds, latency);
+        }
+    }
+
+    for (const std::pair<unsigned int, QueuedUpload>& upload : recorded)
+    {
+        if (upload.second._submitted)
+            upload.second._submitted(token);
+    }
+    return token;
 }
 
-bool Vulkan::createImage(Vulkan::Context& context,
-    const void* pixels, 
-    const unsigned int pixelSize, 
-    const unsigned int width, 
-    const unsigned int height, 
-    const unsigned int depth, 
-    const unsigned int samplesPrPixels,
-    VkFormat format,
-    Vulkan::ImageDescriptor & result, 
-    unsigned int mipMapLevels,
-    VkImageLayout finalLayout)
+///////////////////////////////////// Vulkan FramePacer ///////////////////////////////////////////////////////////////////
+
+Vulkan::FramePacer::FramePacer()
+    :_targetFramesPerSecond(0.0)
+    , _minSpinMilliseconds(1.0)
+    , _gpuBound(false)
+    , _sleepOvershootMilliseconds(0.0)
+    , _started(false)
 {
-    if (!Vulkan::createImage(context,
-        width,
-        height,
-        depth,
-        mipMapLevels,
-        samplesPrPixels,
-        format,
-        VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        result))
+}
+
+void Vulkan::FramePacer::reset()
+{
+    _started = false;
+    _gpuBound = false;
+    _sleepOvershootMilliseconds = 0.0;
+    _stats = FramePacerStats();
+}
+
+void Vulkan::FramePacer::waitUntil(std::chrono::steady_clock::time_point deadline)
+{
+    typedef std::chrono::duration<double, std::milli> Milliseconds;
+
+    const double spinMilliseconds = std::max(_minSpinMilliseconds, 2.0 * _sleepOvershootMilliseconds);
+    const double remaining = Milliseconds(deadline - std::chrono::steady_clock::now()).count();
+    if (remaining > spinMilliseconds)
     {
-        g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - Failed to create image\n"));
-        return false;
+        const double sleepMilliseconds = remaining - spinMilliseconds;
+        const std::chrono::steady_clock::time_point sleepStart = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::duration_cast<std::chrono::steady_clock::duration>(Milliseconds(sleepMilliseconds)));
+        const double overshoot = std::max(0.0, Milliseconds(std::chrono::steady_clock::now() - sleepStart).count() - sleepMilliseconds);
+        _sleepOvershootMilliseconds += (overshoot - _sleepOvershootMilliseconds) * 0.1;
     }
 
-    if (!Vulkan::transitionImageLayoutAndSubmit(context,
-        result._image,
-        VK_IMAGE_LAYOUT_UNDEFINED,
-        finalLayout))
+    while (std::chrono::steady_clock::now() < deadline)
+        std::this_thread::yield();
+}
+
+void Vulkan::FramePacer::pace(double gpuWaitMilliseconds, double gpuFrameMilliseconds)
+{
+    typedef std::chrono::duration<double, std::milli> Milliseconds;
+
+    // beginFrame calls this straight after waiting for the frame slot. Without timestamps, a wait that blocked returned as
+    // the gpu finished the frame holding the slot, so two in a row measure how long the gpu takes per frame. Frames that
+    // weren't measured leave the estimate as it is
+    constexpr double gpuBoundWaitMilliseconds = 0.1;
+    const std::chrono::steady_clock::time_point gpuCompletion = std::chrono::steady_clock::now();
+    const bool gpuBound = gpuWaitMilliseconds > gpuBoundWaitMilliseconds;
+    const bool timed = gpuFrameMilliseconds >= 0.0;
+    double measuredMilliseconds = gpuFrameMilliseconds;
+    if (!timed && gpuBound && _gpuBound)
+        measuredMilliseconds = Milliseconds(gpuCompletion - _lastGpuCompletion).count();
+    if (measuredMilliseconds >= 0.0)
     {
-        g_logger->log(Vulkan::Logger::Level::Error, std::string("createImage - transitionImageLayout : VK_IMAGE_LAYOUT_UNDEFINED -> VK_IMAGE_LAYOUT_GENERAL\n"));
-        return false;
+        const double gpuWeight = _stats._averageGpuFrameMilliseconds > 0.0 ? 0.1 : 1.0;
+        _stats._averageGpuFrameMilliseconds += (measuredMilliseconds - _stats._averageGpuFrameMilliseconds) * gpuWeight;
     }
+    _gpuBound = gpuBound;
+    _lastGpuCompletion = gpuCompletion;
 
-    if (pixels != nullptr) {
-        const bool imageUpdateSucceeded = updataImageData(context, result, pixels, mipMapLevels, pixelSize, width, height, depth, finalLayout);
-        return imageUpdateSucceeded;
+    if (_targetFramesPerSecond <= 0.0)
+    {
+        _started = false;
+        return;
     }
 
-    return true;
+    // a gpu slower than the target can't free the next slot any sooner than its own frame time, so the schedule follows
+    // the gpu instead of starting frames that would only block, and counting every one of them as missed
+    // without timestamps the estimate is only refreshed while the waits block, so it's only followed while they do
+    const double periodMilliseconds = 1000.0 / _targetFramesPerSecond;
+    const double gpuMilliseconds = timed || gpuBound ? _stats._averageGpuFrameMilliseconds : 0.0;
+    const double scheduleMilliseconds = std::max(periodMilliseconds, gpuMilliseconds);
+    const std::chrono::steady_clock::duration period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(Milliseconds(scheduleMilliseconds));
+    if (!_started)
+    {
+        _started = true;
+        _lastFrame = std::chrono::steady_clock::now();
+        _nextFrame = _lastFrame + period;
+        return;
+    }
+
+    // a frame that is already more than a frame late starts a new schedule, rather than rushing the next ones to catch up
+    if (std::chrono::steady_clock::now() > _nextFrame + period)
+    {
+        _nextFrame = std::chrono::steady_clock::now();
+        _stats._missedFrames++;
+    }
+    else
+        waitUntil(_nextFrame);
+
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    const double frameMilliseconds = Milliseconds(now - _lastFrame).count();
+    const double error = fabs(frameMilliseconds - periodMilliseconds);
+    _stats._numFrames++;
+    const double weight = 1.0 / (double)std::min<uint64_t>(_stats._numFrames, 64);
+    _stats._lastFrameMilliseconds = frameMilliseconds;
+    _stats._averageFrameMilliseconds += (frameMilliseconds - _stats._averageFrameMilliseconds) * weight;
+    _stats._averageErrorMilliseconds += (error - _stats._averageErrorMilliseconds) * weight;
+    _stats._maxErrorMilliseconds = std::max(_stats._maxErrorMilliseconds, error);
+    _stats._averageGpuWaitMilliseconds += (gpuWaitMilliseconds - _stats._averageGpuWaitMilliseconds) * weight;
+
+    _lastFrame = now;
+    _nextFrame += period;
 }
 
+///////////////////////////////////// Vulkan Readback ///////////////////////////////////////////////////////////////////
 
-bool Vulkan::createImageView(Vulkan::Context& context, VkImage image, VkFormat requiredFormat, VkImageAspectFlags requiredAspectFlags, VkImageViewType imageViewType, VkImageView& result)
+namespace
 {
-    VkImageViewCreateInfo createInfo;
-    memset(&createInfo, 0, sizeof(createInfo));
-    createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    createInfo.pNext = NULL;
-    createInfo.flags = 0;
-    createInfo.image = image;
-    createInfo.viewType = imageViewType;
-    createInfo.format = requiredFormat;
-    createInfo.components = VkComponentMapping{ VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
-    createInfo.subresourceRange.aspectMask = requiredAspectFlags;
-    createInfo.subresourceRange.baseMipLevel = 0;
-    createInfo.subresourceRange.levelCount = 1;
-    createInfo.subresourceRange.baseArrayLayer = 0;
-    createInfo.subresourceRange.layerCount = 1;
+    // readback buffers are handed out in steps of this size, so they can be reused for reads of a similar size
+    constexpr VkDeviceSize readbackBufferGranularity = 64 * 1024;
+    // free readback buffers kept for reuse, and the memory they may hold between them. Past either, the extra ones are freed
+    constexpr size_t maxFreeReadbackBuffers = 8;
+    constexpr VkDeviceSize maxFreeReadbackBytes = 64 * 1024 * 1024;
 
-    const VkResult imageViewCreationResult = vkCreateImageView(context._device, &createInfo, VK_NULL_HANDLE, &result);
-    if (imageViewCreationResult != VK_SUCCESS)
-        return false;
+    void releaseReadbackBuffer(Vulkan::Context& context, Vulkan::BufferDescriptorPtr buffer)
+    {
+        context._readbackBuffers.push_back(buffer);
 
-    return true;
+        VkDeviceSize totalSize = 0;
+        for (const Vulkan::BufferDescriptorPtr& freeBuffer : context._readbackBuffers)
+            totalSize += freeBuffer->_size;
+
+        // the buffers in the pool have finished with the gpu, so dropping the last reference frees them straight away
+        size_t numDropped = 0;
+        while (context._readbackBuffers.size() - numDropped > 1 && (context._readbackBuffers.size() - numDropped > maxFreeReadbackBuffers || totalSize > maxFreeReadbackBytes))
+        {
+            totalSize -= context._readbackBuffers[numDropped]->_size;
+            numDropped++;
+        }
+        if (numDropped > 0)
+            context._readbackBuffers.erase(context._readbackBuffers.begin(), context._readbackBuffers.begin() + numDropped);
+    }
+
+    Vulkan::BufferDescriptorPtr acquireReadbackBuffer(Vulkan::Context& context, VkDeviceSize size)
+    {
+        // smallest free buffer that fits
+        auto best = context._readbackBuffers.end();
+        for (auto it = context._readbackBuffers.begin(); it != context._readbackBuffers.end(); ++it)
+        {
+            if ((*it)->_size >= size && (best == context._readbackBuffers.end() || (*it)->_size < (*best)->_size))
+                best = it;
+        }
+        if (best != context._readbackBuffers.end())
+        {
+            Vulkan::BufferDescriptorPtr buffer = *best;
+            *best = context._readbackBuffers.back();
+            context._readbackBuffers.pop_back();
+            return buffer;
+        }
+
+        // the cpu reads these, so cached memory is much faster than the write combined memory used for staging
+        Vulkan::BufferDescriptorPtr buffer(new Vulkan::BufferDescriptor());
+        VmaAllocationInfo allocInfo = {};
+        if (!Vulkan::createBuffer(context, alignUp(size, readbackBufferGranularity), VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, *buffer, &allocInfo, VK_MEMORY_PROPERTY_HOST_CACHED_BIT))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("readback - Failed to create readback buffer of size ") + std::to_string(size) + "\n");
+            return Vulkan::BufferDescriptorPtr();
+        }
+        return buffer;
+    }
+
+    bool beginReadbackCommands(Vulkan::Context& context, Vulkan::Context::Queue*& queue, VkCommandPool& commandPool, VkCommandBuffer& commandBuffer)
+    {
+        // readbacks go on the graphics queue, which owns everything that is rendered to
+        queue = &Vulkan::getQueue(context, VK_QUEUE_GRAPHICS_BIT);
+        commandPool = context._commandPools[queue->_familyIndex];
+        commandBuffer = VK_NULL_HANDLE;
+        if (!::createCommandBuffer(context, commandPool, &commandBuffer))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("readback - failed to create command buffer\n"));
+            return false;
+        }
+
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("readback - failed to begin command buffer\n"));
+            Vulkan::recycleCommandBuffer(context, commandPool, commandBuffer);
+            return false;
+        }
+        return true;
+    }
+
+    Vulkan::UploadToken submitReadback(Vulkan::Context& context, Vulkan::Context::Queue& queue, VkCommandPool commandPool, VkCommandBuffer commandBuffer, Vulkan::BufferDescriptorPtr buffer, VkDeviceSize size, Vulkan::ReadbackCallback callback)
+    {
+        // make the copy visible to the host once the fence has signalled
+        VkMemoryBarrier hostBarrier = {};
+        hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+        vkEndCommandBuffer(commandBuffer);
+
+        const Vulkan::UploadToken token = Vulkan::submitUpload(context, queue._queue, commandPool, commandBuffer, nullptr); // frees the command buffer if it fails
+        if (token == 0)
+        {
+            releaseReadbackBuffer(context, buffer);
+            return 0;
+        }
+
+        Vulkan::PendingReadback readback;
+        readback._token = token;
+        readback._buffer = buffer;
+        readback._size = size;
+        readback._callback = callback;
+        context._pendingReadbacks.push_back(readback);
+        return token;
+    }
 }
 
-bool Vulkan::transitionImageLayout(Vulkan::Context& context,
-    VkImage image,
-    VkImageLayout oldLayout,
-    VkImageLayout newLayout,
-    VkAccessFlags srcAccessMask,
-    VkAccessFlags dstAccessMask,
-    VkPipelineStageFlags srcStageFlags,
-    VkPipelineStageFlags dstStageFlags,
-    VkCommandBuffer commandBuffer)
+Vulkan::UploadToken Vulkan::readbackBuffer(Context& context, BufferDescriptor& src, VkDeviceSize srcOffset, VkDeviceSize size, ReadbackCallback callback)
 {
-    VkImageMemoryBarrier barrier;
-    memset(&barrier, 0, sizeof(barrier));
+    assert(srcOffset + size <= src._size);
+    if (size == 0)
+        return 0;
+
+    Vulkan::BufferDescriptorPtr buffer = acquireReadbackBuffer(context, size);
+    if (buffer == nullptr)
+        return 0;
+
+    Context::Queue* queue = nullptr;
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    if (!beginReadbackCommands(context, queue, commandPool, commandBuffer))
+    {
+        releaseReadbackBuffer(context, buffer);
+        return 0;
+    }
+
+    // wait for whatever was writing to src in earlier submissions
+    VkMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    VkBufferCopy region = {};
+    region.srcOffset = srcOffset;
+    region.dstOffset = 0;
+    region.size = size;
+    vkCmdCopyBuffer(commandBuffer, src._buffer, buffer->_buffer, 1, &region);
+
+    return submitReadback(context, *queue, commandPool, commandBuffer, buffer, size, callback);
+}
+
+Vulkan::UploadToken Vulkan::readbackImage(Context& context, VkImage image, VkImageLayout layout, unsigned int pixelSize, VkOffset3D offset, VkExtent3D extent, ReadbackCallback callback, unsigned int mipLevel, unsigned int arrayLayer)
+{
+    assert(layout != VK_IMAGE_LAYOUT_UNDEFINED);
+    const VkDeviceSize size = (VkDeviceSize)pixelSize * extent.width * extent.height * extent.depth;
+    if (size == 0 || layout == VK_IMAGE_LAYOUT_UNDEFINED)
+        return 0;
+
+    Vulkan::BufferDescriptorPtr buffer = acquireReadbackBuffer(context, size);
+    if (buffer == nullptr)
+        return 0;
+
+    Context::Queue* queue = nullptr;
+    VkCommandPool commandPool = VK_NULL_HANDLE;
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    if (!beginReadbackCommands(context, queue, commandPool, commandBuffer))
+    {
+        releaseReadbackBuffer(context, buffer);
+        return 0;
+    }
+
+    VkImageMemoryBarrier barrier = {};
     barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.pNext = NULL;
-    barrier.srcAccessMask = srcAccessMask;
-    barrier.dstAccessMask = dstAccessMask;
-    barrier.oldLayout = oldLayout;
-    barrier.newLayout = newLayout;
+    barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    barrier.oldLayout = layout;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
     barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     barrier.image = image;
-    barrier.subresourceRange.aspectMask = (newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL || oldLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
-        ? VK_IMAGE_ASPECT_DEPTH_BIT
-        : VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
-    barrier.subresourceRange.layerCount = 1;
+    barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, mipLevel, 1, arrayLayer, 1 };
+    if (layout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL)
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
 
-    vkCmdPipelineBarrier(
-        commandBuffer,
-        srcStageFlags,
-        dstStageFlags,
-        0,
-        0,
-        nullptr,
-        0,
-        nullptr,
-        1,
-        &barrier);
+    VkBufferImageCopy region = {};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, mipLevel, arrayLayer, 1 };
+    region.imageOffset = offset;
+    region.imageExtent = extent;
+    vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, buffer->_buffer, 1, &region);
 
-    return true;
+    // put the image back the way it was found
+    if (layout != VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL)
+    {
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = layout;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    }
+
+    return submitReadback(context, *queue, commandPool, commandBuffer, buffer, size, callback);
 }
 
-bool Vulkan::transitionImageLayout(Vulkan::Context& context,
-    VkImage image,
-    VkImageLayout oldLayout,
-    VkImageLayout newLayout,
-    VkCommandBuffer commandBuffer)
+Vulkan::UploadToken Vulkan::readbackImage(Context& context, ImageDescriptor& image, unsigned int pixelSize, VkOffset3D offset, VkExtent3D extent, ReadbackCallback callback, unsigned int mipLevel, unsigned int arrayLayer)
 {
-    VkAccessFlags srcAccessMask = 0;
-    VkAccessFlags dstAccessMask = 0;
-
-    VkPipelineStageFlags sourceStage = 0;
-    VkPipelineStageFlags destinationStage = 0;
+    const VkImageLayout layout = image.layout(mipLevel, arrayLayer);
+    if (layout == VK_IMAGE_LAYOUT_UNDEFINED)
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("readbackImage - the image has no contents to read back\n"));
+        return 0;
+    }
+    return readbackImage(context, image._image, layout, pixelSize, offset, extent, callback, mipLevel, arrayLayer);
+}
 
-    struct LayoutMapping {
-        VkAccessFlags accessMask = 0;
-        VkPipelineStageFlags stage = 0;
+namespace
+{
+    // bytes per pixel of the formats a surface can have. 0 for anything else
+    unsigned int surfaceFormatPixelSize(VkFormat format)
+    {
+        switch (format)
+        {
+        case VK_FORMAT_R5G6B5_UNORM_PACK16:
+        case VK_FORMAT_B5G6R5_UNORM_PACK16:
+        case VK_FORMAT_R5G5B5A1_UNORM_PACK16:
+        case VK_FORMAT_B5G5R5A1_UNORM_PACK16:
+        case VK_FORMAT_A1R5G5B5_UNORM_PACK16:
+        case VK_FORMAT_R4G4B4A4_UNORM_PACK16:
+        case VK_FORMAT_B4G4R4A4_UNORM_PACK16:
+            return 2;
+        case VK_FORMAT_R8G8B8A8_UNORM:
+        case VK_FORMAT_R8G8B8A8_SRGB:
+        case VK_FORMAT_B8G8R8A8_UNORM:
+        case VK_FORMAT_B8G8R8A8_SRGB:
+        case VK_FORMAT_A8B8G8R8_UNORM_PACK32:
+        case VK_FORMAT_A8B8G8R8_SRGB_PACK32:
+        case VK_FORMAT_A2R10G10B10_UNORM_PACK32:
+        case VK_FORMAT_A2B10G10R10_UNORM_PACK32:
+        case VK_FORMAT_B10G11R11_UFLOAT_PACK32:
+            return 4;
+        case VK_FORMAT_R16G16B16A16_UNORM:
+        case VK_FORMAT_R16G16B16A16_SFLOAT:
+            return 8;
+        case VK_FORMAT_R32G32B32A32_SFLOAT:
+            return 16;
+        default:
+            return 0;
+        }
+    }
 
-        LayoutMapping() {} 
-        LayoutMapping(const LayoutMapping & src) 
-        :accessMask(src.accessMask)
-        ,stage(src.stage) { }
+    // records the captures requested for this frame into one command buffer, which endFrame submits after the effects'.
+    // Returns VK_NULL_HANDLE when there is nothing to capture
+    VkCommandBuffer recordSwapChainCaptures(Vulkan::Context& context, VkCommandPool commandPool, std::vector<Vulkan::PendingReadback>& captures)
+    {
+        std::vector<Vulkan::SwapChainCapture> requests;
+        requests.swap(context._swapChainCaptures);
+        if (requests.empty() || context._currentImageIndex >= (unsigned int)context._swapChainImages.size())
+            return VK_NULL_HANDLE;
+
+        const unsigned int pixelSize = surfaceFormatPixelSize(context._surfaceFormat.format);
+        const VkExtent3D extent = { context._swapChainSize.width, context._swapChainSize.height, 1 };
+        const VkDeviceSize size = (VkDeviceSize)pixelSize * extent.width * extent.height;
+        if (size == 0)
+            return VK_NULL_HANDLE;
+
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        if (!::createCommandBuffer(context, commandPool, &commandBuffer))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("endFrame - failed to create swapchain capture command buffer\n"));
+            return VK_NULL_HANDLE;
+        }
 
-        LayoutMapping(VkAccessFlags aMask, VkPipelineStageFlags st) 
-            :accessMask(aMask)
-            ,stage(st) {}
-    };
+        VkCommandBufferBeginInfo beginInfo = {};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS)
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("endFrame - failed to begin swapchain capture command buffer\n"));
+            Vulkan::recycleCommandBuffer(context, commandPool, commandBuffer);
+            return VK_NULL_HANDLE;
+        }
 
-    static const std::map<VkImageLayout, LayoutMapping> dstMappings = {
-        {VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
-        {VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
-        {VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
-        {VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
-        {VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
-        {VK_IMAGE_LAYOUT_GENERAL, {0, VK_PIPELINE_STAGE_TRANSFER_BIT }},
-        {VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, {VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT }},
-    };
+        const VkImage image = context._swapChainImages[context._currentImageIndex];
+        for (const Vulkan::SwapChainCapture& request : requests)
+        {
+            Vulkan::BufferDescriptorPtr buffer = acquireReadbackBuffer(context, size);
+            if (buffer == nullptr)
+                continue;
+
+            // the effects' command buffers come first in the same submission, and their rendering has to be done
+            VkImageMemoryBarrier barrier = {};
+            barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+            barrier.oldLayout = request._layout;
+            barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            barrier.image = image;
+            barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+            VkBufferImageCopy region = {};
+            region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+            region.imageOffset = { 0, 0, 0 };
+            region.imageExtent = extent;
+            vkCmdCopyImageToBuffer(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, buffer->_buffer, 1, &region);
+
+            // presentation waits on the semaphore the submission signals, which covers the transition back
+            barrier.srcAccessMask = 0;
+            barrier.dstAccessMask = 0;
+            barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+            barrier.newLayout = request._layout;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+            Vulkan::PendingReadback capture;
+            capture._token = 0;
+            capture._buffer = buffer;
+            capture._size = size;
+            capture._callback = request._callback;
+            captures.push_back(capture);
+        }
 
-    srcAccessMask = 0;
-    sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    const auto it = dstMappings.find(newLayout);
-    if (it == dstMappings.end()) {
-        assert(0);
-        return false;
+        VkMemoryBarrier hostBarrier = {};
+        hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+        vkEndCommandBuffer(commandBuffer);
+        return commandBuffer;
     }
 
-    dstAccessMask = it->second.accessMask;
-    destinationStage = it->second.stage;
+    // hands the captures submitted with a frame over to processReadbacks. They are tracked like an upload, which finishes
+    // with the frame - on the graphics timeline when there is one, otherwise with a fence submitted right after it
+    void trackSwapChainCaptures(Vulkan::Context& context, VkQueue queue, VkCommandPool commandPool, VkCommandBuffer commandBuffer, std::vector<Vulkan::PendingReadback>& captures, uint64_t timelineValue)
+    {
+        Vulkan::PendingUpload upload;
+        upload._token = 0;
+        upload._fence = VK_NULL_HANDLE;
+        upload._buffer = commandBuffer;
+        upload._pool = commandPool;
+        upload._acquireBuffer = VK_NULL_HANDLE;
+        upload._acquirePool = VK_NULL_HANDLE;
+        upload._semaphore = VK_NULL_HANDLE;
+        upload._releaseBuffer = VK_NULL_HANDLE;
+        upload._releaseSemaphore = VK_NULL_HANDLE;
+        upload._timeline = VK_NULL_HANDLE;
+        upload._timelineValue = 0;
+
+        Vulkan::QueueTimeline* timeline = Vulkan::getQueueTimeline(context, queue);
+        if (timeline != nullptr && timelineValue != 0)
+        {
+            upload._timeline = timeline->_semaphore;
+            upload._timelineValue = timelineValue;
+        }
+        else
+        {
+            // a fence submitted on its own signals once everything submitted to the queue before it has finished
+            upload._fence = Vulkan::acquireFence(context);
+            if (upload._fence == VK_NULL_HANDLE || vkQueueSubmit(queue, 0, nullptr, upload._fence) != VK_SUCCESS)
+            {
+                g_logger->log(Vulkan::Logger::Level::Error, std::string("endFrame - Failed to track swapchain capture, waiting for the queue instead\n"));
+                if (upload._fence != VK_NULL_HANDLE)
+                    Vulkan::recycleFences(context, { upload._fence });
+                vkQueueWaitIdle(queue);
+                for (Vulkan::PendingReadback& capture : captures)
+                {
+                    vmaInvalidateAllocation(g_allocator, capture._buffer->_memory, 0, capture._size);
+                    if (capture._callback)
+                        capture._callback(capture._buffer->_mappedData, capture._size);
+                    releaseReadbackBuffer(context, capture._buffer);
+                }
+                Vulkan::recycleCommandBuffer(context, commandPool, commandBuffer);
+                return;
+            }
+        }
 
-    return transitionImageLayout(context, image, oldLayout, newLayout, srcAccessMask, dstAccessMask, sourceStage, destinationStage, commandBuffer);
+        upload._token = ++context._lastUploadToken;
+        context._pendingUploads.push_back(upload);
+        for (Vulkan::PendingReadback& capture : captures)
+        {
+            capture._token = upload._token;
+            context._pendingReadbacks.push_back(capture);
+        }
+    }
 }
 
-bool Vulkan::transitionImageLayoutAndSubmit(Vulkan::Context & context, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout)
+bool Vulkan::captureSwapChainImage(Context& context, ReadbackCallback callback, VkImageLayout layout)
 {
-    VkCommandBuffer commandBuffer;
-    Context::Queue& queue = getQueue(context, VK_QUEUE_TRANSFER_BIT);
-    if (!::createCommandBuffer(context, context._commandPools[queue._familyIndex], &commandBuffer))
-        return false;
-
-    VkCommandBufferBeginInfo beginInfo;
-    memset(&beginInfo, 0, sizeof(beginInfo));
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-    beginInfo.pInheritanceInfo = NULL;
-    beginInfo.pNext = NULL;
-
-    const VkResult beginCommandResult = vkBeginCommandBuffer(commandBuffer, &beginInfo);
-    if (beginCommandResult != VK_SUCCESS)
+    if (surfaceFormatPixelSize(context._surfaceFormat.format) == 0)
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("captureSwapChainImage - the surface format can't be read back\n"));
         return false;
+    }
 
-    transitionImageLayout(context, image, oldLayout, newLayout, commandBuffer);
-
-    vkEndCommandBuffer(commandBuffer);
-
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-
-    VkFence fence = Vulkan::createFence(context._device, 0);
-    assert(fence != VK_NULL_HANDLE);
+    SwapChainCapture capture;
+    capture._layout = layout;
+    capture._callback = callback;
+    context._swapChainCaptures.push_back(capture);
+    return true;
+}
 
-    const VkResult submitResult = vkQueueSubmit(queue._queue, 1, &submitInfo, fence);
-    assert(submitResult == VK_SUCCESS);
+Vulkan::UploadToken Vulkan::readbackSwapChainImage(Context& context, unsigned int imageIndex, ReadbackCallback callback)
+{
+    assert(imageIndex < (unsigned int)context._swapChainImages.size());
+    if (imageIndex >= (unsigned int)context._swapChainImages.size())
+        return 0;
 
-    FenceCommandBufferPair pair{ fence, commandBuffer, context._commandPools[queue._familyIndex] };
-    context._fenceCommandBufferPairs.push_back(pair);
+    const unsigned int pixelSize = surfaceFormatPixelSize(context._surfaceFormat.format);
+    if (pixelSize == 0)
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("readbackSwapChainImage - the surface format can't be read back\n"));
+        return 0;
+    }
 
-    return true;
+    const VkExtent3D extent = { context._swapChainSize.width, context._swapChainSize.height, 1 };
+    return readbackImage(context, context._swapChainImages[imageIndex], VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, pixelSize, { 0, 0, 0 }, extent, callback);
 }
 
-void Vulkan::checkForFinishedPairCommandBufferBuffers(Context& context) {
-    while (!context._fenceCommandBufferPairs.empty()) {
-        for (int i = 0; i < context._fenceCommandBufferPairs.size(); ) {
-            FenceCommandBufferPair& pair = context._fenceCommandBufferPairs[i];
-            const VkResult waitForFencesResult = vkWaitForFences(context._device, 1, &pair._fence, VK_TRUE, 0);
-            if (waitForFencesResult == VK_SUCCESS) {
-                vkDestroyFence(context._device, pair._fence, nullptr);
-                vkFreeCommandBuffers(context._device, pair._pool, 1, &pair._buffer);
-                context._fenceCommandBufferPairs[i] = context._fenceCommandBufferPairs[context._fenceCommandBufferPairs.size() - 1];
-                context._fenceCommandBufferPairs.pop_back();
-            }
-            else {
-                i++;
-            }
-        }
+void Vulkan::processReadbacks(Context& context)
+{
+    // callbacks are called in submission order, so stop at the first readback that isn't done yet
+    size_t numFinished = 0;
+    while (numFinished < context._pendingReadbacks.size() && isUploadComplete(context, context._pendingReadbacks[numFinished]._token))
+    {
+        PendingReadback& readback = context._pendingReadbacks[numFinished];
+        vmaInvalidateAllocation(g_allocator, readback._buffer->_memory, 0, readback._size);
+        if (readback._callback)
+            readback._callback(readback._buffer->_mappedData, readback._size);
+        releaseReadbackBuffer(context, readback._buffer);
+        numFinished++;
     }
 
+    if (numFinished > 0)
+    {
+        context._pendingReadbacks.erase(context._pendingReadbacks.begin(), context._pendingReadbacks.begin() + numFinished);
+        retireFinishedUploads(context);
+    }
 }
 
 
@@ -1817,6 +5481,23 @@ bool Vulkan::createDevice(AppDescriptor & appDesc, Context & context)
           deviceExtensionNames.push_back("VK_EXT_memory_budget");
       if (appDesc.hasExtension(std::string("VK_KHR_get_physical_device_properties2")))
           deviceExtensionNames.push_back("VK_KHR_get_physical_device_properties2");
+#if defined(VK_EXT_host_image_copy)
+      if (appDesc.hasExtension(std::string(VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME)))
+      {
+          deviceExtensionNames.push_back(VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME);
+          // dependencies of host_image_copy that are core in 1.3
+          if (appDesc.hasExtension(std::string("VK_KHR_copy_commands2")))
+              deviceExtensionNames.push_back("VK_KHR_copy_commands2");
+          if (appDesc.hasExtension(std::string("VK_KHR_format_feature_flags2")))
+              deviceExtensionNames.push_back("VK_KHR_format_feature_flags2");
+      }
+#endif
+      if (appDesc.hasExtension(std::string(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME)))
+      {
+          deviceExtensionNames.push_back(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME);
+          if (appDesc.hasExtension(std::string("VK_KHR_external_memory")))
+              deviceExtensionNames.push_back("VK_KHR_external_memory");
+      }
 
       for (const char* extension : deviceExtensionNames)
           appDesc.addRequiredDeviceExtension(extension);
@@ -1856,7 +5537,88 @@ bool Vulkan::createDevice(AppDescriptor & appDesc, Context & context)
   neededFeatures.shaderDrawParameters = 1;
   deviceCreateInfo.pNext = &neededFeatures;
 
-  
+  context._hasExternalMemoryHost = false;
+  if (std::find(sRequiredDeviceExtensions.begin(), sRequiredDeviceExtensions.end(), std::string(VK_EXT_EXTERNAL_MEMORY_HOST_EXTENSION_NAME)) != sRequiredDeviceExtensions.end())
+  {
+      VkPhysicalDeviceExternalMemoryHostPropertiesEXT externalMemoryHostProperties = {};
+      externalMemoryHostProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+      VkPhysicalDeviceProperties2 properties2 = {};
+      properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+      properties2.pNext = &externalMemoryHostProperties;
+      vkGetPhysicalDeviceProperties2(appDesc._physicalDevices[appDesc._chosenPhysicalDevice], &properties2);
+      context._minImportedHostPointerAlignment = externalMemoryHostProperties.minImportedHostPointerAlignment;
+      context._hasExternalMemoryHost = context._minImportedHostPointerAlignment > 0;
+  }
+
+  context._hasHostImageCopy = false;
+#if defined(VK_EXT_host_image_copy)
+  VkPhysicalDeviceHostImageCopyFeaturesEXT hostImageCopyFeatures = {};
+  hostImageCopyFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_IMAGE_COPY_FEATURES_EXT;
+  if (std::find(sRequiredDeviceExtensions.begin(), sRequiredDeviceExtensions.end(), std::string(VK_EXT_HOST_IMAGE_COPY_EXTENSION_NAME)) != sRequiredDeviceExtensions.end())
+  {
+      VkPhysicalDeviceFeatures2 features2 = {};
+      features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+      features2.pNext = &hostImageCopyFeatures;
+      vkGetPhysicalDeviceFeatures2(appDesc._physicalDevices[appDesc._chosenPhysicalDevice], &features2);
+      if (hostImageCopyFeatures.hostImageCopy)
+      {
+          hostImageCopyFeatures.pNext = nullptr;
+          neededFeatures.pNext = &hostImageCopyFeatures;
+          context._hasHostImageCopy = true;
+
+          // the layouts images can be in while being written from the host
+          VkPhysicalDeviceHostImageCopyPropertiesEXT hostImageCopyProperties = {};
+          hostImageCopyProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_IMAGE_COPY_PROPERTIES_EXT;
+          VkPhysicalDeviceProperties2 properties2 = {};
+          properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+          properties2.pNext = &hostImageCopyProperties;
+          vkGetPhysicalDeviceProperties2(appDesc._physicalDevices[appDesc._chosenPhysicalDevice], &properties2);
+          context._hostImageCopyDstLayouts.resize(hostImageCopyProperties.copyDstLayoutCount);
+          hostImageCopyProperties.copySrcLayoutCount = 0;
+          hostImageCopyProperties.pCopyDstLayouts = context._hostImageCopyDstLayouts.empty() ? nullptr : &context._hostImageCopyDstLayouts[0];
+          vkGetPhysicalDeviceProperties2(appDesc._physicalDevices[appDesc._chosenPhysicalDevice], &properties2);
+      }
+  }
+#endif
+
+  // timeline semaphores are used through the core 1.2 entry points
+  context._hasTimelineSemaphore = false;
+  VkPhysicalDeviceTimelineSemaphoreFeatures timelineFeatures = {};
+  timelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+  if (appDesc._requiredVulkanVersion >= VK_API_VERSION_1_2 && context._deviceProperties.apiVersion >= VK_API_VERSION_1_2)
+  {
+      VkPhysicalDeviceFeatures2 features2 = {};
+      features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+      features2.pNext = &timelineFeatures;
+      vkGetPhysicalDeviceFeatures2(appDesc._physicalDevices[appDesc._chosenPhysicalDevice], &features2);
+      if (timelineFeatures.timelineSemaphore)
+      {
+          timelineFeatures.pNext = neededFeatures.pNext;
+          neededFeatures.pNext = &timelineFeatures;
+          context._hasTimelineSemaphore = true;
+      }
+  }
+
+  // barrier batches use the core 1.3 vkCmdPipelineBarrier2 when they can
+  context._hasSynchronization2 = false;
+#if defined(VK_VERSION_1_3)
+  VkPhysicalDeviceSynchronization2Features synchronization2Features = {};
+  synchronization2Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES;
+  if (appDesc._requiredVulkanVersion >= VK_API_VERSION_1_3 && context._deviceProperties.apiVersion >= VK_API_VERSION_1_3)
+  {
+      VkPhysicalDeviceFeatures2 features2 = {};
+      features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+      features2.pNext = &synchronization2Features;
+      vkGetPhysicalDeviceFeatures2(appDesc._physicalDevices[appDesc._chosenPhysicalDevice], &features2);
+      if (synchronization2Features.synchronization2)
+      {
+          synchronization2Features.pNext = neededFeatures.pNext;
+          neededFeatures.pNext = &synchronization2Features;
+          context._hasSynchronization2 = true;
+      }
+  }
+#endif
+
   VkResult creationResult = vkCreateDevice(appDesc._physicalDevices[appDesc._chosenPhysicalDevice], &deviceCreateInfo, nullptr /* no allocation callbacks at this time */, &context._device);
   assert(creationResult == VK_SUCCESS);
   if (creationResult != VK_SUCCESS)
@@ -1895,12 +5657,69 @@ bool Vulkan::createDevice(AppDescriptor & appDesc, Context & context)
       std::sort(context._queues[queueMask].begin(), context._queues[queueMask].end(), [](const Context::Queue & a, const Context::Queue & b) { return a._flagBits < b._flagBits; });
   }
 
+  // one timeline per queue - values signalled from different queues would otherwise not be increasing
+  context._timelines.clear();
+  if (context._hasTimelineSemaphore)
+  {
+      for (const Context::Queue& queue : context._queues[0])
+      {
+          QueueTimeline timeline;
+          timeline._queue = queue._queue;
+          timeline._semaphore = createTimelineSemaphore(context._device, 0);
+          timeline._lastSignaled = 0;
+          if (timeline._semaphore == VK_NULL_HANDLE)
+          {
+              // fall back to fences for every queue, rather than have timelines on some of them
+              g_logger->log(Vulkan::Logger::Level::Warn, std::string("Failed to create a queue timeline semaphore, using fences instead\n"));
+              destroyQueueTimelines(context);
+              break;
+          }
+          context._timelines.push_back(timeline);
+      }
+  }
+
 
   return creationResult == VK_SUCCESS;
 
 
 }
 
+namespace
+{
+    VkPresentModeKHR choosePresentMode(const Vulkan::AppDescriptor& appDesc, const std::vector<VkPresentModeKHR>& possiblePresentModes)
+    {
+        std::vector<VkPresentModeKHR> preferred;
+        switch (appDesc._presentPolicy)
+        {
+        case Vulkan::PresentPolicy::FromVSync:
+            preferred = appDesc._enableVSync ? std::vector<VkPresentModeKHR>{ VK_PRESENT_MODE_FIFO_KHR } : std::vector<VkPresentModeKHR>{ VK_PRESENT_MODE_IMMEDIATE_KHR };
+            break;
+        case Vulkan::PresentPolicy::Mailbox:
+            preferred = { VK_PRESENT_MODE_MAILBOX_KHR };
+            break;
+        case Vulkan::PresentPolicy::FifoRelaxed:
+            preferred = { VK_PRESENT_MODE_FIFO_RELAXED_KHR };
+            break;
+        case Vulkan::PresentPolicy::Immediate:
+            preferred = { VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR };
+            break;
+        case Vulkan::PresentPolicy::Fifo:
+            break;
+        }
+
+        for (VkPresentModeKHR presentMode : preferred)
+        {
+            if (std::find(possiblePresentModes.begin(), possiblePresentModes.end(), presentMode) != possiblePresentModes.end())
+                return presentMode;
+        }
+
+        // FIFO is required to be supported
+        if (!preferred.empty())
+            g_logger->log(Vulkan::Logger::Level::Info, std::string("createSwapChain - Preferred present mode not supported, using FIFO\n"));
+        return VK_PRESENT_MODE_FIFO_KHR;
+    }
+}
+
 bool Vulkan::createSwapChain(AppDescriptor & appDesc, Context & context)
 {
     appDesc._actualNumSamples = requestNumAASamples(context, appDesc._requestedNumSamples);
@@ -1955,10 +5774,14 @@ bool Vulkan::createSwapChain(AppDescriptor & appDesc, Context & context)
     VkSwapchainCreateInfoKHR swapChainCreateInfo;
     memset(&swapChainCreateInfo, 0, sizeof(swapChainCreateInfo));
     
-    const unsigned int imageCount = std::max<uint32_t>(std::min<uint32_t>(3, context._surfaceCapabilities.maxImageCount), context._surfaceCapabilities.minImageCount);
+    // maxImageCount is 0 when there is no upper limit
+    const uint32_t requestedImageCount = appDesc._swapChainImageCount != 0 ? appDesc._swapChainImageCount : 3;
+    const uint32_t maxImageCount = context._surfaceCapabilities.maxImageCount != 0 ? context._surfaceCapabilities.maxImageCount : std::numeric_limits<uint32_t>::max();
+    const unsigned int imageCount = std::max<uint32_t>(std::min<uint32_t>(requestedImageCount, maxImageCount), context._surfaceCapabilities.minImageCount);
     if (imageCount == 0)
         return false;
-    
+    if (appDesc._swapChainImageCount != 0 && imageCount != appDesc._swapChainImageCount)
+        g_logger->log(Vulkan::Logger::Level::Warn, std::string("createSwapChain - ") + std::to_string(appDesc._swapChainImageCount) + " swapchain images requested, using " + std::to_string(imageCount) + "\n");
 
     uint32_t presentModeCount = 0;
     VkResult getPossiblePresentModes0 = vkGetPhysicalDeviceSurfacePresentModesKHR(context._physicalDevice, context._surface, &presentModeCount, nullptr);
@@ -1967,13 +5790,7 @@ bool Vulkan::createSwapChain(AppDescriptor & appDesc, Context & context)
     VkResult getPossiblePresentModes1 = vkGetPhysicalDeviceSurfacePresentModesKHR(context._physicalDevice, context._surface, &presentModeCount, &possiblePresentModes[0]);
     assert(getPossiblePresentModes1 == VK_SUCCESS && presentModeCount != 0);
 
-    // we are betting that at least VK_PRESENT_MODE_FIFO_KHR or VK_PRESENT_MODE_IMMEDIATE_KHR is present
-    // TODO should we add mailboxing if possible?
-    VkPresentModeKHR presentModeWithVSync = (std::find(possiblePresentModes.begin(), possiblePresentModes.end(), VK_PRESENT_MODE_FIFO_KHR) != possiblePresentModes.end()) ?
-        VK_PRESENT_MODE_FIFO_KHR : VK_PRESENT_MODE_IMMEDIATE_KHR;
-    VkPresentModeKHR presentModeWithoutVSync = (std::find(possiblePresentModes.begin(), possiblePresentModes.end(), VK_PRESENT_MODE_IMMEDIATE_KHR) != possiblePresentModes.end()) ?
-        VK_PRESENT_MODE_IMMEDIATE_KHR : VK_PRESENT_MODE_FIFO_KHR;
-
+    context._presentMode = choosePresentMode(appDesc, possiblePresentModes);
     context._swapChainSize.width = appDesc._drawableSurfaceWidth;
     context._swapChainSize.height = appDesc._drawableSurfaceHeight;
     
@@ -1988,13 +5805,15 @@ bool Vulkan::createSwapChain(AppDescriptor & appDesc, Context & context)
     swapChainCreateInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
     swapChainCreateInfo.preTransform = context._surfaceCapabilities.currentTransform;
     swapChainCreateInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-    swapChainCreateInfo.presentMode = appDesc._enableVSync ? presentModeWithVSync : presentModeWithoutVSync;
+    swapChainCreateInfo.presentMode = context._presentMode;
     swapChainCreateInfo.clipped = VK_TRUE;
-//    swapChainCreateInfo.oldSwapchain = context._swapChain;
-    swapChainCreateInfo.oldSwapchain = VK_NULL_HANDLE;
+    // when recreating, the old swapchain is retired by this call even if it fails. recreateSwapChain destroys it later
+    swapChainCreateInfo.oldSwapchain = context._swapChain;
 
-    VkResult swapChainCreationResult = vkCreateSwapchainKHR(context._device, &swapChainCreateInfo, nullptr, &context._swapChain);
+    VkSwapchainKHR swapChain = VK_NULL_HANDLE;
+    VkResult swapChainCreationResult = vkCreateSwapchainKHR(context._device, &swapChainCreateInfo, nullptr, &swapChain);
 	assert(swapChainCreationResult == VK_SUCCESS);
+    context._swapChain = swapChain;
 	if (swapChainCreationResult != VK_SUCCESS)
         return false;
     
@@ -2012,50 +5831,58 @@ bool Vulkan::createSwapChain(AppDescriptor & appDesc, Context & context)
     return true;
 }
 
-bool Vulkan::createDepthBuffer(Context& context, uint32_t numSamples, VkExtent2D size, Vulkan::ImageDescriptor & image, VkImageView& imageView)
+namespace
 {
-    constexpr VkImageTiling requiredTiling = VK_IMAGE_TILING_OPTIMAL;
-    VkFormat depthFormat = findDepthFormat(context, requiredTiling);
-
-    if (!createImage(context,
-        size.width,
-        size.height,
-        1,
-        1,
-        numSamples,
-        depthFormat,
-        requiredTiling,
-        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        image))
-        return false;
+    // the transition to the attachment layout is only queued, so several depth buffers can share one submission
+    bool createDepthImage(Vulkan::Context& context, uint32_t numSamples, VkExtent2D size, Vulkan::ImageDescriptor& image, VkImageView& imageView)
+    {
+        constexpr VkImageTiling requiredTiling = VK_IMAGE_TILING_OPTIMAL;
+        VkFormat depthFormat = findDepthFormat(context, requiredTiling);
+
+        if (!Vulkan::createImage(context,
+            size.width,
+            size.height,
+            1,
+            1,
+            numSamples,
+            depthFormat,
+            requiredTiling,
+            VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            image))
+            return false;
 
-    /*
-    if (!allocateImageMemory(context, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory))
-        return false;
-        */
-    if (!createImageView(context, image._image, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT, VK_IMAGE_VIEW_TYPE_2D, imageView))
-        return false;
+        /*
+        if (!allocateImageMemory(context, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, image, memory))
+            return false;
+            */
+        if (!Vulkan::createImageView(context, image._image, depthFormat, VK_IMAGE_ASPECT_DEPTH_BIT, VK_IMAGE_VIEW_TYPE_2D, imageView))
+            return false;
 
-    if (!transitionImageLayoutAndSubmit(context, image._image, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL))
-        return false;
+        return Vulkan::queueImageTransition(context, image, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+    }
+}
 
-    return true;
+bool Vulkan::createDepthBuffer(Context& context, uint32_t numSamples, VkExtent2D size, Vulkan::ImageDescriptor & image, VkImageView& imageView)
+{
+    return createDepthImage(context, numSamples, size, image, imageView) && flushImageTransitions(context);
 }
 
 
 bool Vulkan::createDepthBuffers(Context & context, uint32_t numSamples, VkExtent2D size, std::vector<Vulkan::ImageDescriptor> & images, std::vector<VkImageView> & imageViews)
 {
+    // one per swapchain image, whatever the number of frames in flight. beginFrame doesn't hand out an image before the
+    // frame last rendering to it has finished, so the image's targets are free by then too
     const unsigned int numBuffers = (unsigned int)context._swapChainImages.size();
 	imageViews.resize(numBuffers);
 	images.resize(numBuffers);
 	for (unsigned int i = 0; i < numBuffers; i++)
 	{
-        if (!createDepthBuffer(context, numSamples, size,  images[i], imageViews[i]))
+        if (!createDepthImage(context, numSamples, size,  images[i], imageViews[i]))
             return false;
 	}
 
-	return true;
+	return flushImageTransitions(context);
 }
 
 bool Vulkan::createColorBuffers(Context & context)
@@ -2652,10 +6479,7 @@ bool Vulkan::createCommandPools(Context & context)
 
 bool Vulkan::resetCommandBuffer(Context& context, VkCommandBuffer& commandBuffer, unsigned int index)
 {
-    if (!context._fences.empty())
-    {
-        const VkResult waitForFencesResult = vkWaitForFences(context._device, 1, &context._fences[index], VK_TRUE, std::numeric_limits<uint64_t>::max());
-    }
+    waitForFrameSlot(context, index);
 
     VkCommandBufferResetFlags resetFlags = VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT;
     const VkResult resetCommandBufferResult = vkResetCommandBuffer(commandBuffer, resetFlags);
@@ -2696,6 +6520,44 @@ VkFence Vulkan::createFence(VkDevice device, VkFenceCreateFlags flags)
     return result;
 }
 
+VkSemaphore Vulkan::createSemaphore(VkDevice device)
+{
+    VkSemaphoreCreateInfo createInfo;
+    memset(&createInfo, 0, sizeof(VkSemaphoreCreateInfo));
+    createInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+    VkSemaphore result = VK_NULL_HANDLE;
+    const VkResult createSemaphoreResult = vkCreateSemaphore(device, &createInfo, nullptr, &result);
+    assert(createSemaphoreResult == VK_SUCCESS);
+    if (createSemaphoreResult != VK_SUCCESS)
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("Failed to create semaphore\n"));
+    }
+    return result;
+}
+
+VkSemaphore Vulkan::createTimelineSemaphore(VkDevice device, uint64_t initialValue)
+{
+    VkSemaphoreTypeCreateInfo typeInfo = {};
+    typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    typeInfo.initialValue = initialValue;
+
+    VkSemaphoreCreateInfo createInfo = {};
+    createInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    createInfo.pNext = &typeInfo;
+
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+    const VkResult createSemaphoreResult = vkCreateSemaphore(device, &createInfo, nullptr, &semaphore);
+    assert(createSemaphoreResult == VK_SUCCESS);
+    if (createSemaphoreResult != VK_SUCCESS)
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("Failed to create timeline semaphore\n"));
+        return VK_NULL_HANDLE;
+    }
+    return semaphore;
+}
+
 // VK_FENCE_CREATE_SIGNALED_BIT context._frameBuffers.size()
 std::vector<VkFence> Vulkan::createFences(VkDevice device, unsigned int count, VkFenceCreateFlags flags)
 {
@@ -2714,9 +6576,9 @@ std::vector<VkFence> Vulkan::createFences(VkDevice device, unsigned int count, V
     
 }
 
-std::vector<VkSemaphore> Vulkan::createSemaphores(Context & context)
+std::vector<VkSemaphore> Vulkan::createSemaphores(Context & context, unsigned int count)
 {
-    std::vector<VkSemaphore> semaphores(getNumInflightFrames(context));
+    std::vector<VkSemaphore> semaphores(count);
     for(unsigned int i=0 ; i < (unsigned int)semaphores.size() ; i++)
     {
         VkSemaphoreCreateInfo createInfo;
@@ -2734,14 +6596,101 @@ std::vector<VkSemaphore> Vulkan::createSemaphores(Context & context)
     return semaphores;
 }
 
+namespace
+{
+    // the frame pacer's gpu frame time comes from these. Not having them isn't an error
+    void createFrameTimestamps(Vulkan::Context& context, unsigned int numSlots)
+    {
+        const Vulkan::Context::Queue& queue = Vulkan::getQueue(context, VK_QUEUE_GRAPHICS_BIT);
+        uint32_t numFamilies = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(context._physicalDevice, &numFamilies, nullptr);
+        std::vector<VkQueueFamilyProperties> families(numFamilies);
+        vkGetPhysicalDeviceQueueFamilyProperties(context._physicalDevice, &numFamilies, families.data());
+        if (numSlots == 0 || queue._familyIndex >= numFamilies || families[queue._familyIndex].timestampValidBits == 0 || context._deviceProperties.limits.timestampPeriod <= 0.0f)
+            return;
+
+        VkQueryPoolCreateInfo createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        createInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        createInfo.queryCount = 2 * numSlots;
+        if (vkCreateQueryPool(context._device, &createInfo, nullptr, &context._frameTimestamps) != VK_SUCCESS)
+        {
+            g_logger->log(Vulkan::Logger::Level::Warn, std::string("Failed to create frame timestamp queries\n"));
+            context._frameTimestamps = VK_NULL_HANDLE;
+            return;
+        }
+
+        // recorded once, and submitted again with every frame in the slot. Frames wait for their slot before submitting,
+        // so the previous submission of these has finished by then
+        const VkCommandPool commandPool = context._commandPools[queue._familyIndex];
+        std::vector<VkCommandBuffer> commandBuffers;
+        if (!createCommandBuffers(context, commandPool, 2 * numSlots, &commandBuffers))
+        {
+            vkDestroyQueryPool(context._device, context._frameTimestamps, nullptr);
+            context._frameTimestamps = VK_NULL_HANDLE;
+            return;
+        }
+
+        for (unsigned int i = 0; i < (unsigned int)commandBuffers.size(); i++)
+        {
+            VkCommandBufferBeginInfo beginInfo = {};
+            beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            vkBeginCommandBuffer(commandBuffers[i], &beginInfo);
+            if (i % 2 == 0)
+            {
+                // at the stage the frame waits for its swapchain image in, so time spent waiting on presentation isn't counted
+                vkCmdResetQueryPool(commandBuffers[i], context._frameTimestamps, i, 2);
+                vkCmdWriteTimestamp(commandBuffers[i], VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, context._frameTimestamps, i);
+            }
+            else
+                vkCmdWriteTimestamp(commandBuffers[i], VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, context._frameTimestamps, i);
+            vkEndCommandBuffer(commandBuffers[i]);
+        }
+
+        context._frameTimestampCommands = commandBuffers;
+        context._frameTimestampsWritten.assign(numSlots, false);
+    }
+
+    void destroyFrameTimestamps(Vulkan::Context& context)
+    {
+        if (!context._frameTimestampCommands.empty())
+        {
+            const VkCommandPool commandPool = context._commandPools[Vulkan::getQueue(context, VK_QUEUE_GRAPHICS_BIT)._familyIndex];
+            vkFreeCommandBuffers(context._device, commandPool, (uint32_t)context._frameTimestampCommands.size(), context._frameTimestampCommands.data());
+        }
+        if (context._frameTimestamps != VK_NULL_HANDLE)
+            vkDestroyQueryPool(context._device, context._frameTimestamps, nullptr);
+        context._frameTimestamps = VK_NULL_HANDLE;
+        context._frameTimestampCommands.clear();
+        context._frameTimestampsWritten.clear();
+    }
+
+    // gpu time of the frame last submitted in slot, once it has finished. Negative when it wasn't timed
+    double frameGpuMilliseconds(Vulkan::Context& context, unsigned int slot)
+    {
+        if (slot >= (unsigned int)context._frameTimestampsWritten.size() || !context._frameTimestampsWritten[slot])
+            return -1.0;
+
+        uint64_t timestamps[2] = {};
+        if (vkGetQueryPoolResults(context._device, context._frameTimestamps, 2 * slot, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+            return -1.0;
+        // a counter that wrapped in between isn't worth untangling for one frame
+        if (timestamps[1] < timestamps[0])
+            return -1.0;
+        return (double)(timestamps[1] - timestamps[0]) * context._deviceProperties.limits.timestampPeriod / 1000000.0;
+    }
+}
+
 bool Vulkan::createSemaphores(AppDescriptor & appDesc, Context & context)
 {
-    context._imageAvailableSemaphores = createSemaphores(context);
-    context._renderFinishedSemaphores = createSemaphores(context);
+    // acquiring is per frame, while presenting waits per image
+    context._imageAvailableSemaphores = createSemaphores(context, getNumInflightFrames(context));
+    context._renderFinishedSemaphores = createSemaphores(context, (unsigned int)context._swapChainImages.size());
     context._fences = createFences(context._device, (unsigned int)getNumInflightFrames(context), VK_FENCE_CREATE_SIGNALED_BIT);
+    createFrameTimestamps(context, (unsigned int)context._fences.size());
     
-    return context._imageAvailableSemaphores.size() == context._renderFinishedSemaphores.size()
-    && context._imageAvailableSemaphores.size() == context._fences.size()
+    return context._imageAvailableSemaphores.size() == context._fences.size()
+    && context._renderFinishedSemaphores.size() == context._swapChainImages.size()
     && !context._imageAvailableSemaphores.empty();
 }
 
@@ -2759,6 +6708,7 @@ void Vulkan::destroySemaphores(Context& context)
     context._imageAvailableSemaphores.clear();
     context._renderFinishedSemaphores.clear();
     context._fences.clear();
+    destroyFrameTimestamps(context);
 
 }
 
@@ -2792,6 +6742,124 @@ Vulkan::BufferDescriptorPtr Vulkan::createBuffer(Context& context, VkDeviceSize
     return buffer;
 }
 
+namespace
+{
+    size_t systemPageSize()
+    {
+#if defined(_WIN32)
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        return (size_t)systemInfo.dwPageSize;
+#else
+        return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+    }
+
+    // the pointer and size handed to the driver have to be multiples of minImportedHostPointerAlignment. The range is
+    // widened to the alignment at both ends, which is only safe while that stays within the pages the range already touches
+    bool importHostMemory(Vulkan::Context& context, const void* hostPointer, VkDeviceSize size, VkBufferUsageFlags usage, Vulkan::ImportedBufferDescriptor& result)
+    {
+        if (!context._hasExternalMemoryHost || hostPointer == nullptr || size == 0)
+            return false;
+
+        const VkDeviceSize alignment = context._minImportedHostPointerAlignment;
+        const uintptr_t pageSize = (uintptr_t)systemPageSize();
+        const uintptr_t address = (uintptr_t)hostPointer;
+        const uintptr_t importAddress = address & ~(uintptr_t)(alignment - 1);
+        const VkDeviceSize bufferOffset = (VkDeviceSize)(address - importAddress);
+        const VkDeviceSize importSize = (bufferOffset + size + alignment - 1) & ~(alignment - 1);
+        const uintptr_t firstPage = address & ~(pageSize - 1);
+        const uintptr_t pagesEnd = (address + (uintptr_t)size + pageSize - 1) & ~(pageSize - 1);
+        if (importAddress < firstPage || importAddress + (uintptr_t)importSize > pagesEnd)
+            return false;
+
+        VkMemoryHostPointerPropertiesEXT pointerProperties = {};
+        pointerProperties.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+        if (vkGetMemoryHostPointerPropertiesEXT(context._device, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, (const void*)importAddress, &pointerProperties) != VK_SUCCESS)
+            return false;
+
+        VkExternalMemoryBufferCreateInfo externalInfo = {};
+        externalInfo.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+        externalInfo.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+
+        VkBufferCreateInfo createInfo = {};
+        createInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        createInfo.pNext = &externalInfo;
+        createInfo.size = size;
+        createInfo.usage = usage;
+        createInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (vkCreateBuffer(context._device, &createInfo, nullptr, &result._buffer) != VK_SUCCESS)
+            return false;
+        result._device = context._device;
+
+        VkMemoryRequirements requirements;
+        vkGetBufferMemoryRequirements(context._device, result._buffer, &requirements);
+        const uint32_t memoryTypeBits = requirements.memoryTypeBits & pointerProperties.memoryTypeBits;
+        if (memoryTypeBits == 0 || (bufferOffset % requirements.alignment) != 0 || bufferOffset + requirements.size > importSize)
+        {
+            result.destroy();
+            return false;
+        }
+
+        uint32_t memoryTypeIndex = 0;
+        while ((memoryTypeBits & (1u << memoryTypeIndex)) == 0)
+            memoryTypeIndex++;
+
+        VkImportMemoryHostPointerInfoEXT importInfo = {};
+        importInfo.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+        importInfo.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+        importInfo.pHostPointer = (void*)importAddress;
+
+        VkMemoryAllocateInfo allocateInfo = {};
+        allocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocateInfo.pNext = &importInfo;
+        allocateInfo.allocationSize = importSize;
+        allocateInfo.memoryTypeIndex = memoryTypeIndex;
+        if (vkAllocateMemory(context._device, &allocateInfo, nullptr, &result._importedMemory) != VK_SUCCESS)
+        {
+            result.destroy();
+            return false;
+        }
+
+        if (vkBindBufferMemory(context._device, result._buffer, result._importedMemory, bufferOffset) != VK_SUCCESS)
+        {
+            result.destroy();
+            return false;
+        }
+
+        result._size = (unsigned int)size;
+        // the gpu reads the application memory directly. Writes to it go through the application's own pointer
+        result._mappable = false;
+        result._mappedData = nullptr;
+        return true;
+    }
+}
+
+Vulkan::BufferDescriptorPtr Vulkan::importHostBuffer(Context& context, const void* hostPointer, VkDeviceSize size, VkBufferUsageFlags usage, std::shared_ptr<const void> owner)
+{
+    std::shared_ptr<Vulkan::ImportedBufferDescriptor> imported(new Vulkan::ImportedBufferDescriptor());
+    if (importHostMemory(context, hostPointer, size, usage, *imported))
+    {
+        imported->_owner = owner;
+        return imported;
+    }
+
+    if (context._hasExternalMemoryHost)
+        g_logger->log(Vulkan::Logger::Level::Verbose, std::string("importHostBuffer - could not import host pointer, copying ") + std::to_string(size) + " bytes instead\n");
+
+    // fallback - a regular device local buffer with the data copied in
+    const VkMemoryPropertyFlags preferredProperties = context._hasHostVisibleDeviceLocalMemory ? (VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) : 0;
+    Vulkan::BufferDescriptorPtr buffer(new Vulkan::BufferDescriptor());
+    if (!createBuffer(context, size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, *buffer, nullptr, preferredProperties))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("importHostBuffer - Failed to create buffer of size ") + std::to_string(size) + " bytes\n");
+        return Vulkan::BufferDescriptorPtr();
+    }
+
+    copyDataToIndexOrVertexBuffer(context, hostPointer, size, buffer);
+    return buffer;
+}
+
 Vulkan::PersistentBufferPtr Vulkan::lookupPersistentBuffer(Context& context, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, const std::string tag, int numBuffers)
 {
     const int numInternalBuffers = (numBuffers <= 0) ? Vulkan::getNumInflightFrames(context) : numBuffers;
@@ -2825,8 +6893,9 @@ Vulkan::PersistentBufferPtr Vulkan::createPersistentBuffer(Context& context, VkD
         else
             pBuffer = it->second;
 
+        // frames in flight can still be reading the old buffers
         for (auto & buf : pBuffer->_buffers)
-            destroyBufferDescriptor(buf);
+            buf.destroy(context);
 
         if(!createBuffers(pBuffer, (unsigned int)size))
             return Vulkan::PersistentBufferPtr();
@@ -2840,7 +6909,7 @@ Vulkan::PersistentBufferPtr Vulkan::createPersistentBuffer(Context& context, VkD
 }
 
 
-bool Vulkan::createBuffer(Context & context, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, BufferDescriptor & bufDesc, VmaAllocationInfo * aInfo)
+bool Vulkan::createBuffer(Context & context, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, BufferDescriptor & bufDesc, VmaAllocationInfo * aInfo, VkMemoryPropertyFlags preferredProperties)
 {
     VkBufferCreateInfo createInfo;
     memset(&createInfo, 0, sizeof(VkBufferCreateInfo));
@@ -2852,11 +6921,17 @@ bool Vulkan::createBuffer(Context & context, VkDeviceSize size, VkBufferUsageFla
     VmaAllocationCreateInfo allocCreateInfo = {};
     allocCreateInfo.flags = 0;
     allocCreateInfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
-    if (aInfo != nullptr)
+    // host visible buffers stay mapped for their whole lifetime. Mapping is ignored by vma if the buffer doesn't end up in host visible memory
+    if (aInfo != nullptr || ((properties | preferredProperties) & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT))
         allocCreateInfo.flags |= VMA_ALLOCATION_CREATE_MAPPED_BIT;
 
+    // buffers the gpu reads while rendering are better off in device local memory, when the cpu can write to that directly
+    const VkBufferUsageFlags gpuReadUsage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_TEXEL_BUFFER_BIT;
+    if (context._hasHostVisibleDeviceLocalMemory && (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && (usage & gpuReadUsage))
+        preferredProperties |= VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+
     allocCreateInfo.requiredFlags = properties;
-    allocCreateInfo.preferredFlags = properties;
+    allocCreateInfo.preferredFlags = properties | preferredProperties;
 
     VkBuffer vertexBuffer;
     VmaAllocationInfo allocInfo = {};
@@ -2877,8 +6952,13 @@ bool Vulkan::createBuffer(Context & context, VkDeviceSize size, VkBufferUsageFla
     }
 
 
-    if (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
-        bufDesc._mappable = true;
+    VkMemoryPropertyFlags memoryFlags = 0;
+    vmaGetMemoryTypeProperties(g_allocator, allocInfo.memoryType, &memoryFlags);
+    bufDesc._mappable = (memoryFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+    bufDesc._mappedData = allocInfo.pMappedData;
+    bufDesc._writeCombined = bufDesc._mappable && (memoryFlags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT) == 0;
+    bufDesc._createdFrame = context._frameNumber;
+    bufDesc._createdTimelineValue = lastGraphicsSubmission(context);
 
     return true;
 }
@@ -2891,30 +6971,186 @@ Vulkan::BufferDescriptorPtr Vulkan::createIndexOrVertexBufferAndCopyData(Context
     return dstBuffer;
 }
 
+Vulkan::BufferDescriptorPtr Vulkan::createIndexOrVertexBufferAndCopyData(Context& context, TransferBatch& batch, const void* srcData, VkDeviceSize bufferSize, BufferType type) {
+    Vulkan::BufferDescriptorPtr dstBuffer = createIndexOrVertexBuffer(context, bufferSize, type);
+    if (dstBuffer != nullptr) {
+        if (!copyDataToIndexOrVertexBuffer(context, batch, srcData, bufferSize, dstBuffer))
+            return Vulkan::BufferDescriptorPtr();
+    }
+    return dstBuffer;
+}
+
 void Vulkan::copyDataToIndexOrVertexBuffer(Context& context, const void* srcData, VkDeviceSize bufferSize, Vulkan::BufferDescriptorPtr dstBuffer) {
+    TransferBatch batch;
+    if (!batch.begin(context))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("copyDataToIndexOrVertexBuffer - Failed to begin transfer batch\n"));
+        return;
+    }
+
+    if (copyDataToIndexOrVertexBuffer(context, batch, srcData, bufferSize, dstBuffer))
+        batch.submitAndWait();
+}
+
+bool Vulkan::copyDataToIndexOrVertexBuffer(Context& context, TransferBatch& batch, const void* srcData, VkDeviceSize bufferSize, Vulkan::BufferDescriptorPtr dstBuffer) {
+    // host visible device local memory is written directly - the data is there as soon as this returns. That's only safe
+    // while the gpu can't be reading the buffer, so buffers a frame still in flight may use go through staging instead
+    if (dstBuffer->_mappedData != nullptr && !bufferMayBeInUse(context, *dstBuffer))
+    {
+        copyToMappedMemory(dstBuffer->_mappedData, srcData, (size_t)bufferSize, dstBuffer->_writeCombined);
+        vmaFlushAllocation(g_allocator, dstBuffer->_memory, 0, bufferSize);
+        return true;
+    }
+
     VkDeviceSize amountLeftToCopy = bufferSize;
     VkDeviceSize dstOffset = 0;
     const char* srcDataP = (const char*)(srcData);
     while (amountLeftToCopy > 0)
     {
-        Vulkan::PersistentBufferPtr stagingBuffer = getPersistentStagingBuffer(context, bufferSize);
-        VkDeviceSize amountToCopy = std::min<VkDeviceSize>(stagingBuffer->_registeredSize, amountLeftToCopy);
-        stagingBuffer->copyFromAndFlush(context, 0, (const void *)srcDataP, amountToCopy, 0);
+        const VkDeviceSize amountToCopy = std::min<VkDeviceSize>(stagingBufferSize, amountLeftToCopy);
+        if (!batch.copyToBuffer(*dstBuffer, srcDataP, amountToCopy, dstOffset))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("copyDataToIndexOrVertexBuffer - Failed to record copy\n"));
+            return false;
+        }
+
+        amountLeftToCopy -= amountToCopy;
+        dstOffset += amountToCopy;
+        srcDataP += amountToCopy;
+    }
+
+    return true;
+}
+
+bool Vulkan::decompressToBuffer(Context& context, TransferBatch& batch, BufferDescriptor& dst, const std::vector<CompressedChunk>& chunks, DecompressFunction decompress)
+{
+    for (const CompressedChunk& chunk : chunks)
+    {
+        assert(chunk._dstOffset + chunk._uncompressedSize <= dst._size);
+        if (chunk._uncompressedSize > stagingBufferSize)
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("decompressToBuffer - chunk of ") + std::to_string(chunk._uncompressedSize) + " bytes is larger than the staging buffer\n");
+            return false;
+        }
+    }
+
+    // a mapped buffer the gpu can't be using is decompressed into directly, in one go. Anything else goes through staging,
+    // a window at a time, and the batch is flushed in between so the gpu copies one window while the next is decompressed
+    const bool direct = dst._mappedData != nullptr && !bufferMayBeInUse(context, dst);
+    // decompressors read back what they have written, which is slow on uncached memory, and staging is write combined.
+    // Those chunks are decompressed into a buffer each worker keeps, and streamed out from there
+    const bool throughScratch = !direct || dst._writeCombined;
+
+    size_t first = 0;
+    while (first < chunks.size())
+    {
+        // staging is reserved on this thread - the batch isn't thread safe, but the memory it hands out can be filled from anywhere
+        std::vector<void*> destinations;
+        VkDeviceSize windowBytes = 0;
+        size_t last = first;
+        for (; last < chunks.size(); last++)
+        {
+            const CompressedChunk& chunk = chunks[last];
+            if (!direct && last > first && windowBytes + chunk._uncompressedSize > decompressWindowSize)
+                break;
+            windowBytes += chunk._uncompressedSize;
+
+            void* destination = nullptr;
+            if (chunk._uncompressedSize > 0)
+            {
+                destination = direct ? (unsigned char*)dst._mappedData + chunk._dstOffset : batch.reserveBufferCopy(dst, chunk._uncompressedSize, chunk._dstOffset);
+                if (destination == nullptr)
+                {
+                    g_logger->log(Vulkan::Logger::Level::Error, std::string("decompressToBuffer - Failed to reserve staging memory\n"));
+                    return false;
+                }
+            }
+            destinations.push_back(destination);
+        }
+
+        std::atomic<bool> succeeded(true);
+        workerPool().run((unsigned int)destinations.size(), [&](unsigned int task) {
+            const CompressedChunk& chunk = chunks[first + task];
+            void* destination = destinations[task];
+            if (destination == nullptr)
+                return;
+
+            const size_t size = (size_t)chunk._uncompressedSize;
+            if (!throughScratch)
+            {
+                if (!decompress(chunk._data, chunk._compressedSize, destination, size))
+                    succeeded = false;
+                return;
+            }
+
+            thread_local std::vector<unsigned char> scratch;
+            if (scratch.size() < size)
+                scratch.resize(size);
+            if (decompress(chunk._data, chunk._compressedSize, scratch.data(), size))
+                copyToMappedMemory(destination, scratch.data(), size, true);
+            else
+                succeeded = false;
+
+            // the workers outlive the call, so an unusually large chunk mustn't pin its scratch memory on every one of them
+            if (scratch.size() > maxRetainedScratchSize)
+                std::vector<unsigned char>().swap(scratch);
+        });
+
+        if (!succeeded)
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("decompressToBuffer - Failed to decompress data\n"));
+            return false;
+        }
+
+        first = last;
+        if (first < chunks.size() && !batch.flush())
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("decompressToBuffer - Failed to submit decompressed data\n"));
+            return false;
+        }
+    }
 
-        Context::Queue& queue = getQueue(context, VK_QUEUE_TRANSFER_BIT);
-        dstBuffer->copyFromAndFlush(context, context._commandPools[queue._familyIndex], queue._queue, stagingBuffer->getBuffer(0), amountToCopy, 0, dstOffset);
+    if (direct)
+        vmaFlushAllocation(g_allocator, dst._memory, 0, VK_WHOLE_SIZE);
+    return true;
+}
 
-        amountLeftToCopy -= amountToCopy;
-        dstOffset += amountToCopy;
-        srcDataP += amountToCopy;
+Vulkan::BufferDescriptorPtr Vulkan::createIndexOrVertexBufferFromCompressedData(Context& context, const std::vector<CompressedChunk>& chunks, DecompressFunction decompress, BufferType type)
+{
+    TransferBatch batch;
+    if (!batch.begin(context))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("createIndexOrVertexBufferFromCompressedData - Failed to begin transfer batch\n"));
+        return Vulkan::BufferDescriptorPtr();
     }
 
+    Vulkan::BufferDescriptorPtr buffer = createIndexOrVertexBufferFromCompressedData(context, batch, chunks, decompress, type);
+    if (buffer == nullptr || !batch.submitAndWait())
+        return Vulkan::BufferDescriptorPtr();
+    return buffer;
+}
+
+Vulkan::BufferDescriptorPtr Vulkan::createIndexOrVertexBufferFromCompressedData(Context& context, TransferBatch& batch, const std::vector<CompressedChunk>& chunks, DecompressFunction decompress, BufferType type)
+{
+    VkDeviceSize bufferSize = 0;
+    for (const CompressedChunk& chunk : chunks)
+        bufferSize = std::max<VkDeviceSize>(bufferSize, chunk._dstOffset + chunk._uncompressedSize);
+
+    Vulkan::BufferDescriptorPtr buffer = createIndexOrVertexBuffer(context, bufferSize, type);
+    if (buffer == nullptr || !decompressToBuffer(context, batch, *buffer, chunks, decompress))
+        return Vulkan::BufferDescriptorPtr();
+    return buffer;
 }
 
 
 Vulkan::BufferDescriptorPtr Vulkan::createIndexOrVertexBuffer(Context & context, VkDeviceSize bufferSize, BufferType type)
 {    
-    Vulkan::BufferDescriptorPtr vertexBufferDescriptor = createBuffer(context, bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | ((type == BufferType::Vertex) ? VK_BUFFER_USAGE_VERTEX_BUFFER_BIT : VK_BUFFER_USAGE_INDEX_BUFFER_BIT), VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    const VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT | ((type == BufferType::Vertex) ? VK_BUFFER_USAGE_VERTEX_BUFFER_BIT : VK_BUFFER_USAGE_INDEX_BUFFER_BIT);
+    // on UMA / resizable BAR, ask for memory that can be written directly. If that heap is full vma falls back to plain device local memory
+    const VkMemoryPropertyFlags preferredProperties = context._hasHostVisibleDeviceLocalMemory ? (VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) : 0;
+    Vulkan::BufferDescriptorPtr vertexBufferDescriptor(new Vulkan::BufferDescriptor());
+    if (!createBuffer(context, bufferSize, usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, *vertexBufferDescriptor, nullptr, preferredProperties))
+        vertexBufferDescriptor = nullptr;
     if(vertexBufferDescriptor==nullptr)
     {
         g_logger->log(Vulkan::Logger::Level::Error, std::string("Failed to create vertex buffer of size ") + std::to_string((int)bufferSize) + " bytes\n");
@@ -3097,6 +7333,27 @@ void Vulkan::updateUniforms(AppDescriptor & appDesc, Context & context, uint32_t
     
 }
 
+void Vulkan::Mesh::setVertexBuffer(Context& context, BufferPtr vertexBuffer)
+{
+    if (_buffers[0] != vertexBuffer)
+        deferRelease(context, _buffers[0]);
+    _buffers[0] = vertexBuffer;
+}
+
+void Vulkan::Mesh::setIndexBuffer(Context& context, BufferPtr indexBuffer)
+{
+    if (_buffers[1] != indexBuffer)
+        deferRelease(context, _buffers[1]);
+    _buffers[1] = indexBuffer;
+}
+
+void Vulkan::Mesh::setInstanceBuffer(Context& context, BufferPtr instanceBuffer)
+{
+    if (_instanceBuffer != instanceBuffer)
+        deferRelease(context, _instanceBuffer);
+    _instanceBuffer = instanceBuffer;
+}
+
 void Vulkan::destroyMesh(Context & context, Mesh& mesh)
 {
 //	destroyBufferDescriptor(context, mesh._vertexBuffer);
@@ -3137,13 +7394,36 @@ bool Vulkan::initializeIndexAndVertexBuffers(AppDescriptor & appDesc,
     void * userData, 
     bool alwaysReallocate,
     Vulkan::Mesh & result)
+{
+    // index and vertex data go into the same submission
+    TransferBatch batch;
+    if (!batch.begin(context))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("initializeIndexAndVertexBuffers - Failed to begin transfer batch\n"));
+        return false;
+    }
+
+    if (!initializeIndexAndVertexBuffers(appDesc, context, batch, vertexData, indexData, userData, alwaysReallocate, result))
+        return false;
+
+    return batch.submitAndWait();
+}
+
+bool Vulkan::initializeIndexAndVertexBuffers(AppDescriptor & appDesc,
+    Context & context,
+    TransferBatch & batch,
+    std::vector<unsigned char> & vertexData,
+    std::vector<unsigned char> & indexData,
+    void * userData,
+    bool alwaysReallocate,
+    Vulkan::Mesh & result)
 {
     if (!indexData.empty())
     {
         BufferDescriptorPtr indexBuffer = std::dynamic_pointer_cast<BufferDescriptor>(result.getIndexBuffer());
         if (alwaysReallocate || indexBuffer == nullptr || indexBuffer->_size < indexData.size()) {
             indexBuffer = createIndexOrVertexBuffer(context, indexData.size(), BufferType::Index);
-            result.setIndexBuffer(indexBuffer);
+            result.setIndexBuffer(context, indexBuffer);
         }
 
         if (indexBuffer == nullptr) {
@@ -3155,14 +7435,15 @@ bool Vulkan::initializeIndexAndVertexBuffers(AppDescriptor & appDesc,
         const void* data = indexData.data();
         const VkDeviceSize bufferSize = indexData.size();
 
-        copyDataToIndexOrVertexBuffer(context, data, bufferSize, indexBuffer);
+        if (!copyDataToIndexOrVertexBuffer(context, batch, data, bufferSize, indexBuffer))
+            return false;
     }
 
     if (!vertexData.empty()) {
         BufferDescriptorPtr vertexBuffer = std::dynamic_pointer_cast<BufferDescriptor>(result.getVertexBuffer());
         if (alwaysReallocate || vertexBuffer == nullptr || vertexBuffer->_size < vertexData.size()) {
             vertexBuffer = createIndexOrVertexBuffer(context, vertexData.size(), BufferType::Vertex);
-            result.setVertexBuffer(vertexBuffer);
+            result.setVertexBuffer(context, vertexBuffer);
         }
 
         if (vertexBuffer == nullptr) {
@@ -3174,7 +7455,8 @@ bool Vulkan::initializeIndexAndVertexBuffers(AppDescriptor & appDesc,
         const void* data = vertexData.data();
         const VkDeviceSize bufferSize = vertexData.size();
 
-        copyDataToIndexOrVertexBuffer(context, data, bufferSize, vertexBuffer);
+        if (!copyDataToIndexOrVertexBuffer(context, batch, data, bufferSize, vertexBuffer))
+            return false;
     }
 
     if (!indexData.empty()) // this is an indexed mesh
@@ -3188,6 +7470,243 @@ bool Vulkan::initializeIndexAndVertexBuffers(AppDescriptor & appDesc,
 
 }
 
+namespace
+{
+    // ranges closer than this are uploaded as one, as a few extra bytes are cheaper than an extra copy region
+    constexpr VkDeviceSize dirtyRangeMergeDistance = 256;
+    // granularity used when diffing against a shadow copy
+    constexpr VkDeviceSize dirtyBlockSize = 256;
+
+    // sorts, clips to dataSize and merges ranges that overlap or lie close together
+    std::vector<Vulkan::DirtyRange> mergeDirtyRanges(std::vector<Vulkan::DirtyRange> ranges, VkDeviceSize dataSize)
+    {
+        std::sort(ranges.begin(), ranges.end(), [](const Vulkan::DirtyRange& a, const Vulkan::DirtyRange& b) { return a._offset < b._offset; });
+
+        std::vector<Vulkan::DirtyRange> merged;
+        for (const Vulkan::DirtyRange& range : ranges)
+        {
+            if (range._offset >= dataSize || range._size == 0)
+                continue;
+            const VkDeviceSize end = std::min<VkDeviceSize>(range._offset + range._size, dataSize);
+            if (!merged.empty() && range._offset <= merged.back()._offset + merged.back()._size + dirtyRangeMergeDistance)
+            {
+                Vulkan::DirtyRange& last = merged.back();
+                last._size = std::max<VkDeviceSize>(last._offset + last._size, end) - last._offset;
+            }
+            else
+                merged.push_back(Vulkan::DirtyRange(range._offset, end - range._offset));
+        }
+        return merged;
+    }
+
+    // compares data against the previous upload block by block. Anything past the end of previous is dirty
+    std::vector<Vulkan::DirtyRange> findDirtyRanges(const std::vector<unsigned char>& data, const std::vector<unsigned char>& previous)
+    {
+        std::vector<Vulkan::DirtyRange> ranges;
+        const VkDeviceSize dataSize = data.size();
+        const VkDeviceSize comparableSize = std::min<VkDeviceSize>(dataSize, previous.size());
+        for (VkDeviceSize offset = 0; offset < comparableSize; offset += dirtyBlockSize)
+        {
+            const VkDeviceSize blockSize = std::min<VkDeviceSize>(dirtyBlockSize, comparableSize - offset);
+            if (memcmp(&data[(size_t)offset], &previous[(size_t)offset], (size_t)blockSize) == 0)
+                continue;
+            if (!ranges.empty() && ranges.back()._offset + ranges.back()._size == offset)
+                ranges.back()._size += blockSize;
+            else
+                ranges.push_back(Vulkan::DirtyRange(offset, blockSize));
+        }
+        if (dataSize > comparableSize)
+            ranges.push_back(Vulkan::DirtyRange(comparableSize, dataSize - comparableSize));
+        return ranges;
+    }
+
+    bool updateMeshBuffer(Vulkan::Context& context, Vulkan::TransferBatch& batch, const std::vector<unsigned char>& data, const std::vector<Vulkan::DirtyRange>& dirtyRanges, Vulkan::BufferType type, Vulkan::BufferDescriptorPtr& buffer, bool& reallocated)
+    {
+        reallocated = false;
+        if (buffer == nullptr || buffer->_size < data.size())
+        {
+            buffer = Vulkan::createIndexOrVertexBuffer(context, data.size(), type);
+            if (buffer == nullptr)
+                return false;
+            reallocated = true;
+            return Vulkan::copyDataToIndexOrVertexBuffer(context, batch, data.data(), data.size(), buffer);
+        }
+
+        const bool idle = !bufferMayBeInUse(context, *buffer);
+        for (const Vulkan::DirtyRange& range : mergeDirtyRanges(dirtyRanges, data.size()))
+        {
+            // writing mapped memory directly is only safe while no frame in flight can be reading the buffer. Otherwise the
+            // batch orders the copy after those frames on the gpu
+            const unsigned char* src = &data[(size_t)range._offset];
+            if (buffer->_mappedData != nullptr && idle)
+            {
+                copyToMappedMemory((unsigned char*)buffer->_mappedData + range._offset, src, (size_t)range._size, buffer->_writeCombined);
+                vmaFlushAllocation(g_allocator, buffer->_memory, range._offset, range._size);
+                continue;
+            }
+
+            VkDeviceSize amountLeftToCopy = range._size;
+            VkDeviceSize dstOffset = range._offset;
+            while (amountLeftToCopy > 0)
+            {
+                const VkDeviceSize amountToCopy = std::min<VkDeviceSize>(stagingBufferSize, amountLeftToCopy);
+                if (!batch.copyToBuffer(*buffer, src, amountToCopy, dstOffset))
+                {
+                    g_logger->log(Vulkan::Logger::Level::Error, std::string("updateIndexAndVertexBuffers - Failed to record copy\n"));
+                    return false;
+                }
+                amountLeftToCopy -= amountToCopy;
+                dstOffset += amountToCopy;
+                src += amountToCopy;
+            }
+        }
+        return true;
+    }
+}
+
+bool Vulkan::updateIndexAndVertexBuffers(Context& context,
+    const std::vector<unsigned char>& vertexData,
+    const std::vector<DirtyRange>& dirtyVertexRanges,
+    const std::vector<unsigned char>& indexData,
+    const std::vector<DirtyRange>& dirtyIndexRanges,
+    Vulkan::Mesh& result)
+{
+    TransferBatch batch;
+    if (!batch.begin(context))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("updateIndexAndVertexBuffers - Failed to begin transfer batch\n"));
+        return false;
+    }
+
+    if (!updateIndexAndVertexBuffers(context, batch, vertexData, dirtyVertexRanges, indexData, dirtyIndexRanges, result))
+        return false;
+
+    return batch.submitAndWait();
+}
+
+bool Vulkan::updateIndexAndVertexBuffersAsync(Context& context,
+    const std::vector<unsigned char>& vertexData,
+    const std::vector<DirtyRange>& dirtyVertexRanges,
+    const std::vector<unsigned char>& indexData,
+    const std::vector<DirtyRange>& dirtyIndexRanges,
+    Vulkan::Mesh& result,
+    UploadToken& token)
+{
+    token = 0;
+    TransferBatch batch;
+    if (!batch.begin(context))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("updateIndexAndVertexBuffersAsync - Failed to begin transfer batch\n"));
+        return false;
+    }
+
+    if (!updateIndexAndVertexBuffers(context, batch, vertexData, dirtyVertexRanges, indexData, dirtyIndexRanges, result))
+        return false;
+
+    const bool recorded = batch.stagingBytes() > 0;
+    token = batch.submit();
+    return token != 0 || !recorded;
+}
+
+bool Vulkan::updateIndexAndVertexBuffers(Context& context,
+    TransferBatch& batch,
+    const std::vector<unsigned char>& vertexData,
+    const std::vector<DirtyRange>& dirtyVertexRanges,
+    const std::vector<unsigned char>& indexData,
+    const std::vector<DirtyRange>& dirtyIndexRanges,
+    Vulkan::Mesh& result)
+{
+    if (!indexData.empty())
+    {
+        BufferDescriptorPtr indexBuffer = std::dynamic_pointer_cast<BufferDescriptor>(result.getIndexBuffer());
+        bool reallocated = false;
+        if (!updateMeshBuffer(context, batch, indexData, dirtyIndexRanges, BufferType::Index, indexBuffer, reallocated))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("Failed to update index buffer\n"));
+            return false;
+        }
+        if (reallocated)
+            result.setIndexBuffer(context, indexBuffer);
+        result._numIndices = (unsigned int)indexData.size() / sizeof(uint16_t);
+    }
+
+    if (!vertexData.empty())
+    {
+        BufferDescriptorPtr vertexBuffer = std::dynamic_pointer_cast<BufferDescriptor>(result.getVertexBuffer());
+        bool reallocated = false;
+        if (!updateMeshBuffer(context, batch, vertexData, dirtyVertexRanges, BufferType::Vertex, vertexBuffer, reallocated))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("Failed to update vertex buffer\n"));
+            return false;
+        }
+        if (reallocated)
+            result.setVertexBuffer(context, vertexBuffer);
+    }
+
+    return true;
+}
+
+bool Vulkan::updateIndexAndVertexBuffers(Context& context,
+    const std::vector<unsigned char>& vertexData,
+    const std::vector<unsigned char>& indexData,
+    MeshShadowCopy& shadow,
+    Vulkan::Mesh& result)
+{
+    TransferBatch batch;
+    if (!batch.begin(context))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("updateIndexAndVertexBuffers - Failed to begin transfer batch\n"));
+        return false;
+    }
+
+    if (!updateIndexAndVertexBuffers(context, batch, vertexData, indexData, shadow, result))
+        return false;
+
+    return batch.submitAndWait();
+}
+
+bool Vulkan::updateIndexAndVertexBuffersAsync(Context& context,
+    const std::vector<unsigned char>& vertexData,
+    const std::vector<unsigned char>& indexData,
+    MeshShadowCopy& shadow,
+    Vulkan::Mesh& result,
+    UploadToken& token)
+{
+    token = 0;
+    TransferBatch batch;
+    if (!batch.begin(context))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("updateIndexAndVertexBuffersAsync - Failed to begin transfer batch\n"));
+        return false;
+    }
+
+    if (!updateIndexAndVertexBuffers(context, batch, vertexData, indexData, shadow, result))
+        return false;
+
+    const bool recorded = batch.stagingBytes() > 0;
+    token = batch.submit();
+    return token != 0 || !recorded;
+}
+
+bool Vulkan::updateIndexAndVertexBuffers(Context& context,
+    TransferBatch& batch,
+    const std::vector<unsigned char>& vertexData,
+    const std::vector<unsigned char>& indexData,
+    MeshShadowCopy& shadow,
+    Vulkan::Mesh& result)
+{
+    const std::vector<DirtyRange> dirtyVertexRanges = findDirtyRanges(vertexData, shadow._vertexData);
+    const std::vector<DirtyRange> dirtyIndexRanges = findDirtyRanges(indexData, shadow._indexData);
+    if (!updateIndexAndVertexBuffers(context, batch, vertexData, dirtyVertexRanges, indexData, dirtyIndexRanges, result))
+        return false;
+
+    if (!vertexData.empty())
+        shadow._vertexData = vertexData;
+    if (!indexData.empty())
+        shadow._indexData = indexData;
+    return true;
+}
+
 namespace
 {
     std::array<VkDeviceSize, 10> memoryTypes = {};
@@ -3254,6 +7773,21 @@ bool Vulkan::setupAllocator(AppDescriptor& appDesc, Context& context)
 //        allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
 
     vmaCreateAllocator(&allocatorInfo, &g_allocator);
+
+    // UMA and resizable BAR both show up as a large heap that is both device local and host visible
+    VkPhysicalDeviceMemoryProperties memoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(context._physicalDevice, &memoryProperties);
+    const VkMemoryPropertyFlags directWriteFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    context._hasHostVisibleDeviceLocalMemory = false;
+    for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++)
+    {
+        const VkMemoryType& memoryType = memoryProperties.memoryTypes[i];
+        if ((memoryType.propertyFlags & directWriteFlags) == directWriteFlags && memoryProperties.memoryHeaps[memoryType.heapIndex].size > smallBarHeapSize)
+            context._hasHostVisibleDeviceLocalMemory = true;
+    }
+    if (context._hasHostVisibleDeviceLocalMemory)
+        g_logger->log(Vulkan::Logger::Level::Info, std::string("Host visible device local memory found - writing buffers directly\n"));
+
     return true;
 }
 
@@ -3371,7 +7905,7 @@ bool Vulkan::createSwapChainDependents(AppDescriptor & appDesc, Context & contex
     {
         const unsigned int width = context._swapChainSize.width;
         const unsigned int height = context._swapChainSize.height;
-        const unsigned int numSwapBuffers = (unsigned int)Vulkan::getNumInflightFrames(context);
+        const unsigned int numSwapBuffers = (unsigned int)context._swapChainImages.size();
         context._msaaColourImages.resize(numSwapBuffers);
         context._msaaColourImageViews.resize(numSwapBuffers);
         for (unsigned int i = 0; i < numSwapBuffers; i++)
@@ -3407,10 +7941,19 @@ bool Vulkan::createSwapChainDependents(AppDescriptor & appDesc, Context & contex
 		return false;
 	}
 
-    if (!createSemaphores(appDesc, context))
+    // the frame semaphores and fences survive recreation, unless the number of frames in flight or images changed with it
+    if (context._fences.size() != (size_t)getNumInflightFrames(context) || context._renderFinishedSemaphores.size() != context._swapChainImages.size())
     {
-        g_logger->log(Vulkan::Logger::Level::Error, std::string("Failed to create frame semaphores\n"));
-        return false;
+        for (unsigned int i = 0; i < (unsigned int)context._fences.size(); i++)
+            waitForFrameSlot(context, i);
+        destroySemaphores(context);
+        context._frameTimelineValues.clear();
+
+        if (!createSemaphores(appDesc, context))
+        {
+            g_logger->log(Vulkan::Logger::Level::Error, std::string("Failed to create frame semaphores\n"));
+            return false;
+        }
     }
 
 	return true;
@@ -3418,67 +7961,383 @@ bool Vulkan::createSwapChainDependents(AppDescriptor & appDesc, Context & contex
 
 bool Vulkan::recreateSwapChain(AppDescriptor & appDesc, Context & context)
 {
-	vkDeviceWaitIdle(context._device);
-
+    // nothing waits for the gpu here. The old swapchain is handed to the new one, and it and its dependents are
+    // destroyed once the frames rendered with them are done
 	if (!cleanupSwapChain(appDesc, context))
 		return false;
 
-	if (!createSwapChainDependents(appDesc, context))
+    VkDevice device = context._device;
+    const VkSwapchainKHR oldSwapChain = context._swapChain;
+    const bool created = createSwapChainDependents(appDesc, context);
+    if (oldSwapChain != VK_NULL_HANDLE)
+        deferDestruction(context, [device, oldSwapChain]() { vkDestroySwapchainKHR(device, oldSwapChain, nullptr); });
+	if (!created)
 		return false;
 
     context._currentFrame = 0;
+    context._imagesInFlight.clear();
+    context._imageTimelineValues.clear();
 	return true;
 }
 
-bool Vulkan::cleanupSwapChain(AppDescriptor & appDesc, Context & context)
+namespace
 {
-	VkDevice device = context._device;
+    // a suboptimal swapchain is only worth recreating when the window size changed. Some platforms keep reporting it for
+    // other reasons, like a rotated display, and a new swapchain every frame would be far worse than presenting as is
+    bool surfaceExtentChanged(Vulkan::Context& context)
+    {
+        VkSurfaceCapabilitiesKHR capabilities = {};
+        if (vkGetPhysicalDeviceSurfaceCapabilitiesKHR(context._physicalDevice, context._surface, &capabilities) != VK_SUCCESS)
+            return false;
+        // the swapchain decides the size of surfaces that report this
+        if (capabilities.currentExtent.width == std::numeric_limits<uint32_t>::max())
+            return false;
+        return capabilities.currentExtent.width != context._swapChainSize.width || capabilities.currentExtent.height != context._swapChainSize.height;
+    }
+}
 
-	for (unsigned int i = 0; i < (unsigned int)context._fences.size(); i++)
-	{
-		if (!context._fences.empty())
-		{
-			const VkResult waitForFencesResult = vkWaitForFences(context._device, 1, &context._fences[i], VK_TRUE, std::numeric_limits<uint64_t>::max());
-			assert(waitForFencesResult == VK_SUCCESS);
+Vulkan::FrameStatus Vulkan::beginFrame(AppDescriptor& appDesc, Context& context)
+{
+    if (context._fences.empty() || context._swapChain == VK_NULL_HANDLE)
+        return FrameStatus::Error;
+
+    // only the work submitted the last time this frame slot was used has to be done
+    const unsigned int frame = context._currentFrame % (unsigned int)context._fences.size();
+    const std::chrono::steady_clock::time_point slotWaitStart = std::chrono::steady_clock::now();
+    if (!waitForFrameSlot(context, frame))
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("beginFrame - Failed to wait for frame slot\n"));
+        return FrameStatus::Error;
+    }
+    context._framePacer.pace(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - slotWaitStart).count(), frameGpuMilliseconds(context, frame));
+
+    // everything up to the last frame submitted in this slot is done now
+    for (size_t i = context._submittedFrames.size(); i > 0; i--)
+    {
+        if (context._submittedFrames[i - 1]._frameSlot == frame)
+        {
+            context._submittedFrames.erase(context._submittedFrames.begin(), context._submittedFrames.begin() + i);
+            break;
         }
-	}
+    }
+
+    uint32_t imageIndex = 0;
+    const VkResult acquireResult = vkAcquireNextImageKHR(context._device, context._swapChain, std::numeric_limits<uint64_t>::max(), context._imageAvailableSemaphores[frame], VK_NULL_HANDLE, &imageIndex);
+    if (acquireResult == VK_ERROR_OUT_OF_DATE_KHR)
+        return recreateSwapChain(appDesc, context) ? FrameStatus::SwapChainRecreated : FrameStatus::Error;
+    if (acquireResult != VK_SUCCESS && acquireResult != VK_SUBOPTIMAL_KHR) // suboptimal is dealt with after presenting
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("beginFrame - Failed to acquire swapchain image\n"));
+        return FrameStatus::Error;
+    }
+
+    // with fewer frame slots than swapchain images, the image can still be in use by another slot
+    QueueTimeline* timeline = getGraphicsTimeline(context);
+    if (timeline != nullptr)
+    {
+        if (context._imageTimelineValues.size() != context._swapChainImages.size())
+            context._imageTimelineValues.assign(context._swapChainImages.size(), 0);
+        const uint64_t imageValue = context._imageTimelineValues[imageIndex];
+        if (imageValue != 0)
+            waitForTimelineValues(context, { timeline->_semaphore }, { imageValue });
+    }
+    else
+    {
+        if (context._imagesInFlight.size() != context._swapChainImages.size())
+            context._imagesInFlight.assign(context._swapChainImages.size(), VK_NULL_HANDLE);
+        VkFence& imageFence = context._imagesInFlight[imageIndex];
+        if (imageFence != VK_NULL_HANDLE && imageFence != context._fences[frame])
+            vkWaitForFences(context._device, 1, &imageFence, VK_TRUE, std::numeric_limits<uint64_t>::max());
+        imageFence = context._fences[frame];
+    }
+
+    context._currentImageIndex = imageIndex;
+    context._acquireTime = std::chrono::steady_clock::now();
+    context._frameReadyEffects.clear();
+    PersistentBuffer::startFrame(frame);
+    processDeferredDestructions(context);
+    retireFinishedUploads(context);
+    processReadbacks(context);
+    return FrameStatus::Ready;
+}
+
+Vulkan::FrameStatus Vulkan::endFrame(AppDescriptor& appDesc, Context& context)
+{
+    if (context._fences.empty() || context._swapChain == VK_NULL_HANDLE)
+        return FrameStatus::Error;
+
+    const unsigned int frame = context._currentFrame % (unsigned int)context._fences.size();
+    PersistentBuffer::submitFrame(context, frame);
+    flushImageTransitions(context);
+
+    // the frame's timestamps go around everything else in the submission
+    const bool timestamps = frame < (unsigned int)context._frameTimestampsWritten.size();
+    std::vector<VkCommandBuffer> commandBuffers;
+    if (timestamps)
+        commandBuffers.push_back(context._frameTimestampCommands[2 * frame]);
+    for (const EffectDescriptorPtr& effect : context._frameReadyEffects)
+    {
+        if (frame < (unsigned int)effect->_commandBuffers.size())
+            commandBuffers.push_back(effect->_commandBuffers[frame]);
+    }
+
+    // swapchain captures go last, so they see the finished frame before it's presented
+    Context::Queue& queue = getQueue(context, VK_QUEUE_GRAPHICS_BIT);
+    const VkCommandPool capturePool = context._commandPools[queue._familyIndex];
+    std::vector<PendingReadback> captures;
+    const VkCommandBuffer captureCommands = recordSwapChainCaptures(context, capturePool, captures);
+    if (captureCommands != VK_NULL_HANDLE)
+        commandBuffers.push_back(captureCommands);
+    if (timestamps)
+        commandBuffers.push_back(context._frameTimestampCommands[2 * frame + 1]);
+
+    const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    VkSubmitInfo submitInfo = {};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.waitSemaphoreCount = 1;
+    submitInfo.pWaitSemaphores = &context._imageAvailableSemaphores[frame];
+    submitInfo.pWaitDstStageMask = &waitStage;
+    submitInfo.commandBufferCount = (uint32_t)commandBuffers.size();
+    submitInfo.pCommandBuffers = commandBuffers.empty() ? nullptr : &commandBuffers[0];
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &context._renderFinishedSemaphores[context._currentImageIndex];
+
+    // with a timeline, the frame signals the graphics timeline next to the binary semaphore presenting waits on,
+    // and the frame fence is left alone
+    QueueTimeline* timeline = getQueueTimeline(context, queue._queue);
+    const VkSemaphore signalSemaphores[] = { context._renderFinishedSemaphores[context._currentImageIndex], timeline != nullptr ? timeline->_semaphore : VK_NULL_HANDLE };
+    const uint64_t signalValues[] = { 0, timeline != nullptr ? timeline->_lastSignaled + 1 : 0 };
+    VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+    VkFence fence = context._fences[frame];
+    if (timeline != nullptr)
+    {
+        timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+        timelineInfo.signalSemaphoreValueCount = 2;
+        timelineInfo.pSignalSemaphoreValues = signalValues;
+        submitInfo.pNext = &timelineInfo;
+        submitInfo.signalSemaphoreCount = 2;
+        submitInfo.pSignalSemaphores = signalSemaphores;
+        fence = VK_NULL_HANDLE;
+    }
+    else
+        vkResetFences(context._device, 1, &fence);
+
+    const VkResult submitResult = vkQueueSubmit(queue._queue, 1, &submitInfo, fence);
+    assert(submitResult == VK_SUCCESS);
+    if (submitResult != VK_SUCCESS)
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("endFrame - Failed to submit frame\n"));
+        recycleCommandBuffer(context, capturePool, captureCommands);
+        for (const PendingReadback& capture : captures)
+            releaseReadbackBuffer(context, capture._buffer);
+        return FrameStatus::Error;
+    }
+    if (timestamps)
+        context._frameTimestampsWritten[frame] = true;
+    if (captureCommands != VK_NULL_HANDLE)
+        trackSwapChainCaptures(context, queue._queue, capturePool, captureCommands, captures, signalValues[1]);
+
+    SubmittedFrame submitted;
+    submitted._frameNumber = context._frameNumber;
+    submitted._frameSlot = frame;
+    submitted._timelineValue = signalValues[1];
+    context._submittedFrames.push_back(submitted);
+    if (timeline != nullptr)
+    {
+        timeline->_lastSignaled = signalValues[1];
+        if (context._frameTimelineValues.size() != context._fences.size())
+            context._frameTimelineValues.resize(context._fences.size(), 0);
+        context._frameTimelineValues[frame] = signalValues[1];
+        if (context._currentImageIndex < (unsigned int)context._imageTimelineValues.size())
+            context._imageTimelineValues[context._currentImageIndex] = signalValues[1];
+    }
+
+    VkPresentInfoKHR presentInfo = {};
+    presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    presentInfo.waitSemaphoreCount = 1;
+    presentInfo.pWaitSemaphores = &context._renderFinishedSemaphores[context._currentImageIndex];
+    presentInfo.swapchainCount = 1;
+    presentInfo.pSwapchains = &context._swapChain;
+    presentInfo.pImageIndices = &context._currentImageIndex;
+    const VkResult presentResult = vkQueuePresentKHR(queue._queue, &presentInfo);
+
+    PresentLatencyStats& latency = context._presentLatency;
+    latency._lastMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - context._acquireTime).count();
+    latency._numFrames++;
+    latency._averageMilliseconds += (latency._lastMilliseconds - latency._averageMilliseconds) / (double)std::min<uint64_t>(latency._numFrames, presentLatencyWindow);
+    // a single stall would otherwise be reported for the rest of the run
+    latency._windowMaxMilliseconds = std::max(latency._windowMaxMilliseconds, latency._lastMilliseconds);
+    if (latency._numFrames <= presentLatencyWindow)
+        latency._maxMilliseconds = latency._windowMaxMilliseconds;
+    if (latency._numFrames % presentLatencyWindow == 0)
+    {
+        latency._maxMilliseconds = latency._windowMaxMilliseconds;
+        latency._windowMaxMilliseconds = 0.0;
+    }
+
+    context._frameNumber++;
+    context._currentFrame = (frame + 1) % (unsigned int)context._fences.size();
+
+    if (presentResult == VK_ERROR_OUT_OF_DATE_KHR || (presentResult == VK_SUBOPTIMAL_KHR && surfaceExtentChanged(context)))
+        return recreateSwapChain(appDesc, context) ? FrameStatus::SwapChainRecreated : FrameStatus::Error;
+    if (presentResult == VK_SUBOPTIMAL_KHR)
+        return FrameStatus::Ready;
+    if (presentResult != VK_SUCCESS)
+    {
+        g_logger->log(Vulkan::Logger::Level::Error, std::string("endFrame - Failed to present\n"));
+        return FrameStatus::Error;
+    }
+    return FrameStatus::Ready;
+}
+
+void Vulkan::deferDestruction(Context& context, std::function<void()> destroy)
+{
+    DeferredDestruction deferred;
+    deferred._frameNumber = context._frameNumber;
+    deferred._uploadToken = context._lastUploadToken;
+    deferred._graphicsTimelineValue = lastGraphicsSubmission(context);
+    deferred._destroy = destroy;
+    context._deferredDestructions.push_back(deferred);
+}
+
+void Vulkan::deferRelease(Context& context, BufferPtr buffer)
+{
+    if (buffer != nullptr)
+        deferDestruction(context, [buffer]() mutable { buffer.reset(); });
+}
+
+namespace
+{
+    // uploads finish out of order when they are spread over several queues, so all of the earlier ones are checked
+    bool areUploadsComplete(Vulkan::Context& context, Vulkan::UploadToken token, bool wait)
+    {
+        for (size_t i = 0; i < context._pendingUploads.size(); i++)
+        {
+            const Vulkan::PendingUpload& upload = context._pendingUploads[i];
+            if (upload._token > token || isPendingUploadDone(context, upload))
+                continue;
+            if (!wait)
+                return false;
+
+            // waiting retires uploads, which reorders the list, so start over
+            if (!Vulkan::waitForUpload(context, upload._token))
+                return false;
+            i = (size_t)-1;
+        }
+        return true;
+    }
+}
+
+void Vulkan::processDeferredDestructions(Context& context, bool waitForAll)
+{
+    // queued in frame and upload order, so the first one that isn't ready ends the run
+    while (!context._deferredDestructions.empty())
+    {
+        const DeferredDestruction& deferred = context._deferredDestructions.front();
+        QueueTimeline* timeline = getGraphicsTimeline(context);
+        if (timeline != nullptr && deferred._graphicsTimelineValue != 0)
+        {
+            // covers frames and anything else submitted to the graphics queue with the timeline
+            const bool done = waitForAll
+                ? waitForTimelineValues(context, { timeline->_semaphore }, { deferred._graphicsTimelineValue })
+                : isTimelineValueReached(context, timeline->_semaphore, deferred._graphicsTimelineValue);
+            if (!done)
+                break;
+        }
+        else if (timeline == nullptr && deferred._frameNumber != 0)
+        {
+            const bool done = waitForAll ? waitForFrame(context, deferred._frameNumber - 1) : isFrameComplete(context, deferred._frameNumber - 1);
+            if (!done)
+                break;
+        }
+        if (!areUploadsComplete(context, deferred._uploadToken, waitForAll))
+            break;
 
-	for (auto depthImageView : context._depthImageViews)
-		vkDestroyImageView(device, depthImageView, nullptr);
-	context._depthImageViews.clear();
+        const std::function<void()> destroy = deferred._destroy;
+        context._deferredDestructions.pop_front();
+        destroy();
+    }
+}
 
-    for (auto depthImage : context._depthImages)
-        depthImage.destroy();
-	context._depthImages.clear();
+bool Vulkan::isFrameComplete(Context& context, uint64_t frameNumber)
+{
+    if (frameNumber >= context._frameNumber)
+        return false; // not submitted yet
 
-	for (auto frameBuffer : context._frameBuffers)
-		vkDestroyFramebuffer(device, frameBuffer, nullptr);
-	context._frameBuffers.clear();
+    const SubmittedFrame* frame = findSubmittedFrame(context, frameNumber);
+    if (frame == nullptr)
+        return true; // pruned by beginFrame once its slot came around again
 
-	for (auto imageView : context._swapChainImageViews)
-		vkDestroyImageView(device, imageView, nullptr);
-	context._swapChainImageViews.clear();
+    if (frame->_timelineValue != 0)
+    {
+        QueueTimeline* timeline = getGraphicsTimeline(context);
+        uint64_t currentValue = 0;
+        return timeline != nullptr && vkGetSemaphoreCounterValue(context._device, timeline->_semaphore, &currentValue) == VK_SUCCESS && currentValue >= frame->_timelineValue;
+    }
 
-    for (auto msaaColourImageView : context._msaaColourImageViews)
-        vkDestroyImageView(device, msaaColourImageView, nullptr);
-    context._msaaColourImageViews.clear();
+    // the slot fence may have been reused by a later frame, which can't finish before this one
+    return vkGetFenceStatus(context._device, context._fences[frame->_frameSlot]) == VK_SUCCESS;
+}
 
-    for (auto msaaColourImage : context._msaaColourImages)
-        msaaColourImage.destroy();
-    context._msaaColourImages.clear();
+bool Vulkan::waitForFrame(Context& context, uint64_t frameNumber)
+{
+    if (frameNumber >= context._frameNumber)
+        return false;
 
+    const SubmittedFrame* frame = findSubmittedFrame(context, frameNumber);
+    if (frame == nullptr)
+        return true;
 
-/*	for (auto image : context._colorBuffers)
-		vkDestroyImage(device, image, nullptr);
-	context._colorBuffers.clear();*/
+    if (frame->_timelineValue != 0)
+    {
+        QueueTimeline* timeline = getGraphicsTimeline(context);
+        return timeline != nullptr && waitForTimelineValues(context, { timeline->_semaphore }, { frame->_timelineValue });
+    }
 
-	vkDestroySwapchainKHR(device, context._swapChain, nullptr);
-	context._swapChain = VK_NULL_HANDLE;
+    return waitForFrameSlot(context, frame->_frameSlot);
+}
 
-    vkDestroyRenderPass(device, context._renderPass, nullptr);
+bool Vulkan::cleanupSwapChain(AppDescriptor & appDesc, Context & context)
+{
+    // hands everything created for the swapchain over to the deferred destruction queue, as frames in flight can still
+    // be using it. The swapchain itself is left in place, to be passed as oldSwapchain
+	VkDevice device = context._device;
+    std::vector<VkImageView> depthImageViews;
+    std::vector<ImageDescriptor> depthImages;
+    std::vector<VkFramebuffer> frameBuffers;
+    std::vector<VkImageView> swapChainImageViews;
+    std::vector<VkImageView> msaaColourImageViews;
+    std::vector<ImageDescriptor> msaaColourImages;
+    depthImageViews.swap(context._depthImageViews);
+    depthImages.swap(context._depthImages);
+    frameBuffers.swap(context._frameBuffers);
+    swapChainImageViews.swap(context._swapChainImageViews);
+    msaaColourImageViews.swap(context._msaaColourImageViews);
+    msaaColourImages.swap(context._msaaColourImages);
+    const VkRenderPass renderPass = context._renderPass;
     context._renderPass = VK_NULL_HANDLE;
 
-    destroySemaphores(context);
+    deferDestruction(context, [=]() mutable {
+        for (auto depthImageView : depthImageViews)
+            vkDestroyImageView(device, depthImageView, nullptr);
+
+        for (auto depthImage : depthImages)
+            depthImage.destroy();
+
+        for (auto frameBuffer : frameBuffers)
+            vkDestroyFramebuffer(device, frameBuffer, nullptr);
+
+        for (auto imageView : swapChainImageViews)
+            vkDestroyImageView(device, imageView, nullptr);
+
+        for (auto msaaColourImageView : msaaColourImageViews)
+            vkDestroyImageView(device, msaaColourImageView, nullptr);
+
+        for (auto msaaColourImage : msaaColourImages)
+            msaaColourImage.destroy();
+
+        vkDestroyRenderPass(device, renderPass, nullptr);
+    });
 
 	return true;
 }
@@ -3582,14 +8441,22 @@ bool Vulkan::initEffectDescriptor(AppDescriptor& appDesc,
 
 bool Vulkan::recreateEffectDescriptor(AppDescriptor& appDesc, Context& context, EffectDescriptorPtr effect)
 {
-    vkDestroyRenderPass(context._device, effect->_renderPass, nullptr);
-
-    if(effect->_pipelineLayout != nullptr)
-        vkDestroyPipelineLayout(context._device, effect->_pipelineLayout, nullptr);
+    // command buffers of frames in flight can still be using the old objects
+    const VkDevice device = context._device;
+    const VkRenderPass renderPass = effect->_renderPass;
+    const VkPipelineLayout pipelineLayout = effect->_pipelineLayout;
+    const VkPipeline pipeline = effect->_pipeline;
+    deferDestruction(context, [device, renderPass, pipelineLayout, pipeline]() {
+        vkDestroyRenderPass(device, renderPass, nullptr);
+
+        if (pipelineLayout != nullptr)
+            vkDestroyPipelineLayout(device, pipelineLayout, nullptr);
+
+        if (pipeline != nullptr)
+            vkDestroyPipeline(device, pipeline, nullptr);
+    });
+    effect->_renderPass = VK_NULL_HANDLE;
     effect->_pipelineLayout = nullptr;
-
-    if(effect->_pipeline != nullptr)
-        vkDestroyPipeline(context._device, effect->_pipeline, nullptr);
     effect->_pipeline = nullptr;
 
     // compute or graphics pipeline???
@@ -3653,21 +8520,9 @@ bool Vulkan::createSampler(Vulkan::Context& context, VkSampler& sampler)
 
 VkCommandBuffer Vulkan::createCommandBuffer(Vulkan::Context& context, VkCommandPool commandPool, bool beginCommandBuffer)
 {
-    VkCommandBuffer commandBuffer;
-
-    VkCommandBufferAllocateInfo commandBufferAllocateInfo;
-    memset(&commandBufferAllocateInfo, 0, sizeof(VkCommandBufferAllocateInfo));
-    commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    commandBufferAllocateInfo.commandPool = commandPool;
-    commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    commandBufferAllocateInfo.commandBufferCount = 1;
-    const VkResult allocateCommandBuffersResult = vkAllocateCommandBuffers(context._device, &commandBufferAllocateInfo, &commandBuffer);
-    assert(allocateCommandBuffersResult == VK_SUCCESS);
-    if (allocateCommandBuffersResult != VK_SUCCESS)
-    {
-        g_logger->log(Vulkan::Logger::Level::Error, std::string("Failed to create VkCommandbufferAllocateInfo\n"));
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    if (!::createCommandBuffer(context, commandPool, &commandBuffer))
         return commandBuffer;
-    }
 
     if (beginCommandBuffer)
     {
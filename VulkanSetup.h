@@ -11,6 +11,8 @@
 #include <functional>
 #include <memory>
 #include <algorithm>
+#include <deque>
+#include <chrono>
 #include <string.h>
 #include <math.h>
 
@@ -199,11 +201,24 @@ namespace Vulkan
     typedef std::function<void(VkRenderPassCreateInfoDescriptor&)> RenderPassCustomizationCallback;
 
 
+    // how frames are presented. Modes the surface doesn't support fall back to the closest tear-free mode, ending with FIFO,
+    // which is always there. FromVSync keeps the old behaviour of picking FIFO or IMMEDIATE based on _enableVSync
+    enum class PresentPolicy
+    {
+        FromVSync,
+        Mailbox,        // no tearing, and the newest frame is shown at the next vblank. Falls back to FIFO
+        FifoRelaxed,    // vsync, but late frames are shown right away and may tear. Falls back to FIFO
+        Immediate,      // no waiting at all and may tear. Falls back to MAILBOX, then FIFO
+        Fifo,
+    };
+
     struct AppDescriptor
     {
         std::string _appName;
         uint32_t _requiredVulkanVersion;
         bool _enableVSync;
+        PresentPolicy _presentPolicy;
+        uint32_t _swapChainImageCount; // requested number of swapchain images, clamped to what the surface allows. 0 picks 3
         uint32_t _requestedNumSamples;
         uint32_t _actualNumSamples;
         SDL_Window * _window;
@@ -254,6 +269,9 @@ namespace Vulkan
     };
     typedef std::shared_ptr<Buffer> BufferPtr;
 
+    // identifies an upload submitted to the gpu. 0 is never handed out, and is always considered complete
+    typedef uint64_t UploadToken;
+
     struct Context;
     struct BufferDescriptor : public Buffer
     {
@@ -261,12 +279,24 @@ namespace Vulkan
         VmaAllocation _memory;
         bool _mappable;
         unsigned int _size;
+        UploadToken _lastUploadToken;
+        void* _mappedData; // set for every host visible buffer - they are mapped for their whole lifetime
+        bool _writeCombined; // host visible but not cached, so reads are slow and streaming stores pay off
+        // graphics timeline value, or Context::_frameNumber without timelines, when the buffer was created. Graphics work
+        // submitted from then on may read it
+        uint64_t _createdTimelineValue;
+        uint64_t _createdFrame;
   
         BufferDescriptor()
             :_buffer(VK_NULL_HANDLE)
             , _memory(VK_NULL_HANDLE)
             , _size(0)
             , _mappable(false)
+            , _lastUploadToken(0)
+            , _mappedData(nullptr)
+            , _writeCombined(false)
+            , _createdTimelineValue(0)
+            , _createdFrame(0)
         {
         }
 
@@ -275,9 +305,16 @@ namespace Vulkan
         }
 
         void destroy() override;
+        // like destroy, but the buffer is only released once the gpu can no longer be using it
+        virtual void destroy(Vulkan::Context& context);
 
+        // the copy has finished when this returns
         virtual bool copyFrom(Vulkan::Context & context, VkCommandPool commandPool, VkQueue queue, const void * srcData, VkDeviceSize amount, VkDeviceSize dstOffset);
 
+        // records the copy and returns straight away. srcData can be released when this returns, the
+        // destination is ready once isUploadComplete(context, token) is true. Returns 0 on failure
+        UploadToken copyFromAsync(Vulkan::Context& context, VkCommandPool commandPool, VkQueue queue, const void* srcData, VkDeviceSize amount, VkDeviceSize dstOffset);
+
         bool copyFromAndFlush(Vulkan::Context& context,
             VkCommandPool commandPool,
             VkQueue queue,
@@ -292,7 +329,8 @@ namespace Vulkan
             VkQueue queue,
             VkImage image,
             VkOffset3D offset,
-            VkExtent3D extent);
+            VkExtent3D extent,
+            VkDeviceSize bufferOffset = 0);
 
 
     private:
@@ -300,6 +338,28 @@ namespace Vulkan
     };
     typedef std::shared_ptr<BufferDescriptor> BufferDescriptorPtr;
 
+    // a buffer placed directly on top of application memory through VK_EXT_external_memory_host. The memory is owned by
+    // the application - _owner is held on to until the buffer is destroyed, so the allocation can't go away underneath it
+    struct ImportedBufferDescriptor : public BufferDescriptor
+    {
+        VkDevice _device;
+        VkDeviceMemory _importedMemory;
+        std::shared_ptr<const void> _owner;
+
+        ImportedBufferDescriptor()
+            :_device(VK_NULL_HANDLE)
+            , _importedMemory(VK_NULL_HANDLE)
+        {
+        }
+
+        virtual ~ImportedBufferDescriptor() {
+            destroy();
+        }
+
+        void destroy() override;
+        void destroy(Vulkan::Context& context) override;
+    };
+
     struct Context;
     struct PersistentBuffer : public Buffer
     {
@@ -331,26 +391,101 @@ namespace Vulkan
         bool copyFrom(unsigned int frameIndex, const void* srcData, VkDeviceSize amount, VkDeviceSize dstOffset = UINT64_MAX);
         bool copyFromAndFlush(Vulkan::Context& context, unsigned int frameIndex, const void* srcData, VkDeviceSize amount, VkDeviceSize dstOffset = UINT64_MAX);
         void destroy() override;
+        void destroy(Vulkan::Context& context);
 
     };
     typedef std::shared_ptr<PersistentBuffer> PersistentBufferPtr;
 
+    struct StagingAllocation
+    {
+        BufferDescriptor* _buffer;
+        VkDeviceSize _offset;
+        VkDeviceSize _size;
+        void* _mappedData;
+        unsigned int _segment;
+
+        StagingAllocation()
+            :_buffer(nullptr)
+            , _offset(0)
+            , _size(0)
+            , _mappedData(nullptr)
+            , _segment(0) {}
+    };
+
+    // host visible staging memory split into one or more ring buffers (segments). An allocation stays in use until
+    // the upload it was committed with has completed, so writers can keep going while earlier transfers are in flight.
+    // When no segment has room a new one is added instead of recreating the existing ones
+    struct StagingRing
+    {
+        struct Range
+        {
+            UploadToken _token;
+            bool _committed;
+            VkDeviceSize _begin;
+            VkDeviceSize _end;
+        };
+
+        struct Segment
+        {
+            BufferDescriptor _buffer;
+            VmaAllocationInfo _allocInfo;
+            VkDeviceSize _head;
+            std::deque<Range> _inFlight;
+
+            Segment()
+                :_head(0) {}
+        };
+
+        std::vector<std::unique_ptr<Segment>> _segments;
+        VkDeviceSize _segmentSize;
+
+        StagingRing()
+            :_segmentSize(0) {}
+
+        bool allocate(Vulkan::Context& context, VkDeviceSize size, VkDeviceSize alignment, StagingAllocation& result);
+        // hand the allocation back to the ring once the upload identified by token is done. Use 0 if the copy has already completed
+        void commit(const StagingAllocation& allocation, UploadToken token);
+        void retire(Vulkan::Context& context);
+        VkDeviceSize capacity() const;
+        void destroy();
+    };
+
     struct ImageDescriptor
     {
         VkImage _image;
         VmaAllocation _memory;
         unsigned int _size;
         void* _mappedData;
+        VkFormat _format;
+        VkImageUsageFlags _usage;
+        VkExtent3D _extent;
+        unsigned int _mipLevels;
+        unsigned int _arrayLayers;
+        // the layout each subresource was last transitioned to, at arrayLayer * _mipLevels + mipLevel. Kept up to date by
+        // the transitions that take an ImageDescriptor rather than a VkImage. Empty for images createImage didn't make
+        std::vector<VkImageLayout> _layouts;
 
         ImageDescriptor()
             :_image(VK_NULL_HANDLE)
             , _size(0)
-            , _mappedData(nullptr) {}
+            , _mappedData(nullptr)
+            , _format(VK_FORMAT_UNDEFINED)
+            , _usage(0)
+            , _extent{ 0, 0, 0 }
+            , _mipLevels(0)
+            , _arrayLayers(0) {}
 
         void destroy();
+        // like destroy, but the image is only released once the gpu can no longer be using it
+        void destroy(Vulkan::Context& context);
 
         void* map();
         void unmap();
+
+        VkImageLayout layout(uint32_t mipLevel = 0, uint32_t arrayLayer = 0) const;
+        // true when every subresource is in the same layout
+        bool hasUniformLayout() const;
+        void setLayout(VkImageLayout layout, uint32_t baseMipLevel = 0, uint32_t levelCount = VK_REMAINING_MIP_LEVELS, uint32_t baseArrayLayer = 0, uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS);
     };
     
     struct Mesh;
@@ -386,6 +521,11 @@ namespace Vulkan
             _instanceBuffer = instanceBuffer;
         }
 
+        // same as above, but the buffer being replaced is kept alive until the frames and uploads submitted so far are done with it
+        void setVertexBuffer(Context& context, BufferPtr vertexBuffer);
+        void setIndexBuffer(Context& context, BufferPtr indexBuffer);
+        void setInstanceBuffer(Context& context, BufferPtr instanceBuffer);
+
         Mesh()
             :_numIndices(0)
             ,_userData(nullptr)
@@ -529,6 +669,7 @@ namespace Vulkan
     };
     typedef std::shared_ptr<EffectDescriptor> EffectDescriptorPtr;
 
+    // the library doesn't create these any more, see _fenceCommandBufferPairs
     struct FenceCommandBufferPair
     {
         VkFence _fence;
@@ -537,6 +678,195 @@ namespace Vulkan
 
     };
 
+    struct PooledCommandBuffer
+    {
+        VkCommandBuffer _buffer;
+        VkCommandPool _pool;
+    };
+
+    // gathers image barriers and records them with a single barrier call. With synchronization2 every barrier keeps its
+    // own stage masks, otherwise the stages of all of them are combined. Barriers in one call aren't ordered against
+    // each other, so flush before adding a second transition of the same subresources
+    struct BarrierBatch
+    {
+        // access and stage masks are derived from the layouts, as seen by a queue with queueFlags
+        void transitionImage(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, unsigned int queueFlags, uint32_t baseMipLevel = 0, uint32_t levelCount = VK_REMAINING_MIP_LEVELS, uint32_t baseArrayLayer = 0, uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS);
+        // transitions from the layouts image tracks, one barrier per range of subresources sharing a layout, and records
+        // newLayout in image. Subresources already in a read only newLayout get no barrier at all. image has to stay where
+        // it is until keepLayouts or restoreLayouts is called
+        void transitionImage(ImageDescriptor& image, VkImageLayout newLayout, unsigned int queueFlags, uint32_t baseMipLevel = 0, uint32_t levelCount = VK_REMAINING_MIP_LEVELS);
+        void addImageBarrier(const VkImageMemoryBarrier& barrier, VkPipelineStageFlags srcStage, VkPipelineStageFlags dstStage);
+        bool references(VkImage image) const;
+        // records every gathered barrier into commandBuffer, and empties the batch
+        void flush(Context& context, VkCommandBuffer commandBuffer);
+        void clear();
+        // tracked layouts change as the barriers are gathered. rememberLayouts saves the ones image had before the first
+        // change, restoreLayouts puts them back when what the barriers were recorded into isn't submitted after all, and
+        // keepLayouts forgets them once it is
+        void rememberLayouts(ImageDescriptor& image);
+        void restoreLayouts();
+        void keepLayouts();
+
+        inline bool empty() const { return _imageBarriers.empty(); }
+        inline size_t size() const { return _imageBarriers.size(); }
+
+    private:
+        struct RememberedLayouts
+        {
+            ImageDescriptor* _image;
+            std::vector<VkImageLayout> _layouts;
+        };
+
+        std::vector<VkImageMemoryBarrier> _imageBarriers;
+        std::vector<VkPipelineStageFlags> _srcStages;
+        std::vector<VkPipelineStageFlags> _dstStages;
+        std::vector<RememberedLayouts> _rememberedLayouts;
+    };
+
+    struct PendingUpload
+    {
+        UploadToken _token;
+        VkFence _fence;
+        VkCommandBuffer _buffer;
+        VkCommandPool _pool;
+        BufferPtr _stagingBuffer; // kept alive until the gpu is done reading from it
+
+        // set when the upload ran on another queue family, and ownership was handed over with a second submission
+        VkCommandBuffer _acquireBuffer;
+        VkCommandPool _acquirePool;
+        VkSemaphore _semaphore;
+        // set when images the owner queue was using were first released by a submission on it, also from _acquirePool.
+        // _releaseSemaphore links it to the upload when there are no timeline semaphores
+        VkCommandBuffer _releaseBuffer;
+        VkSemaphore _releaseSemaphore;
+
+        // with timeline semaphores the upload is done once _timeline reaches _timelineValue, and _fence isn't used
+        VkSemaphore _timeline;
+        uint64_t _timelineValue;
+    };
+
+    // run once every frame submitted and every upload made before it was queued has finished on the gpu
+    struct DeferredDestruction
+    {
+        uint64_t _frameNumber;
+        UploadToken _uploadToken;
+        uint64_t _graphicsTimelineValue; // everything submitted to the graphics queue before it, when there are timelines
+        std::function<void()> _destroy;
+    };
+
+    // cpu time from vkAcquireNextImageKHR returning to vkQueuePresentKHR returning
+    struct PresentLatencyStats
+    {
+        double _lastMilliseconds;
+        double _averageMilliseconds; // moving average over roughly the last 64 frames
+        double _maxMilliseconds; // over the last complete window of 64 frames, or the frames so far until there is one
+        double _windowMaxMilliseconds; // over the window in progress
+        uint64_t _numFrames;
+
+        PresentLatencyStats()
+            :_lastMilliseconds(0.0)
+            , _averageMilliseconds(0.0)
+            , _maxMilliseconds(0.0)
+            , _windowMaxMilliseconds(0.0)
+            , _numFrames(0)
+        {
+        }
+    };
+
+    struct FramePacerStats
+    {
+        double _lastFrameMilliseconds;
+        double _averageFrameMilliseconds;
+        // frame time minus the target frame time, averaged as an absolute value
+        double _averageErrorMilliseconds;
+        double _maxErrorMilliseconds;
+        // time beginFrame spent waiting for the gpu to free the frame slot
+        double _averageGpuWaitMilliseconds;
+        // gpu time per frame, from the timestamps written around each frame. Without those, the time between gpu completions
+        // of consecutive frames, which can only be measured while beginFrame is waiting on the gpu
+        double _averageGpuFrameMilliseconds;
+        uint64_t _numFrames;
+        uint64_t _missedFrames; // frames that started more than a frame late, and restarted the schedule
+
+        FramePacerStats()
+            :_lastFrameMilliseconds(0.0)
+            , _averageFrameMilliseconds(0.0)
+            , _averageErrorMilliseconds(0.0)
+            , _maxErrorMilliseconds(0.0)
+            , _averageGpuWaitMilliseconds(0.0)
+            , _averageGpuFrameMilliseconds(0.0)
+            , _numFrames(0)
+            , _missedFrames(0)
+        {
+        }
+    };
+
+    // holds beginFrame back so frames start at a steady rate. Most of the wait is slept, and the last part - at least
+    // _minSpinMilliseconds, more if the os has been waking us up late - is spun, as sleeping alone is too coarse.
+    // The pacer runs straight after the wait for the frame slot, and is given the gpu time of the frame that last used the
+    // slot when the graphics queue has timestamps. Otherwise waits that block return as the gpu finishes a frame, and the
+    // time between those completions is the gpu's frame time. When that is longer than the target, deadlines are
+    // spaced by the gpu's frame time instead, so frames start as the gpu frees their slot
+    struct FramePacer
+    {
+        double _targetFramesPerSecond; // 0 turns pacing off
+        double _minSpinMilliseconds;
+
+        FramePacer();
+
+        // gpuFrameMilliseconds is negative when the frame's gpu time wasn't measured
+        void pace(double gpuWaitMilliseconds, double gpuFrameMilliseconds = -1.0);
+        void reset();
+        const FramePacerStats& stats() const { return _stats; }
+
+    private:
+        void waitUntil(std::chrono::steady_clock::time_point deadline);
+
+        std::chrono::steady_clock::time_point _nextFrame;
+        std::chrono::steady_clock::time_point _lastFrame;
+        std::chrono::steady_clock::time_point _lastGpuCompletion; // only meaningful while _gpuBound
+        bool _gpuBound; // the last wait for a frame slot blocked
+        double _sleepOvershootMilliseconds; // moving average of how late the os wakes us up
+        bool _started;
+        FramePacerStats _stats;
+    };
+
+    // a Vulkan 1.2 timeline semaphore counting the submissions made to one queue. Whether a buffer can be written directly,
+    // and when deferred destructions run, is judged from the graphics queue's one. Work submitted to the graphics queue
+    // outside endFrame should signal it at _lastSignaled + 1 and store that back, or it isn't waited for. Without timeline
+    // semaphores only frames submitted through beginFrame/endFrame are tracked
+    struct QueueTimeline
+    {
+        VkQueue _queue;
+        VkSemaphore _semaphore;
+        uint64_t _lastSignaled;
+    };
+
+    struct SubmittedFrame
+    {
+        uint64_t _frameNumber;
+        unsigned int _frameSlot;
+        uint64_t _timelineValue;
+    };
+
+    // receives the data of a finished readback. data is only valid for the duration of the call
+    typedef std::function<void(const void* data, VkDeviceSize size)> ReadbackCallback;
+
+    struct PendingReadback
+    {
+        UploadToken _token;
+        BufferDescriptorPtr _buffer;
+        VkDeviceSize _size;
+        ReadbackCallback _callback;
+    };
+
+    // requested by captureSwapChainImage, and recorded into the next frame endFrame submits
+    struct SwapChainCapture
+    {
+        VkImageLayout _layout; // the layout the frame's command buffers leave the swapchain image in
+        ReadbackCallback _callback;
+    };
+
     struct Context
     {
         VkInstance _instance;
@@ -544,6 +874,20 @@ namespace Vulkan
         VkDevice _device;
         VkPhysicalDeviceProperties _deviceProperties;
         VkPhysicalDeviceFeatures _physicalDeviceFeatures;
+        // UMA or resizable BAR. Buffers the gpu reads from are then placed in device local memory, and vertex and index
+        // data is written straight into it instead of going through staging. Can be cleared to force the staging path
+        bool _hasHostVisibleDeviceLocalMemory;
+        // VK_EXT_host_image_copy. Images created with pixels are then written from host memory without staging or command buffers
+        bool _hasHostImageCopy;
+        std::vector<VkImageLayout> _hostImageCopyDstLayouts;
+        // VK_EXT_external_memory_host. Application allocations can then be used as buffers without copying them
+        bool _hasExternalMemoryHost;
+        VkDeviceSize _minImportedHostPointerAlignment;
+        // Vulkan 1.2 timeline semaphores. Every queue then has one, and frames, uploads and readbacks signal it instead of
+        // using fences. _fences are only used without them
+        bool _hasTimelineSemaphore;
+        bool _hasSynchronization2;
+        std::vector<QueueTimeline> _timelines;
         
         struct Queue
         {
@@ -586,17 +930,44 @@ namespace Vulkan
         
         std::vector<VkCommandPool> _commandPools;
 
-        std::vector<VkSemaphore> _renderFinishedSemaphores;
-        std::vector<VkSemaphore> _imageAvailableSemaphores;
-        std::vector<VkFence> _fences;
+        std::vector<VkSemaphore> _renderFinishedSemaphores; // one per swapchain image, as presenting holds on to it until the image comes back
+        std::vector<VkSemaphore> _imageAvailableSemaphores; // one per frame in flight
+        std::vector<VkFence> _fences; // one per frame in flight
         
+        // deprecated - the library tracks its submissions in _pendingUploads. Pairs added here are still reclaimed by
+        // checkForFinishedPairCommandBufferBuffers
         std::vector<FenceCommandBufferPair> _fenceCommandBufferPairs;
+        std::vector<VkFence> _freeFences; // unsignalled, ready for the next one-off submission
+        std::vector<PooledCommandBuffer> _freeCommandBuffers; // one-off command buffers from _commandPools, ready to be begun again
+        BarrierBatch _pendingTransitions; // queued by queueImageTransition, see flushImageTransitions
+        std::vector<PendingUpload> _pendingUploads;
+        UploadToken _lastUploadToken;
+        StagingRing _stagingRing;
+        std::vector<PendingReadback> _pendingReadbacks;
+        std::vector<BufferDescriptorPtr> _readbackBuffers; // host cached buffers waiting to be reused
+        std::vector<SwapChainCapture> _swapChainCaptures;
 
         VkPipelineCache _pipelineCache;
         VkRenderPass _renderPass;
 
-        unsigned int _numInflightFrames;
+        unsigned int _numInflightFrames; // frames the cpu may run ahead of the gpu, independent of the swapchain image count. 0, the default, means one per image
         unsigned int _currentFrame;
+        unsigned int _currentImageIndex; // swapchain image acquired by beginFrame
+        uint64_t _frameNumber; // counts frames submitted by endFrame
+        std::vector<VkFence> _imagesInFlight; // fence of the frame last rendering to each swapchain image
+        std::vector<uint64_t> _frameTimelineValues; // graphics timeline value of the last frame submitted in each slot
+        std::vector<uint64_t> _imageTimelineValues; // graphics timeline value of the frame last rendering to each swapchain image
+        std::deque<SubmittedFrame> _submittedFrames; // frames that may still be running on the gpu
+        VkPresentModeKHR _presentMode; // chosen by createSwapChain from AppDescriptor::_presentPolicy
+        std::chrono::steady_clock::time_point _acquireTime;
+        PresentLatencyStats _presentLatency;
+        std::deque<DeferredDestruction> _deferredDestructions;
+        FramePacer _framePacer;
+        // two timestamps per frame slot, written around each frame's submission for _framePacer. VK_NULL_HANDLE when the
+        // graphics queue doesn't have timestamps
+        VkQueryPool _frameTimestamps;
+        std::vector<VkCommandBuffer> _frameTimestampCommands; // per slot, the one writing the first timestamp, then the one writing the second
+        std::vector<bool> _frameTimestampsWritten; // per slot, whether the last frame submitted in it wrote its timestamps
         std::vector<EffectDescriptorPtr> _potentialEffects;
         std::vector<EffectDescriptorPtr> _frameReadyEffects;
 
@@ -609,8 +980,9 @@ namespace Vulkan
 
     };
 
-    
-    bool initializeIndexAndVertexBuffers(AppDescriptor& appDesc, 
+    struct TransferBatch;
+
+    bool initializeIndexAndVertexBuffers(AppDescriptor& appDesc,
         Context& context,
         std::vector<unsigned char>& vertexData, 
         std::vector<unsigned char>& indexData, 
@@ -622,10 +994,142 @@ namespace Vulkan
     BufferDescriptorPtr createIndexOrVertexBufferAndCopyData(Context& context, const void* srcData, VkDeviceSize bufferSize, BufferType type);
     void copyDataToIndexOrVertexBuffer(Context& context, const void* srcData, VkDeviceSize bufferSize, BufferDescriptorPtr dstBuffer);
 
+    // batched versions - the copies are recorded into batch, and are done once the batch has been submitted
+    bool initializeIndexAndVertexBuffers(AppDescriptor& appDesc,
+        Context& context,
+        TransferBatch& batch,
+        std::vector<unsigned char>& vertexData,
+        std::vector<unsigned char>& indexData,
+        void* userData,
+        bool alwaysReallocate,
+        Vulkan::Mesh& result);
+    BufferDescriptorPtr createIndexOrVertexBufferAndCopyData(Context& context, TransferBatch& batch, const void* srcData, VkDeviceSize bufferSize, BufferType type);
+    bool copyDataToIndexOrVertexBuffer(Context& context, TransferBatch& batch, const void* srcData, VkDeviceSize bufferSize, BufferDescriptorPtr dstBuffer);
+
+    // a compressed piece of buffer data that expands to _uncompressedSize bytes at _dstOffset. Chunks are decompressed in
+    // parallel, so they should be reasonably sized (a few hundred KB to a few MB) and can't be larger than the staging buffer
+    struct CompressedChunk
+    {
+        const void* _data;
+        size_t _compressedSize;
+        VkDeviceSize _uncompressedSize;
+        VkDeviceSize _dstOffset;
+    };
+    // decompresses srcSize bytes at src into exactly dstSize bytes at dst. Called from several threads at once
+    typedef std::function<bool(const void* src, size_t srcSize, void* dst, size_t dstSize)> DecompressFunction;
+
+    // decompresses the chunks on the library's worker threads, and records the copies into batch. dst is written directly
+    // when it is host visible and the gpu can't be using it. Otherwise the data goes through staging a few tens of MB at a
+    // time, with the batch flushed in between, so staging use stays bounded however large dst is. On failure the batch may
+    // hold partial copies and should be thrown away
+    bool decompressToBuffer(Context& context, TransferBatch& batch, BufferDescriptor& dst, const std::vector<CompressedChunk>& chunks, DecompressFunction decompress);
+    BufferDescriptorPtr createIndexOrVertexBufferFromCompressedData(Context& context, const std::vector<CompressedChunk>& chunks, DecompressFunction decompress, BufferType type);
+    BufferDescriptorPtr createIndexOrVertexBufferFromCompressedData(Context& context, TransferBatch& batch, const std::vector<CompressedChunk>& chunks, DecompressFunction decompress, BufferType type);
+
+    // a span of bytes in vertex or index data that changed since the last upload
+    struct DirtyRange
+    {
+        VkDeviceSize _offset;
+        VkDeviceSize _size;
+
+        DirtyRange()
+            :_offset(0)
+            , _size(0)
+        {
+        }
+
+        DirtyRange(VkDeviceSize offset, VkDeviceSize size)
+            :_offset(offset)
+            , _size(size)
+        {
+        }
+    };
+
+    // the data that was last uploaded for a mesh, used to find out what changed when the caller doesn't track it
+    struct MeshShadowCopy
+    {
+        std::vector<unsigned char> _vertexData;
+        std::vector<unsigned char> _indexData;
+    };
+
+    // uploads only the dirty ranges of vertexData and indexData into the buffers the mesh already has. Buffers that are
+    // missing or too small are (re)created and uploaded in full, and the old ones released once the gpu is done with them.
+    // Empty data leaves that buffer alone. Mapped buffers are only written directly while no graphics work in flight can
+    // be reading them (see QueueTimeline), otherwise the copy is ordered after that work on the owner queue. The overloads
+    // without a batch wait for the copies to finish
+    bool updateIndexAndVertexBuffers(Context& context,
+        const std::vector<unsigned char>& vertexData,
+        const std::vector<DirtyRange>& dirtyVertexRanges,
+        const std::vector<unsigned char>& indexData,
+        const std::vector<DirtyRange>& dirtyIndexRanges,
+        Vulkan::Mesh& result);
+    bool updateIndexAndVertexBuffers(Context& context,
+        TransferBatch& batch,
+        const std::vector<unsigned char>& vertexData,
+        const std::vector<DirtyRange>& dirtyVertexRanges,
+        const std::vector<unsigned char>& indexData,
+        const std::vector<DirtyRange>& dirtyIndexRanges,
+        Vulkan::Mesh& result);
+
+    // same as above, but the dirty ranges are found by comparing against shadow, which is updated afterwards
+    bool updateIndexAndVertexBuffers(Context& context,
+        const std::vector<unsigned char>& vertexData,
+        const std::vector<unsigned char>& indexData,
+        MeshShadowCopy& shadow,
+        Vulkan::Mesh& result);
+    bool updateIndexAndVertexBuffers(Context& context,
+        TransferBatch& batch,
+        const std::vector<unsigned char>& vertexData,
+        const std::vector<unsigned char>& indexData,
+        MeshShadowCopy& shadow,
+        Vulkan::Mesh& result);
+
+    // same as the overloads without a batch, but the copies are submitted without waiting, for meshes updated every frame.
+    // token is the submission's, or 0 if everything was written directly. The gpu orders the copies against the frames around them
+    bool updateIndexAndVertexBuffersAsync(Context& context,
+        const std::vector<unsigned char>& vertexData,
+        const std::vector<DirtyRange>& dirtyVertexRanges,
+        const std::vector<unsigned char>& indexData,
+        const std::vector<DirtyRange>& dirtyIndexRanges,
+        Vulkan::Mesh& result,
+        UploadToken& token);
+    bool updateIndexAndVertexBuffersAsync(Context& context,
+        const std::vector<unsigned char>& vertexData,
+        const std::vector<unsigned char>& indexData,
+        MeshShadowCopy& shadow,
+        Vulkan::Mesh& result,
+        UploadToken& token);
+
+    enum class FrameStatus
+    {
+        Ready,              // go ahead and render
+        SwapChainRecreated, // the window changed. Effects using the swapchain render pass need to be recreated, and the frame skipped
+        Error
+    };
+
+    // the frame loop. beginFrame waits for the frame slot to be free, lets _framePacer hold the frame back, and acquires
+    // the next swapchain image into _currentImageIndex. Between the two, record the frame - updateUniforms adds effects to _frameReadyEffects.
+    // endFrame submits the _currentFrame command buffer of every effect in _frameReadyEffects and presents
+    FrameStatus beginFrame(AppDescriptor& appDesc, Context& context);
+    FrameStatus endFrame(AppDescriptor& appDesc, Context& context);
+    // frameNumber is a value of _frameNumber at the time the frame was submitted
+    bool isFrameComplete(Context& context, uint64_t frameNumber);
+    bool waitForFrame(Context& context, uint64_t frameNumber);
+    // destroy is called once the frames and uploads submitted so far are done with whatever it destroys. beginFrame
+    // processes the queue, and waitForAll finishes everything in it, for shutdown
+    void deferDestruction(Context& context, std::function<void()> destroy);
+    // holds on to buffer the same way, for buffers being replaced while the gpu may still read them. Anyone else sharing
+    // it keeps it alive for as long as they need
+    void deferRelease(Context& context, BufferPtr buffer);
+    void processDeferredDestructions(Context& context, bool waitForAll = false);
+
     // setup has several stages
     bool createInstance(AppDescriptor& appDesc, Context& context, bool enableValidationLayers);
     bool handleVulkanSetup(AppDescriptor& appDesc, Context& context);
     bool recreateSwapChain(AppDescriptor& appDesc, Context& context);
+    // waits for the device to go idle and releases what the library keeps running for the context - pending uploads,
+    // deferred destructions, the queue timelines and the worker threads. Call it before destroying the device
+    void cleanupContext(Context& context);
     void updateUniforms(AppDescriptor& appDesc, Context& context, uint32_t currentImage);
 
     // flagBits are OR'ed version of VkQueueFlagBits 
@@ -668,6 +1172,182 @@ namespace Vulkan
         return (unsigned int)context._queues[flagBits].size();
     }
 
+    // gathers buffer->buffer and buffer->image copies for any number of destinations into a single command buffer,
+    // which is submitted once. Source data is copied into the staging ring when it is added, so it can be released straight away
+    //
+    // When the batch runs on a different queue family than the one the resources are used on (ownerQueueFlagBits), ownership of
+    // every written buffer, and of every image transitioned out of the transfer layouts, is released at the end of the batch
+    // and acquired by a small submission on the owner queue, which waits for the transfer with a semaphore. Only the span
+    // written is handed over. Images that already have contents are first released by the owner queue, in a submission
+    // made ahead of the transfer, so the frames sampling them are done before they're overwritten, and the contents are kept
+    //
+    // Copies into buffers the owner queue may still be reading, or that already belong to the owner's family, are recorded
+    // into that second submission instead, behind a barrier that waits for the reads submitted before it
+    struct TransferBatch
+    {
+        TransferBatch();
+        ~TransferBatch();
+
+        bool begin(Vulkan::Context& context, unsigned int queueFlagBits = VK_QUEUE_TRANSFER_BIT, unsigned int ownerQueueFlagBits = VK_QUEUE_GRAPHICS_BIT);
+        // dst has to stay alive until the batch is submitted, which records the submission in its _lastUploadToken
+        bool copyToBuffer(BufferDescriptor& dst, const void* srcData, VkDeviceSize amount, VkDeviceSize dstOffset);
+        // records a copy of amount bytes into dst, and returns the staging memory to fill in before the batch is submitted.
+        // The memory can be written from any thread. Returns nullptr on failure
+        void* reserveBufferCopy(BufferDescriptor& dst, VkDeviceSize amount, VkDeviceSize dstOffset);
+        // region.bufferOffset is relative to srcData. The image must be in VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
+        bool copyToImage(VkImage image, const void* srcData, VkDeviceSize amount, VkDeviceSize alignment, const VkBufferImageCopy& region);
+        // same as copyToImage, but returns the staging memory to fill in before the batch is submitted. Returns nullptr on failure
+        void* reserveImageCopy(VkImage image, VkDeviceSize amount, VkDeviceSize alignment, const VkBufferImageCopy& region);
+        bool transitionImageLayout(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t baseMipLevel = 0, uint32_t levelCount = VK_REMAINING_MIP_LEVELS);
+        // same as BarrierBatch::transitionImage with an ImageDescriptor. When ownership is transferred, subresources the
+        // owner queue left outside the transfer layouts are released by the owner queue and acquired by the batch. The
+        // tracked layouts go back to what they were if the batch is destroyed or fails to submit
+        bool transitionImageLayout(ImageDescriptor& image, VkImageLayout newLayout, uint32_t baseMipLevel = 0, uint32_t levelCount = VK_REMAINING_MIP_LEVELS);
+        // needs a batch started with VK_QUEUE_GRAPHICS_BIT
+        bool blitImage(VkImage src, VkImageLayout srcLayout, VkImage dst, VkImageLayout dstLayout, const VkImageBlit& region, VkFilter filter);
+
+        // returns 0 if nothing was recorded or the submission failed
+        UploadToken submit();
+        bool submitAndWait();
+        // submits what has been recorded so far and carries on recording on the same queues. Keeps the staging memory
+        // held by very large uploads bounded, while the gpu copies one part as the next one is being written
+        bool flush();
+        // discards what has been recorded since the batch was begun or last flushed, and ends it
+        void abort();
+
+        inline bool isRecording() const { return _commandBuffer != VK_NULL_HANDLE; }
+        inline unsigned int numCommands() const { return _numCommands; }
+        inline VkExtent3D minGranularity() const { return _minGranularity; }
+        inline unsigned int queueFlags() const { return _queueFlags; }
+        inline bool transfersOwnership() const { return _familyIndex != _ownerFamilyIndex; }
+        // staging memory used by the copies recorded since the batch was started or last flushed
+        inline VkDeviceSize stagingBytes() const { return _stagingBytes; }
+
+    private:
+        void flushBufferRegions();
+        void flushBarriers(VkImage image);
+        void recordImageBarrier(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t baseMipLevel, uint32_t levelCount, uint32_t baseArrayLayer, uint32_t layerCount);
+        void recordImageAcquireFromOwner(VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t baseMipLevel, uint32_t levelCount, uint32_t baseArrayLayer, uint32_t layerCount);
+        VkCommandBuffer recordOwnerReleases();
+        void recordBufferReleases();
+        bool beginOwnerCommands();
+        VkCommandBuffer beginOwnerQueueWrites();
+        void recordWriteVisibility(VkCommandBuffer commandBuffer);
+        UploadToken submitRecorded(bool keepBufferOwnership);
+        UploadToken submitWithOwnershipTransfer();
+        void release(UploadToken token, bool keepBufferOwnership);
+
+        Vulkan::Context* _context;
+        VkQueue _queue;
+        VkCommandPool _commandPool;
+        VkCommandBuffer _commandBuffer;
+        unsigned int _queueFlags;
+        VkExtent3D _minGranularity;
+        unsigned int _numCommands;
+        unsigned int _requestedQueueFlags;
+        unsigned int _requestedOwnerQueueFlags;
+        VkDeviceSize _stagingBytes;
+
+        unsigned int _familyIndex;
+        unsigned int _ownerFamilyIndex;
+        unsigned int _ownerQueueFlags;
+        VkQueue _ownerQueue;
+        VkCommandPool _ownerCommandPool;
+        VkCommandBuffer _ownerCommandBuffer; // acquires, and copies into buffers the owner queue may be using. Submitted after the transfer
+        unsigned int _numOwnerCommands;
+        bool _ownerQueueWritesStarted;
+        VkPipelineStageFlags _acquireStages;
+        std::vector<VkBufferMemoryBarrier> _acquireBufferBarriers;
+        std::vector<VkImageMemoryBarrier> _acquireImageBarriers;
+        // images taken over from the owner queue, released by a submission there that runs ahead of the batch
+        std::vector<VkImageMemoryBarrier> _releaseImageBarriers;
+        VkPipelineStageFlags _releaseStages;
+        BarrierBatch _barriers; // transitions are held back until a command touches the image, or the batch ends
+
+        VkCommandBuffer _pendingCommandBuffer;
+        VkBuffer _pendingSrc;
+        VkBuffer _pendingDst;
+        std::vector<VkBufferCopy> _pendingRegions;
+        std::vector<StagingAllocation> _stagingAllocations;
+        // kept across flush() along with _acquireBufferBarriers, so buffers written in several parts are released once, by the final submission
+        std::vector<BufferDescriptor*> _writtenBuffers; // given the submission's token as their _lastUploadToken
+        std::vector<VkBuffer> _ownerQueueBuffers;
+    };
+
+    enum class UploadPriority
+    {
+        Critical = 0,   // needed this frame - always uploaded, regardless of the budget
+        VisibleSoon,
+        Background,
+        Count
+    };
+
+    // records an upload into the batch. Returns false on failure
+    typedef std::function<bool(TransferBatch& batch)> UploadFunction;
+    // called with the token of the submission the upload went into, or 0 if it failed
+    typedef std::function<void(UploadToken token)> UploadSubmittedFunction;
+
+    struct UploadSchedulerStats
+    {
+        unsigned int _queueDepth[(unsigned int)UploadPriority::Count];
+        VkDeviceSize _queuedBytes;
+        VkDeviceSize _bytesLastFrame;
+        double _millisecondsLastFrame;
+        // time from enqueue to submission
+        double _averageLatencyMilliseconds;
+        double _maxLatencyMilliseconds;
+
+        UploadSchedulerStats()
+            :_queuedBytes(0)
+            , _bytesLastFrame(0)
+            , _millisecondsLastFrame(0.0)
+            , _averageLatencyMilliseconds(0.0)
+            , _maxLatencyMilliseconds(0.0)
+        {
+            memset(_queueDepth, 0, sizeof(_queueDepth));
+        }
+    };
+
+    // queues uploads and spreads them over frames. processFrame records queued uploads in priority order until the byte or
+    // time budget for the frame is used up, and submits them as a single batch. At least one upload is processed every
+    // frame, so uploads larger than the budget still make progress. An upload that fails to record is dropped, and the
+    // ones recorded alongside it are put back to be retried the next frame.
+    // _millisecondsPerFrame is measured on the cpu, around the recording. The time the gpu then takes to copy the data
+    // isn't part of it - _bytesPerFrame is what bounds that
+    struct UploadScheduler
+    {
+        UploadScheduler();
+
+        VkDeviceSize _bytesPerFrame;
+        double _millisecondsPerFrame;
+
+        void enqueue(UploadPriority priority, VkDeviceSize bytes, UploadFunction upload, UploadSubmittedFunction submitted = nullptr);
+        // copies data, and splits it into pieces of at most _bytesPerFrame so it is spread over several frames
+        void enqueueBufferData(UploadPriority priority, BufferDescriptorPtr dst, const void* data, VkDeviceSize size, VkDeviceSize dstOffset, UploadSubmittedFunction submitted = nullptr);
+        // copies the pixels of the first mip level and uploads the whole image as one upload, as updataImageData with a batch
+        // would. The other levels are generated if generateMipMaps is set. image has to stay alive until submitted is called
+        void enqueueImageData(UploadPriority priority, Context& context, ImageDescriptor& image, const void* pixels, unsigned int pixelSize, VkImageLayout finalLayout, bool generateMipMaps = false, UploadSubmittedFunction submitted = nullptr);
+
+        // returns the token of this frame's submission, or 0 if nothing was submitted
+        UploadToken processFrame(Context& context);
+        inline const UploadSchedulerStats& stats() const { return _stats; }
+        inline bool empty() const { return numQueued() == 0; }
+
+    private:
+        struct QueuedUpload
+        {
+            VkDeviceSize _bytes;
+            UploadFunction _upload;
+            UploadSubmittedFunction _submitted;
+            std::chrono::steady_clock::time_point _enqueueTime;
+        };
+
+        unsigned int numQueued() const;
+        std::deque<QueuedUpload> _queues[(unsigned int)UploadPriority::Count];
+        UploadSchedulerStats _stats;
+        uint64_t _numSubmitted;
+    };
+
 
     bool resetCommandBuffer(Context& context, VkCommandBuffer & commandBuffers, unsigned int index);
     bool resetCommandBuffers(Context& context, std::vector<VkCommandBuffer>& commandBuffers);
@@ -683,6 +1363,11 @@ namespace Vulkan
     bool recreateEffectDescriptor(AppDescriptor& appDesc, Context& context, EffectDescriptorPtr effect);
 
     BufferDescriptorPtr createBuffer(Context& context, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties);
+    // makes a buffer out of size bytes at hostPointer without copying them, when VK_EXT_external_memory_host is available and
+    // the pointer can be imported. Otherwise the data is copied into a new device local buffer, and hostPointer can be released
+    // once this returns. owner is kept alive for as long as an imported buffer exists. The gpu reads the application memory
+    // directly, so it must not be changed while draws using the buffer are in flight
+    BufferDescriptorPtr importHostBuffer(Context& context, const void* hostPointer, VkDeviceSize size, VkBufferUsageFlags usage, std::shared_ptr<const void> owner = nullptr);
     PersistentBufferPtr lookupPersistentBuffer(Context& context, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, const std::string tag, int numBuffers = -1);
     PersistentBufferPtr createPersistentBuffer(Context& context, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, const std::string tag, int numBuffers = -1);
 
@@ -704,11 +1389,19 @@ namespace Vulkan
         VkImageTiling requiredTiling,
         VkImageUsageFlags requiredUsage,
         VkMemoryPropertyFlags memoryProperties,
-        Vulkan::ImageDescriptor& resultImage);
+        Vulkan::ImageDescriptor& resultImage,
+        unsigned int arrayLayers = 1,
+        VkImageCreateFlags createFlags = 0);
 
 
-    bool updataImageData(Vulkan::Context& context, Vulkan::ImageDescriptor& result, const void* pixels, unsigned int mipMapLevels, const unsigned int& pixelSize, const unsigned int& width, const unsigned int& height, const unsigned int& depth, VkImageLayout finalLayout);
+    // generateMipMaps fills in levels 1..mipMapLevels-1 from the uploaded level 0. This is done with blits when the format supports
+    // linear blitting and the batch is on a graphics queue, and otherwise with a box filter on the cpu (formats with 8 bit channels only)
+    bool canBlitMipMaps(Vulkan::Context& context, VkFormat format);
+    bool updataImageData(Vulkan::Context& context, Vulkan::ImageDescriptor& result, const void* pixels, unsigned int mipMapLevels, const unsigned int& pixelSize, const unsigned int& width, const unsigned int& height, const unsigned int& depth, VkImageLayout finalLayout, bool generateMipMaps = false);
+    bool updataImageData(Vulkan::Context& context, Vulkan::TransferBatch& batch, Vulkan::ImageDescriptor& result, const void* pixels, unsigned int mipMapLevels, const unsigned int& pixelSize, const unsigned int& width, const unsigned int& height, const unsigned int& depth, VkImageLayout finalLayout, bool generateMipMaps = false);
 
+    // without pixels, the transition to finalLayout is queued with queueImageTransition, and reaches the gpu with the next
+    // submission the library makes to the graphics queue
     bool createImage(Vulkan::Context& context,
         const void* pixels, 
         const unsigned int pixelSize, 
@@ -719,7 +1412,30 @@ namespace Vulkan
         VkFormat format, 
         ImageDescriptor & result, 
         unsigned int mipLevels,
-        VkImageLayout finalLayout);
+        VkImageLayout finalLayout,
+        bool generateMipMaps = false);
+    // the image is created straight away, but its contents are only valid once the batch has been submitted and completed.
+    // If recording fails, the image is destroyed and the batch aborted, along with anything else recorded into it
+    bool createImage(Vulkan::Context& context,
+        Vulkan::TransferBatch& batch,
+        const void* pixels,
+        const unsigned int pixelSize,
+        const unsigned int width,
+        const unsigned int height,
+        const unsigned int depth,
+        const unsigned int samplesPrPixels,
+        VkFormat format,
+        ImageDescriptor& result,
+        unsigned int mipLevels,
+        VkImageLayout finalLayout,
+        bool generateMipMaps = false);
+
+    // loads a KTX2 or DDS file (recognised by its contents), copying every mip level and array layer stored in the file straight
+    // from a memory mapping into the staging ring. Block compressed formats are uploaded as they are. Cube maps get
+    // VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT and 6 layers per cube. A failure after the image is created cleans up the same
+    // way as createImage with a batch
+    bool loadTexture(Vulkan::Context& context, Vulkan::TransferBatch& batch, const std::string& filename, ImageDescriptor& result, VkImageLayout finalLayout);
+    bool loadTexture(Vulkan::Context& context, const std::string& filename, ImageDescriptor& result, VkImageLayout finalLayout);
 
     bool createImageView(Vulkan::Context& context,
         VkImage image,
@@ -743,11 +1459,21 @@ namespace Vulkan
         VkImageLayout oldLayout,
         VkImageLayout newLayout,
         VkCommandBuffer commandBuffer);
+    // from the layouts image tracks, as seen by a graphics queue. They are recorded as changed straight away, so
+    // commandBuffer has to be submitted
+    bool transitionImageLayout(Vulkan::Context& context, ImageDescriptor& image, VkImageLayout newLayout, VkCommandBuffer commandBuffer);
 
+    // submitted on the graphics queue right away, together with any transitions queued before it
     bool transitionImageLayoutAndSubmit(Vulkan::Context & context,
                                VkImage image,
                                VkImageLayout oldLayout,
                                VkImageLayout newLayout);
+    // same, but from the layouts image tracks
+    bool transitionImageLayoutAndSubmit(Vulkan::Context& context, ImageDescriptor& image, VkImageLayout newLayout);
+    // queued with the other pending transitions, and only submitted by flushImageTransitions. Work recorded outside the
+    // library that uses the image has to be submitted after that
+    bool queueImageTransition(Vulkan::Context& context, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout);
+    bool queueImageTransition(Vulkan::Context& context, ImageDescriptor& image, VkImageLayout newLayout);
 
     bool createUniformBuffer(AppDescriptor& appDesc, Context& context, VkDeviceSize bufferSize, BufferDescriptor& result);
 
@@ -756,8 +1482,50 @@ namespace Vulkan
 
     std::vector<VkFence> createFences(VkDevice device, unsigned int count, VkFenceCreateFlags flags);
     VkFence createFence(VkDevice device, VkFenceCreateFlags flags);
+    VkSemaphore createSemaphore(VkDevice device);
+    VkSemaphore createTimelineSemaphore(VkDevice device, uint64_t initialValue);
+    QueueTimeline* getQueueTimeline(Context& context, VkQueue queue);
+    // deprecated - retireFinishedUploads does this job now. Non-blocking: reclaims finished _fenceCommandBufferPairs
+    // into the fence and command buffer pools, and retires finished uploads
     void checkForFinishedPairCommandBufferBuffers(Context& context);
 
+    // submits the transitions queued by queueImageTransition together, in one command buffer on the graphics
+    // queue. Called before anything else is submitted to the graphics queue, when a TransferBatch begins, and by endFrame
+    bool flushImageTransitions(Context& context);
+
+    // one-off submissions take their fences and command buffers from these pools, rather than creating new ones.
+    // Command buffers are only recycled if they came from one of _commandPools, which allow resetting single buffers
+    VkFence acquireFence(Context& context);
+    void recycleFences(Context& context, const std::vector<VkFence>& fences);
+    void recycleCommandBuffer(Context& context, VkCommandPool commandPool, VkCommandBuffer commandBuffer);
+
+    // async uploads. retireFinishedUploads is non-blocking and should be called once per frame
+    UploadToken submitUpload(Context& context, VkQueue queue, VkCommandPool commandPool, VkCommandBuffer commandBuffer, BufferPtr stagingBuffer);
+    bool isUploadComplete(Context& context, UploadToken token);
+    bool waitForUpload(Context& context, UploadToken token);
+    bool waitForUploads(Context& context);
+    void retireFinishedUploads(Context& context);
+
+    // async readbacks. The copy is submitted to the graphics queue, after everything that has already been submitted there,
+    // and the callback is called from processReadbacks once the gpu has finished it. Returns 0 on failure.
+    // processReadbacks is non-blocking and should be called once per frame
+    UploadToken readbackBuffer(Context& context, BufferDescriptor& src, VkDeviceSize srcOffset, VkDeviceSize size, ReadbackCallback callback);
+    // image is expected to be in layout, and is put back into it after the copy. The data is tightly packed
+    UploadToken readbackImage(Context& context, VkImage image, VkImageLayout layout, unsigned int pixelSize, VkOffset3D offset, VkExtent3D extent, ReadbackCallback callback, unsigned int mipLevel = 0, unsigned int arrayLayer = 0);
+    // same, in the layout image tracks for the subresource
+    UploadToken readbackImage(Context& context, ImageDescriptor& image, unsigned int pixelSize, VkOffset3D offset, VkExtent3D extent, ReadbackCallback callback, unsigned int mipLevel = 0, unsigned int arrayLayer = 0);
+    // copies the swapchain image the current frame renders to. endFrame records the copy into the frame's own submission,
+    // after the effects' command buffers and before the image is handed to presentation, and the callback gets it tightly
+    // packed in _surfaceFormat once the frame has finished. Returns false if _surfaceFormat can't be read back
+    bool captureSwapChainImage(Context& context, ReadbackCallback callback, VkImageLayout layout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR);
+    // copies a swapchain image in a submission of its own, so it sees what was submitted before the call and not the
+    // current frame's rendering. The image must be in VK_IMAGE_LAYOUT_PRESENT_SRC_KHR and not handed to presentation -
+    // captureSwapChainImage is the one to use for what a frame rendered
+    UploadToken readbackSwapChainImage(Context& context, unsigned int imageIndex, ReadbackCallback callback);
+    void processReadbacks(Context& context);
+
+    // per frame resources - uniform buffers, descriptor sets, command buffers - come in this number.
+    // Per image resources - image views, depth and msaa targets, framebuffers, render finished semaphores - follow _swapChainImages
     inline unsigned int getNumInflightFrames(Context& context) {
         return context._numInflightFrames == 0 ? (unsigned int)context._swapChainImages.size() : context._numInflightFrames;
     }